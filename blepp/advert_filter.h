@@ -0,0 +1,131 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_ADVERT_FILTER_H
+#define __INC_BLEPP_ADVERT_FILTER_H
+
+#include <vector>
+#include <string>
+#include <array>
+#include <functional>
+#include <unordered_map>
+#include <boost/optional.hpp>
+#include <blepp/lescan.h>
+
+namespace BLEPP
+{
+	///A description of the adverts a consumer is interested in. Within each
+	///criterion any of the listed values will do, and every criterion which
+	///is given must match. A subscription with no criteria matches everything.
+	struct Subscription
+	{
+		typedef uint32_t Id;
+
+		Id id=0;
+		std::vector<BLEAddress> addresses;         //Exact addresses, regardless of address type
+		std::vector<std::string> address_prefixes; //Leading bytes, e.g. "AC:23:3F"
+		std::vector<uint16_t> company_ids;         //From manufacturer specific data
+		std::vector<UUID> service_uuids;           //From UUID lists or service data, any width
+		boost::optional<int> min_rssi;             //dBm. Adverts without an RSSI fail this.
+	};
+
+	///Many subscriptions compiled in to a single matcher, which works on the 
+	///raw AD structures of an AdvertisingView, so rejecting an advert costs 
+	///a few hash lookups and no allocation. Addresses and prefixes, company
+	///IDs and UUIDs are each looked up in one hash table for all the 
+	///subscriptions, rather than each subscription being tried in turn.
+	class AdvertFilter
+	{
+		public:
+			///Matches nothing.
+			AdvertFilter() = default;
+
+			///Throws std::invalid_argument on a malformed address prefix.
+			explicit AdvertFilter(const std::vector<Subscription>& subscriptions);
+
+			///Find the subscriptions which the advert satisfies. Their ids are
+			///put in matches, in the order the subscriptions were given.
+			///matches is also used as scratch space, so keep it around
+			///between calls to avoid allocating.
+			bool match(const AdvertisingView& advert, std::vector<Subscription::Id>& matches) const;
+
+			size_t size() const;
+
+		private:
+			enum Criterion: uint32_t
+			{
+				Address = 1,
+				Company = 2,
+				Service = 4,
+				criterion_bits = 3,
+			};
+
+			typedef std::array<uint8_t, 12> UUIDStem;
+			struct StemHash
+			{
+				size_t operator()(const UUIDStem&) const;
+			};
+			typedef std::unordered_map<uint32_t, std::vector<uint32_t>> ShortUUIDMap;
+
+			std::vector<Subscription::Id> ids;
+			std::vector<uint32_t> required;       //Criterion bits needed by each subscription
+			std::vector<int> min_rssi;            //Per subscription
+			std::vector<uint32_t> unkeyed;        //Subscriptions with no hashed criteria
+			int lowest_min_rssi=-128;             //Nothing quieter than this can match
+			bool address_required=false;          //By every subscription
+
+			std::vector<int> prefix_lengths;      //Distinct lengths in bytes, 6 for exact matches
+			std::unordered_map<uint64_t, std::vector<uint32_t>> address_map;
+			std::unordered_map<uint16_t, std::vector<uint32_t>> company_map;
+
+			//UUIDs are stored in their 128 bit form. Those built on the Bluetooth
+			//base UUID are keyed on the 32 bit value, and the rest on the full UUID.
+			std::unordered_map<UUIDStem, ShortUUIDMap, StemHash> uuid_map;
+
+			void lookup_uuid(const uint8_t* uuid128, std::vector<uint32_t>& hits) const;
+			void lookup_uuid(uint32_t short_uuid, std::vector<uint32_t>& hits) const;
+	};
+
+	///Pass on only the adverts which match a filter, along with the matching
+	///subscription ids, and count those which don't.
+	class AdvertFilterSink: public AdvertisingSink
+	{
+		public:
+			typedef std::function<void(const AdvertisingView&, const std::vector<Subscription::Id>&)> Callback;
+
+			AdvertFilterSink(const AdvertFilter& filter, const Callback& callback);
+
+			void on_advertisement(const AdvertisingView&) override;
+
+			uint64_t accepted() const;
+			uint64_t rejected() const;
+
+		private:
+			const AdvertFilter& filter;
+			Callback callback;
+			std::vector<Subscription::Id> matches;
+			uint64_t accepted_count=0;
+			uint64_t rejected_count=0;
+	};
+}
+
+#endif
@@ -0,0 +1,136 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_ADVERT_GENERATOR_H
+#define __INC_BLEPP_ADVERT_GENERATOR_H
+
+#include <cstdint>
+#include <vector>
+#include <queue>
+#include <random>
+#include <chrono>
+#include <blepp/hci_replay.h>
+
+namespace BLEPP
+{
+	///Simulates a crowd of advertising devices, for load testing the
+	///scanner, filters and trackers at densities no capture covers. The
+	///output is LE Advertising Report events, exactly as an adapter would
+	///deliver them, in order of simulated time.
+	///
+	///Either pull packets with next(), collect a stretch of them with
+	///generate() and play them with HCIReplay (e.g. in real time), or
+	///connect an HCIScanner to get_fd() and push them with feed().
+	///The same seed always produces the same sequence.
+	class AdvertGenerator
+	{
+		public:
+			struct Config
+			{
+				size_t devices = 1000;
+				
+				///Each device picks an interval in this range. Every advert
+				///is further delayed by 0-10ms, as the spec requires.
+				std::chrono::milliseconds min_interval{100};
+				std::chrono::milliseconds max_interval{1000};
+
+				///Probability of each device including each kind of data
+				///(alongside flags). Whatever doesn't fit in 31 bytes is left out.
+				double names = 0.3;
+				double uuids = 0.5;
+				double manufacturer_data = 0.7;
+
+				///Devices using private addresses, which change every
+				///rotation_period (if nonzero) at a random phase.
+				double random_addresses = 0.8;
+				std::chrono::seconds rotation_period{0};
+
+				///Each device has a mean RSSI spread uniformly over this range
+				///and each report adds gaussian noise.
+				int rssi_min = -95;
+				int rssi_max = -40;
+				double rssi_noise = 4;
+
+				std::uint32_t seed = 1;
+			};
+
+			AdvertGenerator();
+			explicit AdvertGenerator(const Config&);
+			~AdvertGenerator();
+			AdvertGenerator(const AdvertGenerator&) = delete;
+			AdvertGenerator& operator=(const AdvertGenerator&) = delete;
+
+			///Write the next report into packet, as read from an HCI socket,
+			///and return its simulated time.
+			std::chrono::microseconds next(std::vector<uint8_t>& packet);
+
+			///The next count reports, or all the reports until the given time.
+			std::vector<HCIReplay::Packet> generate(size_t count);
+			std::vector<HCIReplay::Packet> generate(std::chrono::microseconds until);
+
+			///Distinct addresses used so far, including rotated ones.
+			size_t addresses() const;
+			const Config& config() const;
+
+			///The end to read from.
+			int get_fd() const;
+
+			///Write up to max reports to the socket, without pacing. Returns
+			///the number written: fewer if the socket is full. Never blocks.
+			size_t feed(size_t max);
+
+		private:
+			struct Device
+			{
+				std::uint8_t address[6];
+				bool random;
+				bool connectable;
+				bool address_used;
+				std::int8_t rssi;
+				std::chrono::microseconds interval;
+				std::chrono::microseconds next_rotation;
+				std::uint8_t payload_length;
+				std::uint8_t payload[31];
+			};
+
+			struct Due
+			{
+				std::chrono::microseconds when;
+				std::uint32_t device;
+				bool operator<(const Due& d) const { return when > d.when; } //Earliest first
+			};
+
+			Config cfg;
+			std::mt19937 rng;
+			std::normal_distribution<double> noise;
+			std::vector<Device> devices;
+			std::priority_queue<Due> schedule;
+			size_t num_addresses=0;
+
+			int fds[2];   //Read end, write end
+			std::vector<uint8_t> pending;
+
+			void new_address(Device&);
+	};
+}
+
+#endif
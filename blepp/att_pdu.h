@@ -165,6 +165,51 @@ namespace BLEPP
 			}
 	};
 
+	/* Response to prep_write_req, 3.F.3.4.6.2. The server echoes the segment. */
+	class PDUPrepareWriteResponse: public PDUResponse
+	{
+		public:
+			PDUPrepareWriteResponse(const PDUResponse& p_)
+			:PDUResponse(p_)
+			{
+				type_check(ATT_OP_PREP_WRITE_RESP);
+
+				if(length < 5)
+					error<std::runtime_error>("Invalid packet length for PDUPrepareWriteResponse");
+			}
+
+			uint16_t handle() const
+			{
+				return uint16(1);
+			}
+
+			uint16_t offset() const
+			{
+				return uint16(3);
+			}
+
+			std::pair<const uint8_t*, const uint8_t*> value() const
+			{
+				return std::make_pair(data + 5, data + length);
+			}
+	};
+
+	/* Response to read_blob_req, 3.F.3.4.4.6 */
+	class PDUReadBlobResponse: public PDUResponse
+	{
+		public:
+			PDUReadBlobResponse(const PDUResponse& p_)
+			:PDUResponse(p_)
+			{
+				type_check(ATT_OP_READ_BLOB_RESP);
+			}
+
+			std::pair<const uint8_t*, const uint8_t*> value() const
+			{
+				return std::make_pair(data + 1, data + length);
+			}
+	};
+
 
 
 	/* Response to read_by_type, 3.F.3.4.4.2 */
@@ -0,0 +1,112 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_BLEADDRESS_H
+#define __INC_BLEPP_BLEADDRESS_H
+
+#include <cstdint>
+#include <cstddef>
+#include <string>
+#include <ostream>
+#include <functional>
+
+namespace BLEPP
+{
+	///LE address type as reported by the HCI (4.0/2/E.7.7.65.2)
+	enum class AddressType: std::uint8_t
+	{
+		Public = 0x00,
+		Random = 0x01,
+	};
+
+	///A 48 bit Bluetooth device address, along with its type. This is a 
+	///plain value, so it's cheap to copy, compare and hash. It's only 
+	///formatted as a string when someone asks for one.
+	///
+	///The bytes are stored little endian, which is the order used by the HCI,
+	///by L2CAP and by bdaddr_t, so the printed form is the bytes reversed.
+	class BLEAddress
+	{
+		public:
+			std::uint8_t bytes[6];
+			AddressType type;
+
+			BLEAddress()
+			:bytes{0,0,0,0,0,0}, type(AddressType::Public)
+			{
+			}
+
+			///Construct from 6 little endian bytes, as received from the HCI.
+			BLEAddress(const std::uint8_t* little_endian, AddressType t = AddressType::Public);
+
+			///Parse the usual aa:bb:cc:dd:ee:ff form. Upper and lower case
+			///are both accepted. Throws std::invalid_argument on a bad string.
+			explicit BLEAddress(const std::string& address, AddressType t = AddressType::Public);
+
+			///Format as aa:bb:cc:dd:ee:ff
+			std::string str() const;
+
+			///The 48 bits of the address packed in the low bits of an integer,
+			///so that 0x112233445566 is 11:22:33:44:55:66. The type is not included.
+			std::uint64_t to_uint64() const;
+
+			bool is_random() const
+			{
+				return type == AddressType::Random;
+			}
+
+			std::size_t hash() const;
+
+			bool operator==(const BLEAddress& a) const
+			{
+				return type == a.type && to_uint64() == a.to_uint64();
+			}
+
+			bool operator!=(const BLEAddress& a) const
+			{
+				return !(*this == a);
+			}
+
+			bool operator<(const BLEAddress& a) const
+			{
+				if(to_uint64() != a.to_uint64())
+					return to_uint64() < a.to_uint64();
+				else
+					return type < a.type;
+			}
+	};
+
+	std::ostream& operator<<(std::ostream&, const BLEAddress&);
+}
+
+namespace std
+{
+	template<> struct hash<BLEPP::BLEAddress>
+	{
+		size_t operator()(const BLEPP::BLEAddress& a) const
+		{
+			return a.hash();
+		}
+	};
+}
+
+#endif
@@ -50,14 +50,22 @@ namespace BLEPP
 		BLEDevice(const int& sock_);
 
 		void send_read_request(std::uint16_t handle);
+		void send_read_blob_request(std::uint16_t handle, std::uint16_t offset);
 		void send_read_by_type(const bt_uuid_t& uuid, std::uint16_t start = 0x0001, std::uint16_t end=0xffff);
 		void send_find_information(std::uint16_t start = 0x0001, std::uint16_t end=0xffff);
 		void send_read_group_by_type(const bt_uuid_t& uuid, std::uint16_t start = 0x0001, std::uint16_t end=0xffff);
 		void send_write_request(std::uint16_t handle, const std::uint8_t* data, int length);
 		void send_write_request(std::uint16_t handle, std::uint16_t data);
 		void send_handle_value_confirmation();
+		void send_prepare_write_request(std::uint16_t handle, std::uint16_t offset, const std::uint8_t* data, int length);
+		void send_execute_write_request(std::uint8_t flags);
 		void send_write_command(std::uint16_t handle, const std::uint8_t* data, int length);
 		void send_write_command(std::uint16_t handle, std::uint16_t data);
+
+		///Send a write command without blocking. Returns false, having sent
+		///nothing, if the socket has no room for it.
+		bool try_send_write_command(std::uint16_t handle, const std::uint8_t* data, int length);
+		void send_mtu_request(std::uint16_t mtu);
 		void process_att_mtu_request(PDUResponse &req_pdu);
 		void process_att_mtu_response(PDUResponse &resp_pdu);
 		PDUResponse receive(std::uint8_t* buf, int max);
@@ -23,10 +23,13 @@
  */
 
 #include <vector>
+#include <deque>
 #include <stdexcept>
 #include <functional>
+#include <chrono>
 
 #include <blepp/logging.h>
+#include <blepp/bleaddress.h>
 #include <blepp/bledevice.h>
 #include <blepp/att_pdu.h>
 
@@ -140,6 +143,10 @@ namespace BLEPP
 		GetClientCharaceristicConfiguration,
 		AwaitingWriteResponse,
 		AwaitingReadResponse,
+		AwaitingMTUResponse,
+		AwaitingLongReadResponse,
+		AwaitingPrepareWriteResponse,
+		AwaitingExecuteWriteResponse,
 	};
 
 	static const int Waiting=-1;
@@ -180,6 +187,49 @@ namespace BLEPP
 	};
 
 
+	///The whole of a value which may have needed several requests to read.
+	struct LongReadResponse
+	{
+		uint16_t handle;
+		const std::vector<uint8_t>& value;
+
+		///Number of requests it took: one Read, then a Read Blob
+		///for every further MTU-1 bytes.
+		int round_trips;
+	};
+
+	///Outcome of a write made with Prepare Write and Execute Write.
+	struct LongWriteResponse
+	{
+		uint16_t handle;
+
+		///False if a reliable write found a segment echoed back wrongly
+		///and cancelled the whole write instead of executing it.
+		bool committed;
+
+		///Number of requests it took: one per segment, plus the Execute.
+		int round_trips;
+	};
+
+	///Summary of a stream of write commands once the last one is sent.
+	struct WriteStreamResponse
+	{
+		uint16_t handle;
+		size_t bytes;
+		int chunks;
+
+		///Number of times the socket was full and the stream had to wait.
+		int stalls;
+
+		///From the start until the kernel took the last chunk.
+		std::chrono::duration<double> elapsed;
+
+		double bytes_per_second() const
+		{
+			return elapsed.count() > 0 ? bytes / elapsed.count() : 0;
+		}
+	};
+
 	struct Characteristic
 	{	
 		private:
@@ -191,13 +241,19 @@ namespace BLEPP
 		:s(s_)
 		{}
 
-		void set_notify_and_indicate(bool , bool, WriteType type=WriteType::Request );
+		void set_notify_and_indicate(bool , bool, WriteType type=WriteType::Request, std::function<void()> cb=nullptr);
 		std::function<void(const PDUNotificationOrIndication&)> cb_notify_or_indicate;
 		std::function<void(const PDUReadResponse&)> cb_read;
+		std::function<void(const LongReadResponse&)> cb_long_read;
+		std::function<void(const LongWriteResponse&)> cb_long_write;
+		std::function<void(const WriteStreamResponse&)> cb_write_stream;
 
 		void write_request(const uint8_t* data, int length);
+		void long_write_request(const uint8_t* data, int length, bool reliable=false);
 		void write_command(const uint8_t* data, int length);
+		void write_command_stream(const uint8_t* data, size_t length);
 		void read_request();
+		void long_read_request();
 
 		// Shortcuts for writing values without explicitly using sizeof and pointer cast.
 		// Don't forget to explicitly cast when writing numbers!, e.g. write_request((uint16_t)3)
@@ -297,9 +353,59 @@ namespace BLEPP
 			int next_handle_to_read=-1;
 			uint16_t read_req_handle=-1;
 			int last_request=-1;
+			uint16_t requested_mtu=ATT_DEFAULT_MTU;
+			bool mtu_exchange_requested=false;
 			
 			std::vector<std::uint8_t> buf;
 
+			struct LongRead
+			{
+				uint16_t handle=0;
+				std::vector<std::uint8_t>* value=nullptr;
+				int round_trips=0;
+				std::function<void(const LongReadResponse&)> cb;
+			} long_read;
+			std::vector<std::uint8_t> long_read_buf;
+			void finish_long_read();
+
+			struct LongWrite
+			{
+				uint16_t handle=0;
+				std::vector<std::uint8_t> value;
+				size_t offset=0, segment=0;
+				bool reliable=false, cancelled=false;
+				int round_trips=0;
+				std::function<void(const LongWriteResponse&)> cb;
+			} long_write;
+			void finish_long_write();
+
+			//Operations waiting their turn, oldest first. Commands need not
+			//wait for the machine to be idle, only for what is ahead of them.
+			struct Operation
+			{
+				std::function<void()> run;
+				bool command;
+			};
+			std::deque<Operation> operations;
+			void submit(std::function<void()> op, bool command=false);
+			void run_queue(bool writable=false);
+
+			//Completion callbacks of the request in flight, if it has its own.
+			std::function<void()> write_cb;
+			std::function<void(const PDUReadResponse&)> read_cb;
+
+			struct WriteStream
+			{
+				bool active=false;
+				uint16_t handle=0;
+				std::vector<std::uint8_t> value;
+				size_t offset=0;
+				int chunks=0, stalls=0;
+				std::chrono::steady_clock::time_point start;
+				std::function<void(const WriteStreamResponse&)> cb;
+			} stream;
+			void pump_stream();
+
 
 			struct PrimaryServiceInfo
 			{
@@ -313,6 +419,7 @@ namespace BLEPP
 			void fail(Disconnect);
 			Characteristic* characteristic_of_handle(uint16_t handle);
 			void close_and_cleanup();
+			void io_changed();
 
 		public:
 
@@ -325,8 +432,17 @@ namespace BLEPP
 			std::function<void()> cb_find_characteristics = buggerall;
 			std::function<void()> cb_get_client_characteristic_configuration = buggerall;
 			std::function<void()> cb_write_response = buggerall;
+			std::function<void()> cb_mtu_exchanged = buggerall;
 			std::function<void(Characteristic&, const PDUNotificationOrIndication&)> cb_notify_or_indicate;
 			std::function<void(Characteristic&, const PDUReadResponse&)> cb_read;
+			std::function<void(Characteristic&, const LongReadResponse&)> cb_long_read;
+			std::function<void(Characteristic&, const LongWriteResponse&)> cb_long_write;
+			std::function<void(Characteristic&, const WriteStreamResponse&)> cb_write_stream;
+
+			///Called whenever socket() or wait_on_write() may have changed, so
+			///an event loop can update what it waits for without polling every
+			///machine. Reactor takes this over while the machine is registered.
+			std::function<void()> cb_io_changed;
 
 
 			BLEGATTStateMachine(size_t bufsize=128);
@@ -336,30 +452,117 @@ namespace BLEPP
 			void connect_blocking(const std::string& addres);
 			void connect_nonblocking(const std::string& addres);
 			void connect(const std::string& addresa, bool blocking, bool pubaddr = true, std::string device = "");
+
+			///Connect using a binary address. The public/random type is taken
+			///from the address, e.g. as reported by HCIScanner.
+			void connect_blocking(const BLEAddress& address);
+			void connect_nonblocking(const BLEAddress& address);
+			void connect(const BLEAddress& address, bool blocking, std::string device = "");
 			void close();
 
+			///Take over an ATT socket which is already connected, for
+			///example one end of a socketpair standing in for a device.
+			///The machine owns it from then on and cb_connected is called.
+			void connect(int fd);
+
 			int socket();
 		
 			bool wait_on_write();
+
+			bool is_streaming() const
+			{
+				return stream.active;
+			}
 			
 			bool is_idle()
 			{
-				return state == Idle;
+				return state == Idle && operations.empty();
 			}
+
+			///Number of operations queued behind the one in progress.
+			size_t queued() const
+			{
+				return operations.size();
+			}
+
+			///Call cb once everything queued before it has finished.
+			void queue_callback(std::function<void()> cb);
 			
-			void send_write_request(uint16_t handle, const uint8_t* data, int length);
+			//Requests may be made at any time while connected or connecting.
+			//ATT allows one request at a time, so they are queued and each one
+			//is sent when the response to the one before it arrives. Requests
+			//given their own callback report to that, and not to the shared
+			//cb_write_response or cb_read.
+			void send_write_request(uint16_t handle, const uint8_t* data, int length, std::function<void()> cb=nullptr);
+
+			///Commands need no response, so they go straight out even while
+			///a request is outstanding, unless others are queued before them.
 			void send_write_command(uint16_t handle, const uint8_t* data, int length);
-			void send_read_request(uint16_t handle);
+
+			///Write a value of up to 512 bytes, too long for a single Write
+			///Request. It is queued on the server with Prepare Write requests
+			///as large as the MTU allows, then committed with Execute Write.
+			///Every segment is checked against the server's echo of it. In
+			///reliable mode, a mismatch cancels the whole write, otherwise it
+			///is logged. cb, or else cb_long_write, gets the outcome.
+			void send_long_write_request(uint16_t handle, const uint8_t* data, int length, bool reliable=false, std::function<void(const LongWriteResponse&)> cb=nullptr);
+
+			///Send a buffer of any size as write commands of MTU-3 bytes,
+			///as fast as the link takes them. Writes never block: when the
+			///socket is full, wait_on_write() becomes true, and the stream
+			///carries on from write_and_process_next() once the socket is
+			///writable. Other requests and commands made meanwhile are held
+			///in the queue until then, and go ahead of the rest of the stream.
+			///The kernel only frees socket space as the controller reports
+			///its buffers sent, so this is paced by the controller. cb, or
+			///else cb_write_stream, gets the throughput at the end.
+			void send_write_command_stream(uint16_t handle, const uint8_t* data, size_t length, std::function<void(const WriteStreamResponse&)> cb=nullptr);
+
+			void send_read_request(uint16_t handle, std::function<void(const PDUReadResponse&)> cb=nullptr);
+
+			///Read a value of any length, following the Read with Read Blob
+			///requests for as long as the server fills the MTU. The value is
+			///assembled in the supplied vector, which is cleared first, and
+			///cb is called once with the lot. Without cb, the result goes to
+			///the characteristic's cb_long_read or else to cb_long_read.
+			///The request may wait in the queue before it starts, so value
+			///is held by reference from this call until the result has been
+			///delivered or the connection is closed: it must outlive that,
+			///and must not be touched meanwhile.
+			void send_long_read_request(uint16_t handle, std::vector<std::uint8_t>& value, std::function<void(const LongReadResponse&)> cb=nullptr);
+
+			///As above, assembling into a buffer owned by the machine. It is
+			///reused, so the value is only valid until the next long read.
+			void send_long_read_request(uint16_t handle);
+
+			///Ask the server to raise the ATT MTU to n bytes. The result is
+			///the smaller of n and what the server can take, and becomes
+			///available through mtu() when cb_mtu_exchanged is called. A
+			///server which does not support the exchange leaves it at 23.
+			///The exchange can only happen once per connection, so asking
+			///again throws std::logic_error.
+			void request_mtu(uint16_t n);
+
+			///Current ATT MTU of the connection.
+			uint16_t mtu() const
+			{
+				return dev.buf.size();
+			}
 
 			void read_primary_services();
 			void find_all_characteristics();
 			void get_client_characteristic_configuration();
 			void read_and_process_next();
 			void write_and_process_next();
-			void set_notify_and_indicate(Characteristic& c, bool notify, bool indicate, WriteType type = WriteType::Request);
+			void set_notify_and_indicate(Characteristic& c, bool notify, bool indicate, WriteType type = WriteType::Request, std::function<void()> cb=nullptr);
+
+			///Set the CCC of all of cs, calling cb once they are all done.
+			void set_notify_and_indicate(const std::vector<Characteristic*>& cs, bool notify, bool indicate, std::function<void()> cb, WriteType type = WriteType::Request);
 
 
-			void setup_standard_scan(std::function<void()>& cb);
+			///Read the services, characteristics and CCCs then call cb. If
+			///mtu is nonzero, it is requested before anything is read.
+			void setup_standard_scan(std::function<void()>& cb, uint16_t mtu=0);
 	};
 
 
@@ -0,0 +1,155 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_DEVICE_TRACKER_H
+#define __INC_BLEPP_DEVICE_TRACKER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <chrono>
+#include <functional>
+#include <blepp/lescan.h>
+
+namespace BLEPP
+{
+	///Everything the tracker knows about one device.
+	struct TrackedDevice
+	{
+		static const int max_payload = 31; //Legacy advertising data. Longer payloads are truncated.
+
+		BLEAddress address;
+		std::chrono::steady_clock::time_point first_seen;
+		std::chrono::steady_clock::time_point last_seen;
+		std::uint64_t adverts;       //Reports received
+
+		std::int8_t rssi_last;
+		std::int8_t rssi_min;
+		std::int8_t rssi_max;
+		std::uint32_t rssi_samples;  //Reports with an RSSI
+		std::int64_t rssi_sum;
+		double rssi_mean() const;
+
+		LeAdvertisingEventType last_type;
+
+		//Adverts and scan responses are kept separately, so that devices
+		//alternating between them are not seen as changing. The length is
+		//not_received until the first one arrives.
+		static const std::uint8_t not_received = 0xff;
+		std::uint8_t payload_length;
+		std::uint8_t payload[max_payload];
+		std::uint8_t scan_response_length;
+		std::uint8_t scan_response[max_payload];
+	};
+
+	///Receives events from a DeviceTracker. The device is only valid
+	///during the call.
+	class DeviceListener
+	{
+		public:
+			///First advert from a device, or the first since it departed.
+			virtual void on_arrival(const TrackedDevice&) {}
+			///The advertising data or scan response differs from last time.
+			virtual void on_change(const TrackedDevice&) {}
+			///Nothing heard for the departure timeout.
+			virtual void on_departure(const TrackedDevice&) {}
+			virtual ~DeviceListener(){}
+	};
+
+	///Per device statistics, kept up to date from the scanner.
+	///
+	///Devices live in a fixed size open addressing table keyed on the 
+	///binary address, with the keys in their own array so that probing 
+	///touches as little memory as possible. The table is sized for 
+	///max_devices when it's created and never grows. Once it's full, new
+	///devices are ignored, and overflows() counts them.
+	///
+	///Departures are found with a timing wheel: each device sits in the
+	///bucket for when it might depart, and only those buckets are looked at
+	///as time passes, so the cost doesn't depend on the number of devices.
+	///Devices which have been heard again since are simply moved to a later
+	///bucket.
+	class DeviceTracker: public AdvertisingSink
+	{
+		public:
+			typedef std::chrono::steady_clock Clock;
+
+			explicit DeviceTracker(std::size_t max_devices=4096, Clock::duration departure_timeout=std::chrono::seconds(30));
+
+			///The listener must outlive the tracker, or be replaced by nullptr.
+			void set_listener(DeviceListener* listener);
+
+			///Record an advert. This also processes departures up to now.
+			void update(const AdvertisingView& advert, Clock::time_point now=Clock::now());
+
+			///Record an advert as of its arrival time.
+			void on_advertisement(const AdvertisingView& advert) override;
+
+			///Process departures up to now. Call this periodically if
+			///adverts might stop arriving altogether.
+			void expire(Clock::time_point now=Clock::now());
+
+			///nullptr if the device is not being tracked.
+			const TrackedDevice* find(const BLEAddress& address) const;
+			void for_each(const std::function<void(const TrackedDevice&)>& f) const;
+
+			std::size_t size() const;
+			std::size_t max_devices() const;
+			Clock::duration departure_timeout() const;
+
+			///New devices ignored because the table was full.
+			std::uint64_t overflows() const;
+
+		private:
+			static const std::uint64_t empty_key = ~std::uint64_t(0);
+			static const std::uint64_t deleted_key = ~std::uint64_t(0) - 1;
+			static const std::uint32_t end_of_list = ~std::uint32_t(0);
+			static const std::size_t wheel_size = 256;
+
+			std::size_t limit;
+			Clock::duration timeout;
+			DeviceListener* listener=nullptr;
+
+			std::vector<std::uint64_t> keys;
+			std::vector<TrackedDevice> devices;
+			std::vector<std::uint32_t> next;   //Links for the wheel's lists
+			std::size_t mask;
+			std::size_t live=0;
+			std::size_t deleted=0;
+			std::uint64_t num_overflows=0;
+
+			//Timing wheel
+			Clock::duration resolution;
+			Clock::time_point epoch;
+			bool started=false;
+			std::int64_t current_tick=0;
+			std::vector<std::uint32_t> wheel;
+
+			static std::uint64_t key_of(const BLEAddress&);
+			std::size_t lookup(std::uint64_t key, std::size_t hash) const;
+			std::int64_t tick_of(Clock::time_point) const;
+			void schedule(std::uint32_t slot);
+			void rebuild();
+	};
+}
+
+#endif
@@ -0,0 +1,92 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_DUPLICATE_FILTER_H
+#define __INC_BLEPP_DUPLICATE_FILTER_H
+
+#include <cstdint>
+#include <cstddef>
+#include <vector>
+#include <chrono>
+#include <blepp/bleaddress.h>
+
+namespace BLEPP
+{
+	///Software filter for duplicate advertising reports. 
+	///
+	///This is a fixed size open addressing hash table keyed on the address
+	///and the advertising event type, so it never grows no matter how long
+	///the scanner runs. Probing is limited to a small window of slots. If the
+	///window is full then the least recently reported entry in it is thrown 
+	///out, and evictions() counts how often that happens, so if it's large, 
+	///the table is too small.
+	///
+	///Entries can also age out. If the time to live is nonzero, a device 
+	///which was last reported more than ttl ago is reported again, so each
+	///device is reported at most once per ttl. A ttl of zero means forever.
+	class DuplicateFilter
+	{
+		public:
+			typedef std::chrono::steady_clock Clock;
+
+			///The capacity is rounded up to a power of two.
+			explicit DuplicateFilter(std::size_t capacity=4096, Clock::duration ttl=Clock::duration::zero());
+
+			///Returns true if the advert should be reported, i.e. it's not been
+			///seen before, or not within the time to live. 
+			bool insert(const BLEAddress& address, std::uint8_t event_type, Clock::time_point now = Clock::now());
+
+			///Forget everything. Does not reset the eviction count.
+			void clear();
+
+			///Throws away the contents.
+			void set_capacity(std::size_t capacity);
+			void set_ttl(Clock::duration ttl);
+
+			std::size_t size() const;
+			std::size_t capacity() const;
+			Clock::duration ttl() const;
+
+			///Number of live entries thrown out to make space for new ones.
+			std::uint64_t evictions() const;
+
+		private:
+			struct Slot
+			{
+				std::uint64_t key;
+				Clock::time_point last_reported;
+				bool used;
+			};
+
+			static const std::size_t probe_window = 8;
+
+			std::vector<Slot> slots;
+			std::size_t mask;
+			std::size_t used_slots=0;
+			Clock::duration time_to_live;
+			std::uint64_t num_evictions=0;
+
+			bool expired(const Slot&, Clock::time_point now) const;
+	};
+}
+
+#endif
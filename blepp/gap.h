@@ -6,18 +6,60 @@ namespace BLEPP
 	namespace GAP
 	{
 		//From here:
-		//https://www.bluetooth.org/en-us/specification/assigned-numbers/generic-access-profile
-		//incomplete list.
+		//https://www.bluetooth.com/specifications/assigned-numbers/
+		//See "Common Data Types". The data formats are in the Core 
+		//Specification Supplement (CSS), part A.
 		enum GAP
 		{
 			flags = 0x01,
 			incomplete_list_of_16_bit_UUIDs = 0x02,
 			complete_list_of_16_bit_UUIDs = 0x03,
+			incomplete_list_of_32_bit_UUIDs = 0x04,
+			complete_list_of_32_bit_UUIDs = 0x05,
 			incomplete_list_of_128_bit_UUIDs = 0x06,
 			complete_list_of_128_bit_UUIDs = 0x07,
 			shortened_local_name = 0x08,
 			complete_local_name = 0x09,
+			tx_power_level = 0x0a,
+			class_of_device = 0x0d,
+			simple_pairing_hash_C192 = 0x0e,
+			simple_pairing_randomizer_R192 = 0x0f,
+			device_id = 0x10, //Also security manager TK value
+			security_manager_out_of_band_flags = 0x11,
+			peripheral_connection_interval_range = 0x12,
+			list_of_16_bit_service_solicitation_UUIDs = 0x14,
+			list_of_128_bit_service_solicitation_UUIDs = 0x15,
 			service_data_16_bit_UUID = 0x16,
+			public_target_address = 0x17,
+			random_target_address = 0x18,
+			appearance = 0x19,
+			advertising_interval = 0x1a,
+			LE_bluetooth_device_address = 0x1b,
+			LE_role = 0x1c,
+			simple_pairing_hash_C256 = 0x1d,
+			simple_pairing_randomizer_R256 = 0x1e,
+			list_of_32_bit_service_solicitation_UUIDs = 0x1f,
+			service_data_32_bit_UUID = 0x20,
+			service_data_128_bit_UUID = 0x21,
+			LE_secure_connections_confirmation_value = 0x22,
+			LE_secure_connections_random_value = 0x23,
+			URI = 0x24,
+			indoor_positioning = 0x25,
+			transport_discovery_data = 0x26,
+			LE_supported_features = 0x27,
+			channel_map_update_indication = 0x28,
+			PB_ADV = 0x29,
+			mesh_message = 0x2a,
+			mesh_beacon = 0x2b,
+			BIGInfo = 0x2c,
+			broadcast_code = 0x2d,
+			resolvable_set_identifier = 0x2e,
+			advertising_interval_long = 0x2f,
+			broadcast_name = 0x30,
+			encrypted_advertising_data = 0x31,
+			periodic_advertising_response_timing_information = 0x32,
+			electronic_shelf_label = 0x34,
+			three_d_information_data = 0x3d,
 			manufacturer_data = 0xff
 		};
 
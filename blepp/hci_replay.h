@@ -0,0 +1,105 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_HCI_REPLAY_H
+#define __INC_BLEPP_HCI_REPLAY_H
+
+#include <cstdint>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <stdexcept>
+
+namespace BLEPP
+{
+	///Plays back a capture of HCI traffic through a socket, so that an
+	///HCIScanner constructed on get_fd() reads it exactly as it would read
+	///a live adapter. 
+	///
+	///Captures can be btsnoop files, either HCI (as written by hcidump and
+	///Android) or monitor (as written by btmon -w), or pcap files with the
+	///Bluetooth H4, H4 with direction, or Linux monitor link types. Only LE
+	///meta events are kept, since that's all a scanner's socket filter
+	///lets through.
+	///
+	///Nothing here blocks or uses threads: call feed() in the same loop
+	///that reads the scanner.
+	class HCIReplay
+	{
+		public:
+			class FormatError: public std::runtime_error { using runtime_error::runtime_error; };
+
+			enum class Pacing
+			{
+				Fast,     //As fast as the reader can keep up.
+				RealTime, //With the timing of the original capture, scaled by speed.
+			};
+
+			struct Packet
+			{
+				std::chrono::microseconds timestamp;  //Since the first packet
+				std::vector<uint8_t> data;            //As read from an HCI socket: the packet type, then the packet
+			};
+
+			///Load a capture file in to memory. Throws FormatError or std::runtime_error.
+			explicit HCIReplay(const std::string& filename);
+			explicit HCIReplay(std::vector<Packet> packets);
+			~HCIReplay();
+			HCIReplay(const HCIReplay&) = delete;
+			HCIReplay& operator=(const HCIReplay&) = delete;
+
+			const std::vector<Packet>& packets() const;
+
+			///The end to read from.
+			int get_fd() const;
+
+			///Rewind to the first packet and start the clock.
+			void start(Pacing pacing=Pacing::Fast, double speed=1.0);
+
+			///Write every packet which is due, until the socket is full.
+			///Returns the number written. Never blocks.
+			size_t feed();
+
+			///True once every packet has been written.
+			bool done() const;
+
+			///Milliseconds until the next packet is due, 0 if one is due now,
+			///or -1 if done. Suitable for a poll() timeout.
+			int next_due_ms() const;
+
+			///Write packets as a btsnoop HCI UART (H4) capture.
+			static void save_btsnoop(const std::string& filename, const std::vector<Packet>& packets);
+
+		private:
+			std::vector<Packet> packet_list;
+			size_t position=0;
+			Pacing pacing=Pacing::Fast;
+			double speed=1;
+			std::chrono::steady_clock::time_point started;
+			int fds[2];   //Read end, write end
+
+			void open_socket();
+			std::chrono::steady_clock::time_point due(const Packet&) const;
+	};
+}
+
+#endif
@@ -29,9 +29,17 @@
 #include <string>
 #include <stdexcept>
 #include <cstdint>
-#include <set>
+#include <functional>
+#include <memory>
+#include <thread>
+#include <atomic>
+#include <chrono>
+#include <unordered_set>
 #include <boost/optional.hpp>
 #include <blepp/blestatemachine.h> //for UUID. FIXME mofo
+#include <blepp/bleaddress.h>
+#include <blepp/duplicate_filter.h>
+#include <blepp/packet_ring.h>
 #include <bluetooth/hci.h>
 
 namespace BLEPP
@@ -53,9 +61,10 @@ namespace BLEPP
 	//It seems pretty wretched.
 	struct AdvertisingResponse
 	{
-		std::string address;
+		BLEAddress address;
 		LeAdvertisingEventType type;
 		int8_t rssi;
+		std::chrono::steady_clock::time_point timestamp; //See AdvertisingView::timestamp
 		struct Name
 		{
 			std::string name;
@@ -74,6 +83,12 @@ namespace BLEPP
 			Flags(std::vector<uint8_t>&&);
 		};
 
+		struct ServiceData
+		{
+			UUID uuid;
+			std::vector<uint8_t> data; //Not including the UUID
+		};
+
 		std::vector<UUID> UUIDs;
 		bool uuid_16_bit_complete=0;
 		bool uuid_32_bit_complete=0;
@@ -81,13 +96,179 @@ namespace BLEPP
 		
 		boost::optional<Name>  local_name;
 		boost::optional<Flags> flags;
+		boost::optional<int8_t> tx_power;      //dBm
+		boost::optional<uint16_t> appearance;  //See the assigned numbers
 
 		std::vector<std::vector<uint8_t>> manufacturer_specific_data;
-		std::vector<std::vector<uint8_t>> service_data;
+		std::vector<std::vector<uint8_t>> service_data;  //Each one starts with its UUID
+		std::vector<ServiceData> service_data_by_uuid;   //The same, with the UUID decoded
 		std::vector<std::vector<uint8_t>> unparsed_data_with_types;
 		std::vector<std::vector<uint8_t>> raw_packet;
 	};
 
+	///A single AD structure (4.0/3/C.11) inside an advertising payload.
+	///This does not own the data: it points into the buffer the HCI packet
+	///was read into. The data does not include the type byte.
+	struct ADStructure
+	{
+		uint8_t type;
+		const uint8_t* data;
+		uint8_t length;
+	};
+
+	///Iterates over the AD structures in an advertising payload. The
+	///payload must be well formed, which AdvertisingView guarantees.
+	///A zero length field marks early termination of the data (4.0/3/C.11)
+	///and ends the iteration.
+	class ADIterator
+	{
+		private:
+			const uint8_t* pos;
+			const uint8_t* end_;
+
+		public:
+			ADIterator(const uint8_t* begin, const uint8_t* end)
+			:pos(begin), end_(end)
+			{
+				if(pos != end_ && *pos == 0)
+					pos = end_;
+			}
+
+			ADStructure operator*() const
+			{
+				return ADStructure{pos[1], pos + 2, static_cast<uint8_t>(pos[0] - 1)};
+			}
+
+			ADIterator& operator++()
+			{
+				pos += pos[0] + 1;
+				if(pos != end_ && *pos == 0)
+					pos = end_;
+				return *this;
+			}
+
+			bool operator==(const ADIterator& i) const
+			{
+				return pos == i.pos;
+			}
+
+			bool operator!=(const ADIterator& i) const
+			{
+				return pos != i.pos;
+			}
+	};
+
+	///Zero allocation view of a single advertising report. This points
+	///directly in to the HCI read buffer, so it is only valid for the 
+	///duration of the callback it is handed to. Use materialize() to get
+	///an owning AdvertisingResponse if you need to keep it.
+	struct AdvertisingView
+	{
+		LeAdvertisingEventType type;
+		BLEAddress address;
+		int8_t rssi;
+
+		///When the packet arrived. HCIScanner uses the time the kernel 
+		///received it, converted to steady_clock, so queueing in the socket
+		///or the capture ring doesn't show up as jitter. It falls back to 
+		///the time it was read if the kernel doesn't supply one.
+		std::chrono::steady_clock::time_point timestamp;
+		const uint8_t* data;    //The AD structures
+		uint8_t length;
+
+		///Where the AD structures of each type are, recorded by build_index(),
+		///so that looking up a type doesn't mean walking the payload.
+		struct Index
+		{
+			static const int max_entries=16;
+
+			uint64_t present[4];              //Bit set for each type present
+			uint8_t count;
+			uint8_t types[max_entries];
+			uint8_t offsets[max_entries];     //Of the length byte
+			bool overflowed;                  //More structures than entries
+		};
+		Index index;
+		bool indexed=false;
+
+		///Check that the AD structures exactly tile the payload and index them.
+		///Returns false if the payload is corrupt. The parser does this before
+		///a view is handed out, so it's only needed for views made by hand.
+		bool build_index();
+
+		ADIterator begin() const
+		{
+			return ADIterator(data, data + length);
+		}
+
+		ADIterator end() const
+		{
+			return ADIterator(data + length, data + length);
+		}
+
+		///First AD structure of the given type, if any. See GAP:: for types.
+		boost::optional<ADStructure> find(uint8_t type) const;
+
+		///Is there an AD structure of the given type?
+		bool has(uint8_t type) const;
+
+		///Decode single fields on demand. Only the structures needed are
+		///looked at. These throw std::out_of_range if a structure has a
+		///bad length for its type.
+		boost::optional<AdvertisingResponse::Name> local_name() const;
+		boost::optional<AdvertisingResponse::Flags> flags() const;
+		boost::optional<int8_t> tx_power() const;
+		boost::optional<uint16_t> appearance() const;
+		std::vector<UUID> uuids() const;
+		std::vector<AdvertisingResponse::ServiceData> service_data() const;
+		
+		///Parse everything in to an owning AdvertisingResponse. 
+		///Throws std::out_of_range if an AD structure has a bad length
+		///for its type.
+		AdvertisingResponse materialize() const;
+	};
+
+	///Human readable name of an AD type, e.g. "Complete Local Name".
+	const char* ad_type_name(uint8_t type);
+
+	///Receives advertising reports straight from the parser, one at a time,
+	///with no intermediate containers. The view is only valid during the call.
+	class AdvertisingSink
+	{
+		public:
+			virtual void on_advertisement(const AdvertisingView&) = 0;
+
+			///Called instead of on_advertisement() for a report whose AD
+			///structures don't fit its payload. The default ignores it.
+			virtual void on_corrupt_advertisement(const AdvertisingView&){}
+
+			virtual ~AdvertisingSink(){}
+	};
+
+	///Wrap any callable (e.g. a lambda) as an AdvertisingSink without 
+	///type erasure, so nothing is allocated. Use make_advertising_sink().
+	template<class F> class AdvertisingFunctionSink: public AdvertisingSink
+	{
+		private:
+			F& f;
+		public:
+			AdvertisingFunctionSink(F& f_)
+			:f(f_)
+			{}
+
+			void on_advertisement(const AdvertisingView& a) override
+			{
+				f(a);
+			}
+	};
+
+	template<class F> AdvertisingFunctionSink<F> make_advertising_sink(F& f)
+	{
+		return AdvertisingFunctionSink<F>(f);
+	}
+
+	class ScanResponseMerger;
+
 	/// Class for scanning for BLE devices
 	/// this must be run as root, because it requires getting packets from the HCI.
 	/// The HCI requires root since it has no permissions on setting filters, so 
@@ -115,6 +296,13 @@ namespace BLEPP
 					fd = i;
 				}
 
+				void reset(int i=-1)
+				{
+					if(fd != -1)
+						close(fd);
+					fd = i;
+				}
+
 				~FD()
 				{
 					if(fd != -1)
@@ -140,6 +328,41 @@ namespace BLEPP
 			Both      //The best and worst of both worlds. 
 		};
 
+		///Scan timing and filtering, as in 4.0/2/E.7.8.10. The interval and
+		///window are in units of 0.625ms. Every interval, the radio listens
+		///for window, so window/interval is the duty cycle: higher catches
+		///more adverts, lower draws less power.
+		struct ScanParameters
+		{
+			uint16_t interval = 0x0010;
+			uint16_t window   = 0x0010;
+			AddressType own_address_type = AddressType::Public;
+			uint8_t filter_policy = 0x00; //0: accept everything, 1: accept list only
+
+			///Listen all the time (10ms/10ms). This is the default.
+			static ScanParameters continuous();
+			///Listen half the time (30ms every 60ms).
+			static ScanParameters balanced();
+			///Listen about 5% of the time (50ms every second).
+			static ScanParameters low_duty();
+
+			///Throws std::invalid_argument if the values are out of range.
+			void validate() const;
+
+			bool operator==(const ScanParameters&) const;
+		};
+
+		///Adverts received while scanning with a particular configuration.
+		struct ScanRate
+		{
+			ScanParameters parameters;
+			ScanType scan_type;
+			uint64_t adverts;  //Advertising reports received, before software filtering.
+			std::chrono::steady_clock::duration scanning_time;
+
+			double adverts_per_second() const;
+		};
+
 		///Generic error exception class
 		class Error: public std::runtime_error
 		{
@@ -164,20 +387,106 @@ namespace BLEPP
 		};
 		
 		///HCI device spat out invalid data.
-		///This is not good. Almost certainly fatal.
+		///This is not good. Almost certainly fatal. Thrown by parse_packet():
+		///get_advertisements() logs such packets, counts them in 
+		///ScannerStats::malformed_packets and carries on with the next one.
 		class HCIError: public Error
 		{
 			using Error::Error;
 		};
 
+		///The source has gone away, e.g. the far end of the fd passed to
+		///HCIScanner(int) was closed. Nothing more will ever arrive.
+		class Closed: public Error
+		{
+			using Error::Error;
+		};
+
 		HCIScanner();
 		HCIScanner(bool start);
-		HCIScanner(bool start, FilterDuplicates duplicates, ScanType, std::string device="");
+		HCIScanner(bool start, FilterDuplicates duplicates, ScanType, std::string device="", const ScanParameters& = ScanParameters::continuous());
+
+		///Read HCI events from an already open descriptor rather than an
+		///adapter, e.g. HCIReplay::get_fd(). The descriptor is duplicated, so
+		///the caller still owns it. No HCI commands are ever sent, so start()
+		///and stop() only reset the software filter and statistics, and the
+		///accept list is always handled in software. Hardware filtering is
+		///not available. The scanner starts running immediately.
+		HCIScanner(int fd, FilterDuplicates duplicates);
 
 
 		void start();
+		///Start with new parameters. If already scanning, this restarts.
+		void start(const ScanParameters&);
 		void stop();
+
+		const ScanParameters& get_scan_parameters() const;
+
+		///The advert rate seen with each configuration used since the 
+		///scanner was created, including the one currently running.
+		std::vector<ScanRate> scan_rates() const;
 		
+		///Configure the software duplicate filter: the number of slots
+		///in the table, and how long before a device is reported again.
+		///A ttl of zero means a device is only reported once per start().
+		void set_software_filter(size_t capacity, DuplicateFilter::Clock::duration ttl = DuplicateFilter::Clock::duration::zero());
+		const DuplicateFilter& software_filter() const;
+
+		///Counters for the accept list.
+		struct AcceptListStats
+		{
+			size_t entries;             //Devices on the list
+			size_t controller_capacity; //As reported by the controller
+			bool in_controller;         //False if filtering is being done in software
+			size_t overflowed_entries;  //Entries beyond the controller's capacity
+			uint64_t hits;              //Reports from listed devices
+			uint64_t misses;            //Reports dropped in software
+		};
+
+		///Only report the listed devices. If the list fits in the controller's
+		///accept list (a.k.a. white list), the scan runs with filter policy 1
+		///and other devices never wake the host. If it doesn't fit, the 
+		///controller's list is cleared, and filtering is done in software.
+		///While the list is non empty, this overrides ScanParameters::filter_policy.
+		///An empty list means report everything. Changing the list while
+		///scanning briefly stops the scan, since the controller can't modify
+		///the list while it's in use.
+		void set_accept_list(const std::vector<BLEAddress>& addresses);
+		void add_to_accept_list(const BLEAddress& address);
+		void remove_from_accept_list(const BLEAddress& address);
+		void clear_accept_list();
+
+		///The size of the controller's accept list. This is read from the 
+		///controller the first time it's needed, and is 0 if it can't be read.
+		size_t accept_list_capacity();
+		AcceptListStats accept_list_stats() const;
+
+		///Fold SCAN_RSP reports in to the ADV_IND or ADV_SCAN_IND they
+		///answer, so an active scan gives one report per advert. Adverts 
+		///are held for up to window waiting for their response. A zero
+		///window turns merging off, which is the default. See 
+		///ScanResponseMerger for the details.
+		void set_scan_response_merging(std::chrono::steady_clock::duration window);
+
+		///nullptr if merging is off.
+		const ScanResponseMerger* scan_response_merger() const;
+
+		///Periodically forget which devices have been seen, so that every
+		///device is reported again (with a fresh RSSI) at least once per 
+		///interval, while keeping duplicate filtering between refreshes.
+		///With hardware filtering, the controller's duplicate list is reset
+		///by disabling and re-enabling the scan, which briefly stops 
+		///scanning: see ScannerStats for how long that takes. The software
+		///set is cleared at the same moment. Zero turns refreshing off, 
+		///which is the default.
+		void set_refresh_interval(std::chrono::steady_clock::duration interval);
+
+		///Milliseconds until the scanner has timed work to do, releasing
+		///held adverts or refreshing the duplicate filters, or -1 if none.
+		///That work is only done by get_advertisements(), so bound the 
+		///timeout by this if polling get_fd() yourself.
+		int next_timeout_ms() const;
+
 		///get the file descriptor.
 		///Use with select(), poll() or whatever.
 		int get_fd() const;
@@ -185,33 +494,200 @@ namespace BLEPP
 		~HCIScanner();
 
 		///Blocking call. Use select() on the FD if you don't want to block.
-		///This reads and parses the HCI packets.
+		///This reads and parses the HCI packets. Once there is something 
+		///to read, every HCI event pending at that moment is read, not just
+		///one. In nonblocking mode, this returns an empty batch if there's
+		///nothing to read.
 		std::vector<AdvertisingResponse> get_advertisements();
+
+		///Wait at most timeout_ms milliseconds for something to read, then
+		///read and parse every pending event. -1 means wait forever and 0 
+		///means don't wait. Returns an empty batch on timeout.
+		std::vector<AdvertisingResponse> get_advertisements(int timeout_ms);
+
+		///Like get_advertisements(), but nothing is allocated. Each report
+		///which passes the filters is handed to the sink as soon as it is
+		///parsed, as a view in to the read buffer.
+		void get_advertisements(AdvertisingSink& sink);
+		void get_advertisements(AdvertisingSink& sink, int timeout_ms);
+
+		///As above, but with a callback instead of a sink.
+		void get_advertisement_views(const std::function<void(const AdvertisingView&)>& callback);
+		void get_advertisement_views(const std::function<void(const AdvertisingView&)>& callback, int timeout_ms);
+
+		///In nonblocking mode, reads never wait, so the get_advertisement
+		///functions return nothing rather than block if there's nothing to read.
+		///This sets O_NONBLOCK on the file descriptor.
+		void set_nonblocking(bool nonblocking);
+		bool is_nonblocking() const;
+
+		///Statistics for the threaded capture mode.
+		struct CaptureStats
+		{
+			size_t ring_capacity;
+			size_t ring_occupancy;
+			size_t ring_high_water; //Largest occupancy seen
+			uint64_t captured;      //Packets read from the HCI in to the ring
+			uint64_t overflows;     //Packets read and dropped because the ring was full
+		};
+
+		///Start a dedicated thread which does nothing but read raw HCI events
+		///in to a preallocated ring of ring_slots packets. This stops the 
+		///kernel's socket buffer overflowing while the application is busy:
+		///a slow consumer shows up in CaptureStats::overflows instead of 
+		///being lost silently. Parsing still happens in the get_advertisement
+		///functions, on the calling thread. While capturing, get_fd() returns
+		///a descriptor which becomes readable when packets are waiting.
+		///Packets still in the ring are discarded by stop_capture_thread().
+		void start_capture_thread(size_t ring_slots=1024);
+		void stop_capture_thread();
+		bool is_capturing() const;
+		CaptureStats capture_stats() const;
+
+		///Set the size of the kernel's receive buffer for the HCI socket.
+		///A bigger buffer rides out longer stalls in the consumer before
+		///events are dropped. Limits set by the system (net.core.rmem_max)
+		///are bypassed if the process has CAP_NET_ADMIN, as it usually 
+		///does when scanning.
+		void set_receive_buffer(size_t bytes);
+
+		///The receive buffer size as the kernel reports it. This includes
+		///the kernel's bookkeeping, so it's about twice what was asked for.
+		size_t receive_buffer() const;
+
+		///Everything which can tell you that adverts are being lost.
+		struct ScannerStats
+		{
+			uint64_t packets;            //HCI events read
+			uint64_t adverts;            //Advertising reports parsed
+			uint64_t corrupt_adverts;    //Reports dropped because their AD structures were malformed
+			uint64_t malformed_packets;  //Events which couldn't be parsed at all
+			uint64_t full_reads;         //Reads which stopped at max_events_per_read, so more may have been waiting: the consumer is falling behind
+
+			bool kernel_drops_known;     //Whether the kernel reports kernel_drops (SO_MEMINFO, Linux 4.12+)
+			uint64_t kernel_drops;       //Events dropped by the kernel because the receive buffer was full
+			size_t receive_buffer;       //As receive_buffer()
+			size_t receive_queued;       //Bytes waiting in the receive buffer, including overhead
+
+			uint64_t ring_overflows;     //Events dropped because the capture ring was full, see CaptureStats
+
+			uint64_t refreshes;          //See set_refresh_interval()
+			std::chrono::steady_clock::duration last_refresh_gap;  //How long scanning was off for the last refresh
+			std::chrono::steady_clock::duration max_refresh_gap;
+			std::chrono::steady_clock::duration total_refresh_gap;
+
+			///Events lost before they could be parsed.
+			uint64_t lost() const
+			{
+				return kernel_drops + ring_overflows;
+			}
+		};
+
+		///A snapshot of the counters, which are cumulative over the scanner's
+		///lifetime. This makes a couple of system calls, so it's intended to
+		///be polled periodically rather than per event.
+		ScannerStats stats() const;
+
+		///The most HCI events read in one call, so that one busy scanner 
+		///can't starve anything else being serviced by the same thread.
+		static const int max_events_per_read = 256;
 		
 		///Parse an HCI advertising packet. There's probably not much
 		///reason to call this yourself.
 		static std::vector<AdvertisingResponse> parse_packet(const std::vector<uint8_t>& p);
 
-		private:
-			struct FilterEntry
-			{
-				explicit FilterEntry(const AdvertisingResponse&);
-				const std::string mac_address;
-				int type;
-				bool operator<(const FilterEntry&) const;
-			};
+		///Parse an HCI advertising packet without allocating, handing
+		///a view of each advertising report to the sink.
+		static void parse_packet(const uint8_t* packet, size_t length, AdvertisingSink& sink);
+		static void parse_packet(const uint8_t* packet, size_t length, const std::function<void(const AdvertisingView&)>& callback);
 
+		///As above, stamping every report with the given arrival time
+		///rather than the time of the call.
+		static void parse_packet(const uint8_t* packet, size_t length, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival);
+
+		///Whether the socket supplies kernel receive timestamps. If not,
+		///reports are stamped when they are read.
+		bool kernel_timestamps() const;
+
+		private:
 			bool hardware_filtering;
 			bool software_filtering;
 			ScanType scan_type;
+			ScanParameters scan_parameters;
+
+			std::vector<ScanRate> rates;
+			size_t current_rate=0;
+			std::chrono::steady_clock::time_point scan_started;
+			uint64_t adverts_received=0;
+			uint64_t adverts_at_start=0;
+
+			//Loss accounting. See ScannerStats.
+			uint64_t packets_read=0;
+			uint64_t corrupt_adverts=0;
+			uint64_t malformed_packets=0;
+			uint64_t full_reads=0;
+			uint64_t kernel_drops_at_open=0;
+			bool read_meminfo(uint32_t& drops, uint32_t& queued) const;
 
 			FD hci_fd;
+			bool external_source=false;
+			void enable_scanning();
 			bool running=0;
-			hci_filter old_filter;
+			bool nonblocking=0;
 			
-			///Read the HCI data, but don't parse it.
-			std::vector<uint8_t> read_with_retry();
-			std::set<FilterEntry> scanned_devices;
+			///Read the HCI data in to read_buffer, but don't parse it.
+			///This never blocks: it returns the number of bytes read, or 0
+			///if there's nothing to read or the source has closed, in which
+			///case source_closed is set.
+			size_t read_with_retry();
+			bool source_closed=false;
+			std::vector<uint8_t> read_buffer;
+			std::chrono::steady_clock::time_point read_timestamp;
+
+			///Ask for HCI_TIME_STAMP or SO_TIMESTAMP ancillary data.
+			void enable_timestamps();
+			bool timestamps_enabled=false;
+			DuplicateFilter scanned_devices;
+
+			//Accept list
+			std::unordered_set<BLEAddress> accept_list;
+			boost::optional<size_t> controller_accept_list_size;
+			bool accept_list_in_controller=false;
+			uint64_t accept_list_hits=0;
+			uint64_t accept_list_misses=0;
+			void load_accept_list();
+			void update_controller_accept_list(const BLEAddress&, bool add);
+
+			std::unique_ptr<ScanResponseMerger> merger;
+
+			//Periodic refresh of the duplicate filters
+			int dev_id=-1;
+			FD command_fd;  //Every HCI command goes here, so they don't disturb hci_fd
+			int command_socket();
+			std::chrono::steady_clock::duration refresh_interval{0};
+			std::chrono::steady_clock::time_point next_refresh;
+			uint64_t refreshes=0;
+			std::chrono::steady_clock::duration last_refresh_gap{0};
+			std::chrono::steady_clock::duration max_refresh_gap{0};
+			std::chrono::steady_clock::duration total_refresh_gap{0};
+			void refresh_duplicate_filters();
+			void release_merged(AdvertisingSink& sink);
+
+			///Parse one HCI packet, applying the software filter.
+			void process_packet(const uint8_t* packet, size_t length, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival);
+
+			//Threaded capture mode
+			std::unique_ptr<PacketRing> ring;
+			std::thread capture_thread;
+			FD capture_notify_fd; //Readable when the ring has data
+			FD capture_quit_fd;   //Tells the capture thread to stop
+			std::atomic<int> capture_errno{0};
+			std::atomic<bool> capture_closed{false};
+			std::atomic<uint64_t> captured{0};
+			std::atomic<uint64_t> overflows{0};
+			uint64_t earlier_overflows=0;  //From capture threads since stopped
+			std::atomic<size_t> ring_high_water{0};
+			void capture_loop();
 	};
 }
 
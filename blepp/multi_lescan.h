@@ -0,0 +1,161 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_MULTI_LESCAN_H
+#define __INC_BLEPP_MULTI_LESCAN_H
+
+#include <vector>
+#include <string>
+#include <memory>
+#include <chrono>
+#include <boost/optional.hpp>
+#include <blepp/lescan.h>
+
+namespace BLEPP
+{
+	///Receives reports from a MultiHCIScanner, along with the index of the
+	///adapter which heard them.
+	class MultiAdvertisingSink
+	{
+		public:
+			virtual void on_advertisement(size_t adapter, const AdvertisingView&) = 0;
+			virtual ~MultiAdvertisingSink(){}
+	};
+
+	struct MultiAdvertisingResponse
+	{
+		size_t adapter;  //Index in to MultiHCIScanner's list of adapters
+		AdvertisingResponse advert;
+	};
+
+	///Scan on several adapters at once, to increase the chance of catching
+	///each advert. All adapters are read from one epoll set, so get_fd()
+	///can be used with select() or poll() in the same way as HCIScanner. 
+	///
+	///Duplicate filtering in software is shared, so each device is reported
+	///once no matter how many radios hear it. The most recent RSSI from each
+	///adapter is kept for every device though, whether or not the report 
+	///was filtered, so best_adapter() can pick the adapter to connect with.
+	class MultiHCIScanner
+	{
+		public:
+			///Open the named adapters (e.g. "hci0", "hci1"). With software filtering
+			///(FilterDuplicates::Software or Both), a single filter is shared 
+			///across adapters. Hardware filtering is per adapter.
+			MultiHCIScanner(const std::vector<std::string>& devices, bool start=true, 
+			                HCIScanner::FilterDuplicates duplicates = HCIScanner::FilterDuplicates::Both, 
+			                HCIScanner::ScanType = HCIScanner::ScanType::Active,
+			                const HCIScanner::ScanParameters& = HCIScanner::ScanParameters::continuous());
+
+			///Read from already open descriptors instead, e.g. HCIReplay::get_fd().
+			///See HCIScanner(int, FilterDuplicates): no HCI commands are sent,
+			///so hardware filtering isn't available. Scanning starts immediately.
+			MultiHCIScanner(const std::vector<int>& fds, HCIScanner::FilterDuplicates duplicates = HCIScanner::FilterDuplicates::Software);
+			~MultiHCIScanner();
+
+			void start();
+			void stop();
+
+			///Run each adapter's reader on its own thread. See HCIScanner::start_capture_thread().
+			void start_capture_threads(size_t ring_slots=1024);
+			void stop_capture_threads();
+
+			///An epoll fd which is readable when any adapter has data.
+			int get_fd() const;
+
+			///The soonest of the adapters' HCIScanner::next_timeout_ms(), or -1.
+			int next_timeout_ms() const;
+
+			size_t num_adapters() const;
+			const std::string& adapter_name(size_t adapter) const;
+			HCIScanner& adapter(size_t adapter);
+
+			///Wait at most timeout_ms (-1 means forever) for data on any adapter, 
+			///then read everything that's pending on all of them. Like 
+			///HCIScanner, this returns early if an adapter has timed work to
+			///do: bound the timeout by next_timeout_ms() if polling get_fd().
+			void get_advertisements(MultiAdvertisingSink& sink, int timeout_ms=-1);
+			std::vector<MultiAdvertisingResponse> get_advertisements(int timeout_ms=-1);
+
+			const DuplicateFilter& software_filter() const;
+			void set_software_filter(size_t capacity, DuplicateFilter::Clock::duration ttl = DuplicateFilter::Clock::duration::zero());
+
+			///As HCIScanner::set_refresh_interval(), for every adapter. The 
+			///shared software filter is cleared once per interval, and each
+			///adapter resets its controller's list. Zero turns it off.
+			void set_refresh_interval(std::chrono::steady_clock::duration interval);
+
+			///Most recent RSSI of a device on a particular adapter, if it's 
+			///been heard there within the RSSI time to live.
+			boost::optional<int8_t> rssi(const BLEAddress& address, size_t adapter) const;
+
+			///The adapter which most recently heard the device the loudest.
+			boost::optional<size_t> best_adapter(const BLEAddress& address) const;
+
+			///How long a per adapter RSSI reading is kept. Devices not heard
+			///by any adapter for this long are forgotten.
+			void set_rssi_ttl(std::chrono::steady_clock::duration ttl);
+
+			///Number of devices whose RSSI is tracked. The table is sized
+			///once, so recording never allocates: when it's full the device
+			///heard least recently is forgotten. Clears the table.
+			void set_rssi_capacity(size_t devices);
+
+		private:
+			struct Sighting
+			{
+				int8_t rssi;
+				std::chrono::steady_clock::time_point when;
+			};
+
+			//Open addressed, like DuplicateFilter. Device i's readings are
+			//sightings[i*adapters.size()] onwards.
+			struct Device
+			{
+				uint64_t key;
+				std::chrono::steady_clock::time_point last_heard;
+				bool used;
+			};
+			static const size_t probe_window = 8;
+			
+			class AdapterSink;
+
+			std::vector<std::string> names;
+			std::vector<std::unique_ptr<HCIScanner>> adapters;
+			bool software_filtering;
+			DuplicateFilter filter;
+			std::chrono::steady_clock::duration refresh_interval{0};
+			std::chrono::steady_clock::time_point next_refresh;
+			
+			int epoll_fd=-1;
+			void register_fds();
+
+			std::vector<Device> devices;
+			std::vector<Sighting> sightings;
+			size_t device_mask=0;
+			std::chrono::steady_clock::duration rssi_ttl = std::chrono::seconds(60);
+			size_t find_device(const BLEAddress&) const;
+			void record(size_t adapter, const AdvertisingView&, std::chrono::steady_clock::time_point now);
+	};
+}
+
+#endif
@@ -0,0 +1,133 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_PACKET_RING_H
+#define __INC_BLEPP_PACKET_RING_H
+
+#include <atomic>
+#include <vector>
+#include <cstdint>
+#include <cstddef>
+#include <chrono>
+
+namespace BLEPP
+{
+	///Lock free single producer, single consumer ring of fixed size packet
+	///slots. Everything is allocated up front, so neither side ever 
+	///allocates or takes a lock. Exactly one thread may call the producer
+	///functions and exactly one (other) thread the consumer ones.
+	class PacketRing
+	{
+		private:
+			std::vector<std::uint8_t> data;
+			std::vector<std::uint16_t> lengths;
+			std::vector<std::chrono::steady_clock::time_point> stamps;
+			std::size_t slot_size_;
+			std::size_t mask;
+
+			//Kept on separate cache lines, so the two threads don't fight.
+			std::atomic<std::size_t> head{0}; //Written by the producer
+			char padding[64];
+			std::atomic<std::size_t> tail{0}; //Written by the consumer
+
+		public:
+			///The number of slots is rounded up to a power of 2.
+			PacketRing(std::size_t num_slots, std::size_t slot_size)
+			:slot_size_(slot_size)
+			{
+				std::size_t n=1;
+				while(n < num_slots)
+					n*=2;
+				mask = n-1;
+				data.resize(n * slot_size);
+				lengths.resize(n);
+				stamps.resize(n);
+			}
+
+			std::size_t capacity() const
+			{
+				return mask + 1;
+			}
+
+			std::size_t slot_size() const
+			{
+				return slot_size_;
+			}
+
+			///Number of packets waiting. Approximate if called from 
+			///any thread other than the consumer.
+			std::size_t occupancy() const
+			{
+				return head.load(std::memory_order_acquire) - tail.load(std::memory_order_acquire);
+			}
+
+			///Producer: get the next free slot (slot_size() bytes) or 
+			///nullptr if the ring is full.
+			std::uint8_t* producer_slot()
+			{
+				std::size_t h = head.load(std::memory_order_relaxed);
+				if(h - tail.load(std::memory_order_acquire) == capacity())
+					return nullptr;
+				return data.data() + (h & mask) * slot_size_;
+			}
+
+			///Producer: publish the slot from producer_slot(), along with 
+			///when the packet arrived.
+			void commit(std::size_t length, std::chrono::steady_clock::time_point stamp={})
+			{
+				std::size_t h = head.load(std::memory_order_relaxed);
+				lengths[h & mask] = length;
+				stamps[h & mask] = stamp;
+				head.store(h + 1, std::memory_order_release);
+			}
+
+			///Consumer: get the oldest packet, returning false if 
+			///there isn't one.
+			bool peek(const std::uint8_t*& packet, std::size_t& length) const
+			{
+				std::size_t t = tail.load(std::memory_order_relaxed);
+				if(t == head.load(std::memory_order_acquire))
+					return false;
+
+				packet = data.data() + (t & mask) * slot_size_;
+				length = lengths[t & mask];
+				return true;
+			}
+
+			bool peek(const std::uint8_t*& packet, std::size_t& length, std::chrono::steady_clock::time_point& stamp) const
+			{
+				if(!peek(packet, length))
+					return false;
+
+				stamp = stamps[tail.load(std::memory_order_relaxed) & mask];
+				return true;
+			}
+
+			///Consumer: hand the packet from peek() back to the producer.
+			void release()
+			{
+				tail.store(tail.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+			}
+	};
+}
+
+#endif
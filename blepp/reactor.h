@@ -0,0 +1,123 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_REACTOR_H
+#define __INC_BLEPP_REACTOR_H
+
+#include <list>
+#include <vector>
+#include <unordered_map>
+#include <blepp/lescan.h>
+#include <blepp/blestatemachine.h>
+
+namespace BLEPP
+{
+	///A single threaded event loop over any number of scanners and GATT 
+	///connections, built on epoll rather than select(), so it is not limited 
+	///to FD_SETSIZE and the cost of a wakeup does not depend on how many
+	///connections are idle.
+	///
+	///GATT state machines are driven automatically: write readiness is 
+	///waited for while connecting (see wait_on_write()) and read readiness
+	///otherwise, and write_and_process_next() or read_and_process_next()
+	///are called as appropriate. Scanners are drained in to an
+	///AdvertisingSink.
+	///
+	///Machines report socket changes through cb_io_changed, which the
+	///reactor takes over while they're registered, so they may be connected,
+	///closed and reconnected at any time. Only entries which have changed or
+	///have timed work are looked at between waits. Scanners can't report
+	///changes made outside of callbacks, such as start_capture_thread() or
+	///set_refresh_interval(), so call update() after those. Registered
+	///objects must outlive their registration. Objects may be added or
+	///removed from within callbacks.
+	///
+	///An exception from one entry's callbacks does not stop the rest of the
+	///batch being dispatched: the first is rethrown from run_once() once
+	///the batch is complete.
+	class Reactor
+	{
+		public:
+			Reactor();
+			~Reactor();
+			Reactor(const Reactor&) = delete;
+			Reactor& operator=(const Reactor&) = delete;
+
+			void add(BLEGATTStateMachine& gatt);
+			void remove(BLEGATTStateMachine& gatt);
+
+			void add(HCIScanner& scanner, AdvertisingSink& sink);
+			void remove(HCIScanner& scanner);
+
+			///Pick up changes to a scanner's fd or timed work.
+			void update(HCIScanner& scanner);
+
+			///Wait at most timeout_ms (-1 means forever) and dispatch
+			///whatever is ready. Returns the number of events dispatched.
+			int run_once(int timeout_ms=-1);
+
+			///Call run_once() until stop() is called, e.g. from a callback.
+			void run();
+			void stop();
+
+			size_t size() const;
+
+			///The epoll fd, which is readable when run_once() has work to do,
+			///so a reactor can itself be nested in another event loop.
+			int get_fd() const;
+
+		private:
+			struct Entry
+			{
+				BLEGATTStateMachine* gatt;
+				HCIScanner* scanner;
+				AdvertisingSink* sink;
+				int fd;            //Currently registered fd or -1
+				uint32_t events;   //Currently registered event mask
+				bool removed;
+				bool dirty;        //In dirty, needs resyncing
+				bool timed;        //In timed, a scanner with timed work
+			};
+
+			int epoll_fd=-1;
+			bool stopping=false;
+
+			//Entries are referenced from epoll, so they need stable addresses.
+			std::list<Entry> entries;
+			std::unordered_map<const void*, std::list<Entry>::iterator> index;
+			std::vector<Entry*> dirty;
+			std::vector<Entry*> timed;
+			std::vector<std::list<Entry>::iterator> removed;
+			bool dispatching=false;
+
+			Entry& add(Entry e, const void* key);
+			void mark(Entry& e);
+			void check_timer(Entry& e);
+			void remove(const void* key);
+			void sync(Entry& e, bool force);
+			void unregister(Entry& e);
+			void dispatch(Entry& e, uint32_t events);
+			void purge();
+	};
+}
+
+#endif
@@ -0,0 +1,95 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_SCAN_MERGER_H
+#define __INC_BLEPP_SCAN_MERGER_H
+
+#include <cstdint>
+#include <vector>
+#include <chrono>
+#include <blepp/lescan.h>
+
+namespace BLEPP
+{
+	///Folds scan responses into the adverts they answer. In an active
+	///scan, a scannable advert (ADV_IND or ADV_SCAN_IND) is held for a
+	///short window. If a SCAN_RSP from the same address arrives within
+	///it, one combined report is emitted: it has the type, RSSI and
+	///timestamp of the advert, and its data is the advert's AD structures
+	///followed by the scan response's, so lookups find the advert's copy
+	///of anything which appears in both. Adverts whose window runs out are
+	///released as they are, and so are scan responses with no advert
+	///waiting. Everything else passes straight through.
+	///
+	///At most max_pending adverts are held. When that fills, the oldest
+	///is released early. Nothing is allocated after construction.
+	class ScanResponseMerger
+	{
+		public:
+			typedef std::chrono::steady_clock Clock;
+
+			explicit ScanResponseMerger(Clock::duration window=std::chrono::milliseconds(50), std::size_t max_pending=64);
+
+			///Hand a report to the merger. Anything which is ready, including
+			///held adverts whose window has run out by the report's timestamp,
+			///is passed to out.
+			void add(const AdvertisingView& advert, AdvertisingSink& out);
+
+			///Release held adverts whose window has run out by now.
+			void release(Clock::time_point now, AdvertisingSink& out);
+
+			///Release everything held.
+			void release_all(AdvertisingSink& out);
+
+			///Drop everything held.
+			void clear();
+
+			///When the next held advert must be released, if any are held.
+			bool next_deadline(Clock::time_point& deadline) const;
+
+			Clock::duration window() const;
+			std::size_t pending() const;
+
+			std::uint64_t merged() const;    //Adverts combined with a scan response
+			std::uint64_t timed_out() const; //Adverts released without one
+
+		private:
+			struct Pending
+			{
+				bool used;
+				AdvertisingView advert;
+				Clock::time_point deadline;
+				std::uint8_t length;
+				std::uint8_t data[62];  //Advert, then scan response
+			};
+
+			Clock::duration window_;
+			std::vector<Pending> slots;
+			std::size_t num_pending=0;
+			std::uint64_t num_merged=0;
+			std::uint64_t num_timed_out=0;
+
+			void emit(Pending&, AdvertisingSink& out);
+	};
+}
+
+#endif
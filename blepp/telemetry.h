@@ -0,0 +1,146 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef __INC_BLEPP_TELEMETRY_H
+#define __INC_BLEPP_TELEMETRY_H
+
+#include <array>
+#include <string>
+#include <functional>
+#include <unordered_map>
+#include <blepp/lescan.h>
+
+namespace BLEPP
+{
+	///A single value decoded from a broadcast. Numeric readings are in
+	///value. Byte readings (identifiers and URLs) point in to the advert,
+	///so like AdvertisingView they are only valid during the callback.
+	struct Reading
+	{
+		enum Type
+		{
+			Temperature,     //Degrees C
+			BatteryVoltage,  //Volts
+			TxPower,         //dBm: measured at 1m for iBeacon, calibrated at 0m for Eddystone
+			AdvertCount,     //Adverts sent since power on
+			Uptime,          //Seconds since power on
+			Major,
+			Minor,
+			Identifier,      //Bytes: iBeacon proximity UUID, Eddystone namespace and instance or EID
+			URL,             //Bytes: Eddystone URL scheme prefix and encoded URL. See eddystone_url().
+		};
+
+		const char* source;  //Name of the format, e.g. "iBeacon" or "Eddystone-TLM"
+		Type type;
+		double value;
+		const uint8_t* data;
+		uint8_t length;
+	};
+
+	///Receives readings from decoders, one at a time.
+	class ReadingSink
+	{
+		public:
+			virtual void on_reading(const Reading&) = 0;
+			virtual ~ReadingSink(){}
+	};
+
+	///Wrap any callable as a ReadingSink. Use make_reading_sink().
+	template<class F> class ReadingFunctionSink: public ReadingSink
+	{
+		private:
+			F& f;
+		public:
+			ReadingFunctionSink(F& f_)
+			:f(f_)
+			{}
+
+			void on_reading(const Reading& r) override
+			{
+				f(r);
+			}
+	};
+
+	template<class F> ReadingFunctionSink<F> make_reading_sink(F& f)
+	{
+		return ReadingFunctionSink<F>(f);
+	}
+
+	///Decoders get the payload following the company ID (for manufacturer 
+	///data) or the UUID (for service data). They return false if the 
+	///payload is not in the expected format.
+	typedef std::function<bool(const uint8_t* data, size_t length, ReadingSink&)> TelemetryDecoder;
+
+	///Dispatches manufacturer data by company ID and service data by 
+	///UUID to registered decoders, with a hash lookup for each.
+	class TelemetryRegistry
+	{
+		public:
+			///Optionally with the built in iBeacon and Eddystone decoders.
+			explicit TelemetryRegistry(bool builtin_decoders=true);
+
+			///Replaces any existing decoder for the same key.
+			void add_manufacturer_decoder(uint16_t company_id, const TelemetryDecoder&);
+			void add_service_decoder(const UUID& uuid, const TelemetryDecoder&);
+
+			///Decode everything in the advert which has a decoder, without
+			///allocating. Returns the number of payloads successfully decoded.
+			int decode(const AdvertisingView& advert, ReadingSink& sink) const;
+			int decode(const AdvertisingResponse& advert, ReadingSink& sink) const;
+
+			uint64_t malformed() const;
+
+		private:
+			typedef std::array<uint8_t, 16> Key128;
+			struct Key128Hash
+			{
+				size_t operator()(const Key128&) const;
+			};
+
+			std::unordered_map<uint16_t, TelemetryDecoder> manufacturer_decoders;
+			std::unordered_map<Key128, TelemetryDecoder, Key128Hash> service_decoders;
+			mutable uint64_t malformed_count=0;
+
+			static Key128 key(const UUID&);
+			bool run(const TelemetryDecoder&, const uint8_t*, size_t, ReadingSink&) const;
+			int decode_manufacturer_data(const uint8_t* data, size_t length, ReadingSink& sink) const;
+			int decode_service_data(const UUID& uuid, const uint8_t* data, size_t length, ReadingSink& sink) const;
+	};
+
+	namespace Telemetry
+	{
+		static const uint16_t apple_company_id = 0x004C;
+		static const uint16_t eddystone_uuid = 0xFEAA;
+
+		///Apple iBeacon, in manufacturer data after the company ID.
+		bool decode_ibeacon(const uint8_t* data, size_t length, ReadingSink& sink);
+
+		///Eddystone UID, URL, TLM (unencrypted) and EID frames, in service 
+		///data after the UUID.
+		bool decode_eddystone(const uint8_t* data, size_t length, ReadingSink& sink);
+
+		///Expand the URL reading from an Eddystone-URL frame.
+		std::string eddystone_url(const uint8_t* data, size_t length);
+	}
+}
+
+#endif
@@ -0,0 +1,87 @@
+#include <blepp/advert_filter.h>
+#include <blepp/gap.h>
+#include <iostream>
+#include <random>
+#include <chrono>
+#include <cstdlib>
+
+using namespace std;
+using namespace BLEPP;
+
+//Measure how quickly AdvertFilter rejects adverts, compared to building
+//an AdvertisingResponse for each one. No bluetooth hardware is needed:
+//the adverts are synthetic HCI packets.
+//
+//Usage: filter_benchmark [num_subscriptions [num_packets]]
+
+int main(int argc, char** argv)
+{
+	log_level = LogLevels::Error;
+
+	int num_subs = argc > 1 ? atoi(argv[1]) : 1000;
+	int num_packets = argc > 2 ? atoi(argv[2]) : 10000;
+	const int rounds=100;
+
+	mt19937 rng(1);
+	auto byte = [&](){ return static_cast<uint8_t>(rng()); };
+
+	//A mix of MAC, prefix, company and UUID subscriptions.
+	vector<Subscription> subs(num_subs);
+	for(int i=0; i < num_subs; i++)
+	{
+		subs[i].id = i;
+		uint8_t b[6] = {byte(), byte(), byte(), byte(), byte(), byte()};
+
+		switch(i%4)
+		{
+			case 0: subs[i].addresses.push_back(BLEAddress(b)); break;
+			case 1: subs[i].address_prefixes.push_back(BLEAddress(b).str().substr(0, 8)); break;
+			case 2: subs[i].company_ids.push_back(rng() % 0x1000); subs[i].min_rssi = -70; break;
+			case 3: subs[i].service_uuids.push_back(UUID(static_cast<uint16_t>(rng()))); break;
+		}
+	}
+	AdvertFilter filter(subs);
+
+	//Typical adverts: flags, a 16 bit UUID and some manufacturer data. 
+	vector<vector<uint8_t>> packets;
+	for(int i=0; i < num_packets; i++)
+	{
+		vector<uint8_t> ad = {
+			0x02, GAP::flags, 0x06,
+			0x03, GAP::complete_list_of_16_bit_UUIDs, byte(), byte(),
+			0x09, GAP::manufacturer_data, byte(), byte(), byte(), byte(), byte(), byte(), byte(), byte(),
+		};
+
+		vector<uint8_t> p = {0x04, 0x3E, static_cast<uint8_t>(12 + ad.size()), 0x02, 0x01, 0x00, 0x01};
+		for(int j=0; j < 6; j++)
+			p.push_back(byte());
+		p.push_back(ad.size());
+		p.insert(p.end(), ad.begin(), ad.end());
+		p.push_back(-40 - rng()%60);
+		packets.push_back(p);
+	}
+
+	auto time = [&](AdvertisingSink& sink)
+	{
+		auto t0 = chrono::steady_clock::now();
+		for(int r=0; r < rounds; r++)
+			for(const auto& p: packets)
+				HCIScanner::parse_packet(p.data(), p.size(), sink);
+		return chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+	};
+
+	uint64_t matched=0;
+	AdvertFilterSink filtered(filter, [&](const AdvertisingView&, const vector<Subscription::Id>&){ matched++; });
+	double t_filter = time(filtered);
+
+	uint64_t uuids=0;
+	auto build = [&](const AdvertisingView& a){ uuids += a.materialize().UUIDs.size(); };
+	auto materialize = make_advertising_sink(build);
+	double t_full = time(materialize);
+
+	double n = static_cast<double>(rounds) * num_packets;
+	cout << num_subs << " subscriptions, " << n << " adverts" << endl;
+	cout << "Filter:      " << filtered.rejected() << " rejected, " << filtered.accepted() << " accepted, "
+	     << filtered.rejected() / t_filter << " rejected adverts/s" << endl;
+	cout << "Materialize: " << n / t_full << " adverts/s (" << uuids << " UUIDs)" << endl;
+}
@@ -33,18 +33,26 @@ int main(int argc, char** argv)
 	HCIScanner::ScanType type = HCIScanner::ScanType::Active;
 	HCIScanner::FilterDuplicates filter = HCIScanner::FilterDuplicates::Software;
 	int c;
-	string help = R"X(-[sHbdhp]:
+	bool merge = false;
+	int refresh = 0;
+	string help = R"X(-[sHbdhpm] [-r seconds]:
   -s  software filtering of duplicates (default)
   -H  hardware filtering of duplicates 
   -b  both hardware and software filtering
   -d  show duplicates (no filtering)
   -h  show this message
   -p  passive scan
+  -m  merge scan responses with their adverts
+  -r  report each device again every so many seconds
 )X";
-	while((c=getopt(argc, argv, "sHbdhp")) != -1)
+	while((c=getopt(argc, argv, "sHbdhpmr:")) != -1)
 	{
 		if(c == 'p')
 			type = HCIScanner::ScanType::Passive;
+		else if(c == 'm')
+			merge = true;
+		else if(c == 'r')
+			refresh = atoi(optarg);
 		else if(c == 's')
 			filter = HCIScanner::FilterDuplicates::Software;
 		else if(c == 'H')
@@ -68,6 +76,10 @@ int main(int argc, char** argv)
 
 	log_level = LogLevels::Warning;
 	HCIScanner scanner(true, filter, type);
+	if(merge)
+		scanner.set_scan_response_merging(chrono::milliseconds(50));
+	if(refresh > 0)
+		scanner.set_refresh_interval(chrono::seconds(refresh));
 	
 	//Catch the interrupt signal. If the scanner is not 
 	//cleaned up properly, then it doesn't reset the HCI state.
@@ -89,6 +101,12 @@ int main(int argc, char** argv)
 		timeout.tv_sec = 0;     
 		timeout.tv_usec = 300000;
 
+		//Wake up in time to release adverts waiting for a scan response,
+		//or to refresh the duplicate filters.
+		int next_timeout = scanner.next_timeout_ms();
+		if(next_timeout >= 0 && next_timeout < 300)
+			timeout.tv_usec = next_timeout * 1000;
+
 		fd_set fds;
 		FD_ZERO(&fds);
 		FD_SET(scanner.get_fd(), &fds);
@@ -98,7 +116,7 @@ int main(int argc, char** argv)
 		if(err < 0 && errno == EINTR)	
 			break;
 		
-		if(FD_ISSET(scanner.get_fd(), &fds))
+		if(FD_ISSET(scanner.get_fd(), &fds) || scanner.next_timeout_ms() == 0)
 		{
 			//Only read id there's something to read
 			vector<AdvertisingResponse> ads = scanner.get_advertisements();
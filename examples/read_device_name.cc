@@ -58,15 +58,16 @@ int main(int argc, char **argv)
 			for(auto& characteristic: service.characteristics)
 				if(characteristic.uuid == UUID("2a00"))
 				{
-					characteristic.cb_read = [&](const PDUReadResponse& r)
+					//Names can be up to 248 bytes, which is more than fits in
+					//a single read at the default MTU, so do a long read.
+					characteristic.cb_long_read = [&](const LongReadResponse& r)
 					{
 						cout << "Hello, my name is: ";
-						auto v = r.value();
-						cout << string(v.first, v.second) << ". You killed my father. repare to die." << endl;
+						cout << string(r.value.begin(), r.value.end()) << ". You killed my father. repare to die." << endl;
 						gatt.close();
 					};
 						
-					characteristic.read_request();
+					characteristic.long_read_request();
 					goto name_found;
 				}
 
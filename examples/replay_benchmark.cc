@@ -0,0 +1,105 @@
+#include <blepp/lescan.h>
+#include <blepp/hci_replay.h>
+#include <iostream>
+#include <chrono>
+#include <atomic>
+#include <new>
+#include <cstdlib>
+#include <poll.h>
+
+using namespace std;
+using namespace BLEPP;
+
+//Measure the whole scanner pipeline, from reading the socket to handing
+//each report to a sink, by replaying a capture through HCIScanner. Every
+//allocation made while the benchmark runs is counted.
+//
+//Usage: replay_benchmark [capture [rounds]]
+//
+//The capture can be anything HCIReplay reads, e.g. from btmon -w. The
+//default is the corpus in tests/data. With -r, the capture is played
+//once with its original timing instead.
+
+static atomic<uint64_t> allocations{0};
+
+void* operator new(size_t n)
+{
+	allocations++;
+	if(void* p = malloc(n ? n : 1))
+		return p;
+	throw bad_alloc();
+}
+
+void operator delete(void* p) noexcept
+{
+	free(p);
+}
+
+void operator delete(void* p, size_t) noexcept
+{
+	free(p);
+}
+
+int main(int argc, char** argv)
+{
+	log_level = LogLevels::Error;
+
+	bool real_time = argc > 1 && string(argv[1]) == "-r";
+	if(real_time)
+	{
+		argc--;
+		argv++;
+	}
+
+	string filename = argc > 1 ? argv[1] : "tests/data/adverts.btsnoop";
+	int rounds = real_time ? 1 : argc > 2 ? atoi(argv[2]) : 100;
+
+	HCIReplay replay(filename);
+	HCIScanner scanner(replay.get_fd(), HCIScanner::FilterDuplicates::Off);
+
+	//Do a little work with each report, as a real program would.
+	uint64_t reports=0, named=0;
+	auto report = [&](const AdvertisingView& a){
+		reports++;
+		if(a.local_name())
+			named++;
+	};
+	auto sink = make_advertising_sink(report);
+
+	uint64_t allocations_before = allocations;
+	auto t0 = chrono::steady_clock::now();
+
+	for(int r=0; r < rounds; r++)
+	{
+		replay.start(real_time ? HCIReplay::Pacing::RealTime : HCIReplay::Pacing::Fast);
+
+		for(;;)
+		{
+			replay.feed();
+			
+			if(replay.done())
+			{
+				//Drain what's left in the socket.
+				uint64_t before;
+				do
+				{
+					before = reports;
+					scanner.get_advertisements(sink, 0);
+				}while(reports != before);
+				break;
+			}
+			
+			pollfd p = {scanner.get_fd(), POLLIN, 0};
+			poll(&p, 1, replay.next_due_ms());
+			scanner.get_advertisements(sink, 0);
+		}
+	}
+
+	double t = chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+	uint64_t allocated = allocations - allocations_before;
+
+	cout << replay.packets().size() << " events x " << rounds << " rounds, " << reports << " reports (" << named << " named)" << endl;
+	cout << reports / t << " reports/s" << endl;
+	cout << t * 1e9 / reports << " ns/report" << endl;
+	cout << static_cast<double>(allocated) / reports << " allocations/report" << endl;
+}
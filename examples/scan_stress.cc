@@ -0,0 +1,109 @@
+#include <blepp/lescan.h>
+#include <blepp/advert_generator.h>
+#include <blepp/advert_filter.h>
+#include <blepp/device_tracker.h>
+#include <iostream>
+#include <iomanip>
+#include <chrono>
+#include <functional>
+#include <cstdlib>
+
+using namespace std;
+using namespace BLEPP;
+
+//Push simulated crowds of devices through the scanner and each stage
+//that sits behind it, to find out at what density throughput collapses.
+//No bluetooth hardware is needed.
+//
+//Usage: scan_stress [reports [devices...]]
+//
+//The default is 300000 reports from each of 1000, 10000 and 100000 devices.
+
+//Run reports through a scanner, returning reports/s.
+double run(AdvertGenerator& gen, HCIScanner& scanner, AdvertisingSink& sink, size_t reports)
+{
+	auto t0 = chrono::steady_clock::now();
+	for(size_t n=0; n < reports;)
+	{
+		n += gen.feed(reports - n);
+		scanner.get_advertisements(sink, 0);
+	}
+
+	//Drain what's left.
+	for(int i=0; i < 1000; i++)
+		scanner.get_advertisements(sink, 0);
+
+	return reports / chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+}
+
+int main(int argc, char** argv)
+{
+	log_level = LogLevels::Error;
+
+	size_t reports = argc > 1 ? atol(argv[1]) : 300000;
+	vector<size_t> crowds;
+	for(int i=2; i < argc; i++)
+		crowds.push_back(atol(argv[i]));
+	if(crowds.empty())
+		crowds = {1000, 10000, 100000};
+
+	cout << setw(8) << "devices" << setw(14) << "generate/s" << setw(14) << "parse/s" << setw(14) << "dedup/s" 
+	     << setw(12) << "unique" << setw(12) << "evictions" << setw(14) << "filter/s" << setw(14) << "track/s" << setw(10) << "tracked" << endl;
+
+	for(size_t devices: crowds)
+	{
+		AdvertGenerator::Config cfg;
+		cfg.devices = devices;
+		cfg.rotation_period = chrono::seconds(900);
+
+		//The generator on its own, as a baseline.
+		double generate;
+		{
+			AdvertGenerator gen(cfg);
+			vector<uint8_t> packet;
+			auto t0 = chrono::steady_clock::now();
+			for(size_t i=0; i < reports; i++)
+				gen.next(packet);
+			generate = reports / chrono::duration<double>(chrono::steady_clock::now() - t0).count();
+		}
+
+		uint64_t count=0;
+		auto counter = [&](const AdvertisingView&){ count++; };
+		auto counting = make_advertising_sink(counter);
+
+		//Parsing only.
+		AdvertGenerator g1(cfg);
+		HCIScanner s1(g1.get_fd(), HCIScanner::FilterDuplicates::Off);
+		double parse = run(g1, s1, counting, reports);
+
+		//Software duplicate filtering, with the default table size.
+		AdvertGenerator g2(cfg);
+		HCIScanner s2(g2.get_fd(), HCIScanner::FilterDuplicates::Software);
+		count = 0;
+		double dedup = run(g2, s2, counting, reports);
+		uint64_t unique = count;
+
+		//Subscription matching, with a thousand subscriptions.
+		vector<Subscription> subs(1000);
+		for(size_t i=0; i < subs.size(); i++)
+		{
+			subs[i].id = i;
+			subs[i].company_ids.push_back(i);
+		}
+		AdvertFilter filter(subs);
+		AdvertFilterSink filtered(filter, [](const AdvertisingView&, const vector<Subscription::Id>&){});
+		AdvertGenerator g3(cfg);
+		HCIScanner s3(g3.get_fd(), HCIScanner::FilterDuplicates::Off);
+		double filtering = run(g3, s3, filtered, reports);
+
+		//Tracking every device.
+		DeviceTracker tracker(2*devices);
+		AdvertGenerator g4(cfg);
+		HCIScanner s4(g4.get_fd(), HCIScanner::FilterDuplicates::Off);
+		double tracking = run(g4, s4, tracker, reports);
+
+		cout << setw(8) << devices << setw(14) << generate << setw(14) << parse << setw(14) << dedup 
+		     << setw(12) << unique << setw(12) << s2.software_filter().evictions() << setw(14) << filtering 
+		     << setw(14) << tracking << setw(10) << tracker.size() << endl;
+	}
+}
@@ -0,0 +1,288 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include "blepp/advert_filter.h"
+#include "blepp/gap.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+namespace BLEPP
+{
+	//The Bluetooth base UUID, little endian, without the top 32 bits.
+	//See Bluetooth 4.0, Part B, Section 2.5.1
+	static const std::array<uint8_t, 12> base_uuid_stem{{
+		0xFB, 0x34, 0x9B, 0x5F, 0x80, 0x00, 0x00, 0x80, 0x00, 0x10, 0x00, 0x00 }};
+
+	static uint32_t get_u32(const uint8_t* p)
+	{
+		return p[0] | (p[1] << 8) | (p[2] << 16) | (static_cast<uint32_t>(p[3]) << 24);
+	}
+
+	//An address prefix key, using the top len bytes.
+	static uint64_t prefix_key(uint64_t address, int len)
+	{
+		return (static_cast<uint64_t>(len) << 48) | (address >> (8*(6-len)));
+	}
+
+	size_t AdvertFilter::StemHash::operator()(const UUIDStem& s) const
+	{
+		uint64_t a, b=0;
+		memcpy(&a, s.data(), 8);
+		memcpy(&b, s.data()+8, 4);
+		return std::hash<uint64_t>()(a ^ (b * 0x9E3779B97F4A7C15ull));
+	}
+
+	AdvertFilter::AdvertFilter(const std::vector<Subscription>& subs)
+	{
+		address_required = !subs.empty();
+		lowest_min_rssi = 127;
+
+		for(uint32_t i=0; i < subs.size(); i++)
+		{
+			const Subscription& s = subs[i];
+			uint32_t req = 0;
+
+			ids.push_back(s.id);
+			min_rssi.push_back(s.min_rssi.value_or(-128));
+			lowest_min_rssi = std::min(lowest_min_rssi, min_rssi.back());
+
+			for(const auto& a: s.addresses)
+			{
+				address_map[prefix_key(a.to_uint64(), 6)].push_back(i);
+				prefix_lengths.push_back(6);
+				req |= Address;
+			}
+
+			for(const auto& p: s.address_prefixes)
+			{
+				//Each byte is 2 hex digits and a colon, except the last.
+				int len = (p.size()+1)/3;
+				if(len < 1 || len > 6)
+					throw std::invalid_argument("Bad address prefix: " + p);
+
+				std::string full = p;
+				for(int j=len; j < 6; j++)
+					full += ":00";
+
+				address_map[prefix_key(BLEAddress(full).to_uint64(), len)].push_back(i);
+				prefix_lengths.push_back(len);
+				req |= Address;
+			}
+
+			for(uint16_t c: s.company_ids)
+			{
+				company_map[c].push_back(i);
+				req |= Company;
+			}
+
+			for(const auto& u: s.service_uuids)
+			{
+				bt_uuid_t full;
+				bt_uuid_to_uuid128(&u, &full);
+
+				UUIDStem stem;
+				memcpy(stem.data(), full.value.u128.data, 12);
+				uuid_map[stem][get_u32(full.value.u128.data + 12)].push_back(i);
+				req |= Service;
+			}
+
+			//Repeated keys are harmless: the hits are merged when matching.
+			if(!(req & Address))
+				address_required = false;
+
+			if(req == 0)
+				unkeyed.push_back(i);
+
+			required.push_back(req);
+		}
+
+		if(subs.empty())
+			lowest_min_rssi = -128;
+
+		std::sort(prefix_lengths.begin(), prefix_lengths.end());
+		prefix_lengths.erase(std::unique(prefix_lengths.begin(), prefix_lengths.end()), prefix_lengths.end());
+	}
+
+	size_t AdvertFilter::size() const
+	{
+		return ids.size();
+	}
+
+	void AdvertFilter::lookup_uuid(uint32_t short_uuid, std::vector<uint32_t>& hits) const
+	{
+		auto s = uuid_map.find(base_uuid_stem);
+		if(s == uuid_map.end())
+			return;
+
+		auto u = s->second.find(short_uuid);
+		if(u != s->second.end())
+			for(uint32_t i: u->second)
+				hits.push_back((i << criterion_bits) | Service);
+	}
+
+	void AdvertFilter::lookup_uuid(const uint8_t* uuid128, std::vector<uint32_t>& hits) const
+	{
+		UUIDStem stem;
+		memcpy(stem.data(), uuid128, 12);
+
+		auto s = uuid_map.find(stem);
+		if(s == uuid_map.end())
+			return;
+
+		auto u = s->second.find(get_u32(uuid128 + 12));
+		if(u != s->second.end())
+			for(uint32_t i: u->second)
+				hits.push_back((i << criterion_bits) | Service);
+	}
+
+	bool AdvertFilter::match(const AdvertisingView& a, std::vector<Subscription::Id>& hits) const
+	{
+		hits.clear();
+
+		//127 means the RSSI is not available
+		int rssi = a.rssi==127 ? -128 : a.rssi;
+		if(ids.empty() || rssi < lowest_min_rssi)
+			return false;
+
+		if(!prefix_lengths.empty())
+		{
+			uint64_t address = a.address.to_uint64();
+			for(int len: prefix_lengths)
+			{
+				auto m = address_map.find(prefix_key(address, len));
+				if(m != address_map.end())
+					for(uint32_t i: m->second)
+						hits.push_back((i << criterion_bits) | Address);
+			}
+
+			//Cheap rejection before looking at the payload.
+			if(address_required && hits.empty())
+				return false;
+		}
+
+		if(!company_map.empty() || !uuid_map.empty())
+		{
+			for(const ADStructure& s: a)
+			{
+				const uint8_t* d = s.data;
+				size_t n = s.length;
+
+				switch(s.type)
+				{
+					case GAP::manufacturer_data:
+						if(n >= 2 && !company_map.empty())
+						{
+							auto m = company_map.find(d[0] | (d[1] << 8));
+							if(m != company_map.end())
+								for(uint32_t i: m->second)
+									hits.push_back((i << criterion_bits) | Company);
+						}
+						break;
+
+					case GAP::incomplete_list_of_16_bit_UUIDs:
+					case GAP::complete_list_of_16_bit_UUIDs:
+						for(size_t j=0; j+2 <= n; j+=2)
+							lookup_uuid(static_cast<uint32_t>(d[j] | (d[j+1] << 8)), hits);
+						break;
+
+					case GAP::incomplete_list_of_32_bit_UUIDs:
+					case GAP::complete_list_of_32_bit_UUIDs:
+						for(size_t j=0; j+4 <= n; j+=4)
+							lookup_uuid(get_u32(d+j), hits);
+						break;
+
+					case GAP::incomplete_list_of_128_bit_UUIDs:
+					case GAP::complete_list_of_128_bit_UUIDs:
+						for(size_t j=0; j+16 <= n; j+=16)
+							lookup_uuid(d+j, hits);
+						break;
+
+					case GAP::service_data_16_bit_UUID:
+						if(n >= 2)
+							lookup_uuid(static_cast<uint32_t>(d[0] | (d[1] << 8)), hits);
+						break;
+
+					case GAP::service_data_32_bit_UUID:
+						if(n >= 4)
+							lookup_uuid(get_u32(d), hits);
+						break;
+
+					case GAP::service_data_128_bit_UUID:
+						if(n >= 16)
+							lookup_uuid(d, hits);
+						break;
+				}
+			}
+		}
+
+		for(uint32_t i: unkeyed)
+			hits.push_back(i << criterion_bits);
+
+		if(hits.empty())
+			return false;
+
+		//Group the hits by subscription and see which have every criterion they need.
+		std::sort(hits.begin(), hits.end());
+
+		size_t out=0;
+		for(size_t j=0; j < hits.size();)
+		{
+			uint32_t sub = hits[j] >> criterion_bits;
+			uint32_t got = 0;
+			for(; j < hits.size() && (hits[j] >> criterion_bits) == sub; j++)
+				got |= hits[j] & ((1 << criterion_bits) - 1);
+
+			if(got == required[sub] && rssi >= min_rssi[sub])
+				hits[out++] = ids[sub];
+		}
+		hits.resize(out);
+
+		return out != 0;
+	}
+
+	AdvertFilterSink::AdvertFilterSink(const AdvertFilter& f, const Callback& c)
+	:filter(f), callback(c)
+	{
+	}
+
+	void AdvertFilterSink::on_advertisement(const AdvertisingView& a)
+	{
+		if(filter.match(a, matches))
+		{
+			accepted_count++;
+			callback(a, matches);
+		}
+		else
+			rejected_count++;
+	}
+
+	uint64_t AdvertFilterSink::accepted() const
+	{
+		return accepted_count;
+	}
+
+	uint64_t AdvertFilterSink::rejected() const
+	{
+		return rejected_count;
+	}
+}
@@ -0,0 +1,239 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include "blepp/advert_generator.h"
+#include "blepp/gap.h"
+#include "blepp/lescan.h"
+
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace std;
+using namespace std::chrono;
+
+namespace BLEPP
+{
+	AdvertGenerator::AdvertGenerator()
+	:AdvertGenerator(Config())
+	{}
+
+	AdvertGenerator::AdvertGenerator(const Config& c)
+	:cfg(c), rng(c.seed), noise(0, c.rssi_noise > 0 ? c.rssi_noise : 1e-9)
+	{
+		if(cfg.min_interval.count() <= 0 || cfg.max_interval < cfg.min_interval)
+			throw invalid_argument("AdvertGenerator: bad advertising interval range");
+		if(cfg.rssi_max < cfg.rssi_min)
+			throw invalid_argument("AdvertGenerator: bad RSSI range");
+
+		auto chance = [&](double p){ return uniform_real_distribution<double>()(rng) < p; };
+		auto uniform = [&](int lo, int hi){ return uniform_int_distribution<int>(lo, hi)(rng); };
+
+		devices.resize(cfg.devices);
+		for(size_t i=0; i < devices.size(); i++)
+		{
+			Device& d = devices[i];
+			d.random = chance(cfg.random_addresses);
+			d.connectable = chance(0.5);
+			d.rssi = uniform(cfg.rssi_min, cfg.rssi_max);
+			d.interval = microseconds(uniform_int_distribution<int64_t>(duration_cast<microseconds>(cfg.min_interval).count(), duration_cast<microseconds>(cfg.max_interval).count())(rng));
+			new_address(d);
+
+			//Build the advertising data once: flags, then whatever fits.
+			uint8_t* p = d.payload;
+			auto left = [&](){ return static_cast<int>(d.payload + sizeof(d.payload) - p); };
+
+			*p++ = 2;
+			*p++ = GAP::flags;
+			*p++ = 0x06; //LE general discoverable, BR/EDR not supported
+
+			if(chance(cfg.uuids))
+			{
+				int n = uniform(1, 3);
+				*p++ = 1 + 2*n;
+				*p++ = GAP::complete_list_of_16_bit_UUIDs;
+				for(int j=0; j < n; j++)
+				{
+					*p++ = rng();
+					*p++ = rng();
+				}
+			}
+
+			if(chance(cfg.manufacturer_data))
+			{
+				int n = uniform(4, 8);
+				*p++ = 3 + n;
+				*p++ = GAP::manufacturer_data;
+				for(int j=0; j < n+2; j++)
+					*p++ = rng();
+			}
+
+			if(chance(cfg.names))
+			{
+				string name = "dev" + to_string(i);
+				int n = min(static_cast<int>(name.size()), left() - 2);
+				if(n > 0)
+				{
+					*p++ = 1 + n;
+					*p++ = n == static_cast<int>(name.size()) ? GAP::complete_local_name : GAP::shortened_local_name;
+					p = copy(name.begin(), name.begin() + n, p);
+				}
+			}
+
+			d.payload_length = p - d.payload;
+
+			if(d.random && cfg.rotation_period.count() > 0)
+				d.next_rotation = microseconds(uniform_int_distribution<int64_t>(0, duration_cast<microseconds>(cfg.rotation_period).count() - 1)(rng));
+			else
+				d.next_rotation = microseconds::max();
+
+			//Start at a random point in the first interval.
+			schedule.push({microseconds(uniform_int_distribution<int64_t>(0, d.interval.count() - 1)(rng)), static_cast<uint32_t>(i)});
+		}
+
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+			throw runtime_error(string("Creating generator socket: ") + strerror(errno));
+
+		int size = 1 << 20;
+		setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	}
+
+	AdvertGenerator::~AdvertGenerator()
+	{
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	void AdvertGenerator::new_address(Device& d)
+	{
+		for(auto& b: d.address)
+			b = rng();
+
+		//Resolvable private addresses have 01 in the top two bits.
+		if(d.random)
+			d.address[5] = (d.address[5] & 0x3f) | 0x40;
+
+		d.address_used = false;
+	}
+
+	microseconds AdvertGenerator::next(vector<uint8_t>& packet)
+	{
+		if(schedule.empty())
+			throw logic_error("AdvertGenerator: no devices");
+
+		Due due = schedule.top();
+		schedule.pop();
+		Device& d = devices[due.device];
+
+		if(due.when >= d.next_rotation)
+		{
+			new_address(d);
+			d.next_rotation += duration_cast<microseconds>(cfg.rotation_period);
+		}
+
+		if(!d.address_used)
+		{
+			d.address_used = true;
+			num_addresses++;
+		}
+
+		int rssi = static_cast<int>(d.rssi + noise(rng) + 0.5);
+		rssi = max(-127, min(20, rssi));
+
+		packet.resize(15 + d.payload_length);
+		uint8_t* p = packet.data();
+		*p++ = 0x04;                      //HCI event
+		*p++ = 0x3E;                      //LE meta event
+		*p++ = 12 + d.payload_length;     //Parameter length
+		*p++ = 0x02;                      //Advertising report
+		*p++ = 1;                         //Number of reports
+		*p++ = static_cast<uint8_t>(d.connectable ? LeAdvertisingEventType::ADV_IND : LeAdvertisingEventType::ADV_NONCONN_IND);
+		*p++ = d.random;
+		p = copy(d.address, d.address + 6, p);
+		*p++ = d.payload_length;
+		p = copy(d.payload, d.payload + d.payload_length, p);
+		*p++ = static_cast<uint8_t>(rssi);
+
+		//advDelay: a pseudo random 0-10ms added to every interval.
+		schedule.push({due.when + d.interval + microseconds(uniform_int_distribution<int>(0, 10000)(rng)), due.device});
+
+		return due.when;
+	}
+
+	vector<HCIReplay::Packet> AdvertGenerator::generate(size_t count)
+	{
+		vector<HCIReplay::Packet> packets(count);
+		for(auto& p: packets)
+			p.timestamp = next(p.data);
+		return packets;
+	}
+
+	vector<HCIReplay::Packet> AdvertGenerator::generate(microseconds until)
+	{
+		vector<HCIReplay::Packet> packets;
+		while(!schedule.empty() && schedule.top().when < until)
+		{
+			packets.emplace_back();
+			packets.back().timestamp = next(packets.back().data);
+		}
+		return packets;
+	}
+
+	size_t AdvertGenerator::addresses() const
+	{
+		return num_addresses;
+	}
+
+	const AdvertGenerator::Config& AdvertGenerator::config() const
+	{
+		return cfg;
+	}
+
+	int AdvertGenerator::get_fd() const
+	{
+		return fds[0];
+	}
+
+	size_t AdvertGenerator::feed(size_t max)
+	{
+		size_t written=0;
+
+		for(; written < max; written++)
+		{
+			//A packet which didn't fit last time goes first.
+			if(pending.empty())
+				next(pending);
+
+			if(send(fds[1], pending.data(), pending.size(), MSG_DONTWAIT) < 0)
+			{
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				throw runtime_error(string("Writing generator socket: ") + strerror(errno));
+			}
+			pending.clear();
+		}
+
+		return written;
+	}
+}
@@ -1131,7 +1131,7 @@ namespace BLEPP
 		if (len < min_len)
 			return 0;
 
-		if (pdu[0] != ATT_OP_PREP_WRITE_REQ)
+		if (pdu[0] != ATT_OP_PREP_WRITE_RESP)
 			return 0;
 
 		*handle = att_get_u16(&pdu[1]);
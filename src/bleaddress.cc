@@ -0,0 +1,105 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include <blepp/bleaddress.h>
+
+#include <cstring>
+#include <stdexcept>
+
+namespace BLEPP
+{
+	BLEAddress::BLEAddress(const std::uint8_t* little_endian, AddressType t)
+	:type(t)
+	{
+		memcpy(bytes, little_endian, 6);
+	}
+
+	static int hex_digit(char c)
+	{
+		if(c >= '0' && c <= '9')
+			return c - '0';
+		else if(c >= 'a' && c <= 'f')
+			return c - 'a' + 10;
+		else if(c >= 'A' && c <= 'F')
+			return c - 'A' + 10;
+		else
+			return -1;
+	}
+
+	BLEAddress::BLEAddress(const std::string& address, AddressType t)
+	:type(t)
+	{
+		if(address.size() != 17)
+			throw std::invalid_argument("Invalid Bluetooth address: " + address);
+
+		for(int i=0; i < 6; i++)
+		{
+			int hi = hex_digit(address[i*3]);
+			int lo = hex_digit(address[i*3+1]);
+
+			if(hi < 0 || lo < 0 || (i != 5 && address[i*3+2] != ':'))
+				throw std::invalid_argument("Invalid Bluetooth address: " + address);
+
+			bytes[5-i] = hi * 16 + lo;
+		}
+	}
+
+	std::string BLEAddress::str() const
+	{
+		std::string s(17, ':');
+		const char* digits = "0123456789abcdef";
+
+		for(int i=0; i < 6; i++)
+		{
+			s[i*3+0] = digits[bytes[5-i] >> 4];
+			s[i*3+1] = digits[bytes[5-i] & 15];
+		}
+
+		return s;
+	}
+
+	std::uint64_t BLEAddress::to_uint64() const
+	{
+		std::uint64_t r=0;
+		for(int i=5; i >= 0; i--)
+			r = (r << 8) | bytes[i];
+		return r;
+	}
+
+	std::size_t BLEAddress::hash() const
+	{
+		//The 64 bit finaliser from MurmurHash3. Addresses are often
+		//allocated sequentially by manufacturers, so the bits need mixing
+		//before being used in a power-of-two sized table.
+		std::uint64_t h = to_uint64() | (static_cast<std::uint64_t>(type) << 48);
+		h ^= h >> 33;
+		h *= 0xff51afd7ed558ccdULL;
+		h ^= h >> 33;
+		h *= 0xc4ceb9fe1a85ec53ULL;
+		h ^= h >> 33;
+		return h;
+	}
+
+	std::ostream& operator<<(std::ostream& o, const BLEAddress& a)
+	{
+		return o << a.str();
+	}
+}
@@ -28,8 +28,10 @@
 #include <bluetooth/l2cap.h>
 
 #include <sys/socket.h>
+#include <poll.h>
 
 #include <unistd.h>
+#include <cerrno>
 
 namespace BLEPP
 {
@@ -64,6 +66,24 @@ namespace BLEPP
 			throw std::logic_error("Error constructing packet");
 	}
 
+	//A stalled write stream can leave the socket full. Requests are held
+	//back until there's room, but replies made straight from a response,
+	//such as the next part of a long read, are not, so wait for room
+	//rather than failing the connection.
+	static int write_pdu(int sock, const uint8_t* buf, size_t len)
+	{
+		for(;;)
+		{
+			int ret = send(sock, buf, len, MSG_DONTWAIT);
+			if(ret >= 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+				return ret;
+
+			pollfd p = {sock, POLLOUT, 0};
+			if(poll(&p, 1, -1) < 0 && errno != EINTR)
+				return -1;
+		}
+	}
+
 	class Read{};
 	class Write{};
 
@@ -82,7 +102,15 @@ namespace BLEPP
 	{
 		int len = enc_read_req(handle, buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(sock, buf.data(), len);
+		test(ret, Write);
+	}
+
+	void BLEDevice::send_read_blob_request(uint16_t handle, uint16_t offset)
+	{
+		int len = enc_read_blob_req(handle, offset, buf.data(), buf.size());
+		test_pdu(len);
+		int ret = write_pdu(sock, buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -90,7 +118,7 @@ namespace BLEPP
 	{
 		int len = enc_read_by_type_req(start, end, const_cast<bt_uuid_t*>(&uuid), buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(sock, buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -98,7 +126,7 @@ namespace BLEPP
 	{
 		int len = enc_find_info_req(start, end, buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(sock, buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -106,7 +134,7 @@ namespace BLEPP
 	{
 		int len = enc_read_by_grp_req(start, end, const_cast<bt_uuid_t*>(&uuid), buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(sock, buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -114,7 +142,7 @@ namespace BLEPP
 	{
 		int len = enc_write_req(handle, data, length, buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(sock, buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -128,7 +156,23 @@ namespace BLEPP
 	{
 		int len = enc_confirmation(buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(sock, buf.data(), len);
+		test(ret, Write);
+	}
+
+	void BLEDevice::send_prepare_write_request(uint16_t handle, uint16_t offset, const uint8_t* data, int length)
+	{
+		int len = enc_prep_write_req(handle, offset, data, length, buf.data(), buf.size());
+		test_pdu(len);
+		int ret = write_pdu(sock, buf.data(), len);
+		test(ret, Write);
+	}
+
+	void BLEDevice::send_execute_write_request(uint8_t flags)
+	{
+		int len = enc_exec_write_req(flags, buf.data(), buf.size());
+		test_pdu(len);
+		int ret = write_pdu(sock, buf.data(), len);
 		test(ret, Write);
 	}
 
@@ -136,8 +180,19 @@ namespace BLEPP
 	{
 		int len = enc_write_cmd(handle, data, length, buf.data(), buf.size());
 		test_pdu(len);
-		int ret = write(sock, buf.data(), len);
+		int ret = write_pdu(sock, buf.data(), len);
+		test(ret, Write);
+	}
+
+	bool BLEDevice::try_send_write_command(uint16_t handle, const uint8_t* data, int length)
+	{
+		int len = enc_write_cmd(handle, data, length, buf.data(), buf.size());
+		test_pdu(len);
+		int ret = send(sock, buf.data(), len, MSG_DONTWAIT);
+		if(ret < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == ENOBUFS))
+			return false;
 		test(ret, Write);
+		return true;
 	}
 
 	void BLEDevice::send_write_command(uint16_t handle, uint16_t data)
@@ -146,6 +201,14 @@ namespace BLEPP
 		send_write_command(handle, buf, 2);
 	}
 
+	void BLEDevice::send_mtu_request(uint16_t mtu)
+	{
+		int len = enc_mtu_req(mtu, buf.data(), buf.size());
+		test_pdu(len);
+		int ret = write_pdu(sock, buf.data(), len);
+		test(ret, Write);
+	}
+
 	void BLEDevice::process_att_mtu_request(PDUResponse &req_pdu)
 	{
 		uint8_t my_resp_pdu[3]; //1 byte opcode, two byte param with the size of negotiated MTU
@@ -167,7 +230,7 @@ namespace BLEPP
 			return;
 		}
 		LOG(Debug,"Sending MTU Request " << req_mtu);
-		int len = write(sock,my_req_pdu,3); //send MTU request before we resize our buffer, to spec
+		int len = write_pdu(sock,my_req_pdu,3); //send MTU request before we resize our buffer, to spec
 		test(len, Write);
 		//TODO
 		// We are just accepting the remote end max recv MTU as our max
@@ -187,7 +250,7 @@ namespace BLEPP
 			LOG(Error,"Recovered local MTU to " << my_last_mtu);
 			return;
 		}
-		len = write(sock,my_resp_pdu,3); //send MTU response
+		len = write_pdu(sock,my_resp_pdu,3); //send MTU response
 		test(len, Write);
 		LOG(Debug,"Sending MTU Resp " << my_current_mtu);
 	}
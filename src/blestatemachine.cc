@@ -148,6 +148,19 @@ namespace BLEPP
 			log_fd(::close(sock));
 		sock = -1;
 		primary_services.clear();
+		long_read = LongRead();
+		read_cb = nullptr;
+		write_cb = nullptr;
+		operations.clear();
+		long_write = LongWrite();
+		stream = WriteStream();
+
+		//The MTU belongs to the connection, so a new one starts again from the default.
+		dev.buf.resize(ATT_DEFAULT_MTU);
+		requested_mtu = ATT_DEFAULT_MTU;
+		mtu_exchange_requested = false;
+
+		io_changed();
 	}
 
 	void BLEGATTStateMachine::close()
@@ -207,7 +220,23 @@ namespace BLEPP
 		connect(address, false);
 	}
 
+	void BLEGATTStateMachine::connect_blocking(const BLEAddress& address)
+	{
+		connect(address, true);
+	}
+
+
+	void BLEGATTStateMachine::connect_nonblocking(const BLEAddress& address)
+	{
+		connect(address, false);
+	}
+
 	void BLEGATTStateMachine::connect(const std::string& address, bool blocking, bool pubaddr, std::string device)
+	{
+		connect(BLEAddress(address, pubaddr?AddressType::Public:AddressType::Random), blocking, device);
+	}
+
+	void BLEGATTStateMachine::connect(const BLEAddress& address, bool blocking, std::string device)
 	{
 		ENTER();
 
@@ -224,6 +253,7 @@ namespace BLEPP
 
 		if(sock == -1)
 			throw SocketAllocationFailed(strerror(errno));
+		io_changed();
 
 		////////////////////////////////////////
 		//Bind the socket
@@ -272,7 +302,7 @@ namespace BLEPP
 
 
 		//Address type: Low Energy PUBLIC or RANDOM
-		if (pubaddr) addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
+		if (!address.is_random()) addr.l2_bdaddr_type = BDADDR_LE_PUBLIC;
 		else addr.l2_bdaddr_type = BDADDR_LE_RANDOM;
 
 		if(log_l2cap_options(sock) == -1)
@@ -280,16 +310,10 @@ namespace BLEPP
 			reset();
 			throw SocketGetSockOptFailed(strerror(errno));
 		}
-		//Construct an address from the address string
-		
-		
-		
-
-
-		//Can also use bacpy to copy addresses about
-		int rr = str2ba(address.c_str(), &addr.l2_bdaddr);
+		//bdaddr_t is little endian, the same as BLEAddress, so the
+		//bytes can be copied straight across.
+		memcpy(addr.l2_bdaddr.b, address.bytes, 6);
 		LOG(Debug, "address = " << address);
-		LOG(Debug, "str2ba = " << rr);
 		int ret = log_fd(::connect(sock, (sockaddr*)&addr, sizeof(addr)));
 		
 
@@ -305,6 +329,7 @@ namespace BLEPP
 			}
 
 			cb_connected();
+			run_queue();
 		}
 		else if(errno == EINPROGRESS)
 		{
@@ -326,6 +351,16 @@ namespace BLEPP
 
 
 
+	void BLEGATTStateMachine::connect(int fd)
+	{
+		close_and_cleanup();
+		sock = fd;
+		reset();
+		io_changed();
+		cb_connected();
+		run_queue();
+	}
+
 	int BLEGATTStateMachine::socket()
 	{
 		return sock;
@@ -371,6 +406,42 @@ namespace BLEPP
 				last_request = ATT_OP_READ_REQ;
 				//data already sent
 			}
+			else if(state == AwaitingMTUResponse)
+			{
+				last_request = ATT_OP_MTU_REQ;
+				//data already sent
+			}
+			else if(state == AwaitingLongReadResponse)
+			{
+				//Start with an ordinary read, since short values are the common 
+				//case and servers need not support Read Blob on them.
+				uint16_t offset = long_read.value->size();
+				if(offset == 0)
+				{
+					last_request = ATT_OP_READ_REQ;
+					dev.send_read_request(long_read.handle);
+				}
+				else
+				{
+					last_request = ATT_OP_READ_BLOB_REQ;
+					dev.send_read_blob_request(long_read.handle, offset);
+				}
+				long_read.round_trips++;
+			}
+			else if(state == AwaitingPrepareWriteResponse)
+			{
+				//Each segment has 5 bytes of header: opcode, handle and offset.
+				long_write.segment = std::min<size_t>(mtu() - 5, long_write.value.size() - long_write.offset);
+				last_request = ATT_OP_PREP_WRITE_REQ;
+				dev.send_prepare_write_request(long_write.handle, long_write.offset, long_write.value.data() + long_write.offset, long_write.segment);
+				long_write.round_trips++;
+			}
+			else if(state == AwaitingExecuteWriteResponse)
+			{
+				last_request = ATT_OP_EXEC_WRITE_REQ;
+				dev.send_execute_write_request(long_write.cancelled?ATT_CANCEL_ALL_PREP_WRITES:ATT_WRITE_ALL_PREP_WRITES);
+				long_write.round_trips++;
+			}
 		}
 		catch(BLEDevice::WriteError)
 		{
@@ -386,40 +457,76 @@ namespace BLEPP
 	// Commands to move machine into other states explicitly
 	//
 
+	void BLEGATTStateMachine::submit(std::function<void()> op, bool command)
+	{
+		if(state == Disconnected)
+			throw std::logic_error("Error trying to issue command while disconnected");
+
+		operations.push_back(Operation{std::move(op), command});
+		run_queue();
+	}
+
+	void BLEGATTStateMachine::run_queue(bool writable)
+	{
+		//Each request either finishes straight away or leaves the machine
+		//waiting for a response, and this is called again once it arrives.
+		//Commands at the front need no response, so they go out regardless.
+		//A stalled stream has filled the socket, so nothing goes until
+		//write_and_process_next() finds room, rather than blocking.
+		while(!operations.empty() && (!stream.active || writable) && (state == Idle || (operations.front().command && state != Connecting)))
+		{
+			std::function<void()> op = std::move(operations.front().run);
+			operations.pop_front();
+			try
+			{
+				op();
+			}
+			catch(BLEDevice::WriteError)
+			{
+				fail(Disconnect(Disconnect::Reason::WriteError, errno));
+			}
+		}
+	}
+
+	void BLEGATTStateMachine::queue_callback(std::function<void()> cb)
+	{
+		submit(std::move(cb));
+	}
+
 	void BLEGATTStateMachine::read_primary_services()
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
-		state = ReadingPrimaryService;
-		next_handle_to_read=1;
-		state_machine_write();
+		submit([this]()
+		{
+			state = ReadingPrimaryService;
+			next_handle_to_read=1;
+			state_machine_write();
+		});
 	}
 
 	void BLEGATTStateMachine::find_all_characteristics()
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
-		state = FindAllCharacteristics;
-		next_handle_to_read=1;
-		state_machine_write();
+		submit([this]()
+		{
+			state = FindAllCharacteristics;
+			next_handle_to_read=1;
+			state_machine_write();
+		});
 	}
 
 	void BLEGATTStateMachine::get_client_characteristic_configuration()
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
-		state = GetClientCharaceristicConfiguration;
-		next_handle_to_read=1;
-		state_machine_write();
+		submit([this]()
+		{
+			state = GetClientCharaceristicConfiguration;
+			next_handle_to_read=1;
+			state_machine_write();
+		});
 	}
 
-	void BLEGATTStateMachine::set_notify_and_indicate(Characteristic& c, bool notify, bool indicate, WriteType type)
+	void BLEGATTStateMachine::set_notify_and_indicate(Characteristic& c, bool notify, bool indicate, WriteType type, std::function<void()> cb)
 	{
 		LOG(Trace, "BLEGATTStateMachine::enable_indications(Characteristic&)");
 
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
-		
 		if(!c.indicate && indicate)
 			throw std::logic_error("Error: this is not indicateable");
 		if(!c.notify && notify)
@@ -428,27 +535,48 @@ namespace BLEPP
 		//FIXME: check for CCC
 		c.ccc_last_known_value = notify | (indicate << 1);
 
+		const uint8_t value[2] = { (uint8_t)(c.ccc_last_known_value & 0xff), (uint8_t)(c.ccc_last_known_value >> 8)};
 
-		try{
-			if (type == WriteType::Request) 
-			{
-				dev.send_write_request(c.client_characteric_configuration_handle, c.ccc_last_known_value);
-				state = AwaitingWriteResponse;
-				state_machine_write();
-			} 
-			else 
-				dev.send_write_command(c.client_characteric_configuration_handle, c.ccc_last_known_value);
+		if (type == WriteType::Request) 
+			send_write_request(c.client_characteric_configuration_handle, value, 2, std::move(cb));
+		else 
+		{
+			send_write_command(c.client_characteric_configuration_handle, value, 2);
+			if(cb)
+				queue_callback(std::move(cb));
 		}
-		catch(BLEDevice::WriteError)
+	}
+
+	void BLEGATTStateMachine::set_notify_and_indicate(const std::vector<Characteristic*>& cs, bool notify, bool indicate, std::function<void()> cb, WriteType type)
+	{
+		//Check everything first so that nothing is queued if one is wrong.
+		for(const Characteristic* c: cs)
 		{
-			fail(Disconnect(Disconnect::Reason::WriteError, errno));
+			if(!c->indicate && indicate)
+				throw std::logic_error("Error: this is not indicateable");
+			if(!c->notify && notify)
+				throw std::logic_error("Error: this is not notifiable");
 		}
+
+		//Each write has its own empty callback so that cb_write_response
+		//does not fire once per characteristic.
+		for(Characteristic* c: cs)
+			set_notify_and_indicate(*c, notify, indicate, type, [](){});
+
+		if(cb)
+			queue_callback(std::move(cb));
 	}
 
 
+	void BLEGATTStateMachine::io_changed()
+	{
+		if(cb_io_changed)
+			cb_io_changed();
+	}
+
 	bool BLEGATTStateMachine::wait_on_write()
 	{
-		if(state == Connecting)
+		if(state == Connecting || stream.active)
 			return true;
 		else
 			return false;
@@ -490,7 +618,9 @@ namespace BLEPP
 				{
 					//Connected, so go to the idle state
 					reset();
+					io_changed();
 					cb_connected();
+					run_queue();
 				}
 				else
 				{
@@ -499,6 +629,15 @@ namespace BLEPP
 				}
 
 			}
+			else if(stream.active)
+			{
+				//Whatever the stall held back goes ahead of the rest.
+				run_queue(true);
+				if(stream.active)
+					pump_stream();
+				if(!stream.active)
+					run_queue();
+			}
 			else
 			{
 				LOG(Error, "Not implemented!");
@@ -560,13 +699,37 @@ namespace BLEPP
 			else if (r.type() == ATT_OP_MTU_REQ)
 			{
 				dev.process_att_mtu_request(r);
+				if(buf.size() < dev.buf.size())
+					buf.resize(dev.buf.size());
+			}
+			//server is answering an exchange which we started with request_mtu
+			else if (r.type() == ATT_OP_MTU_RESP && state == AwaitingMTUResponse)
+			{
+				uint16_t server_mtu;
+				if(dec_mtu_resp(r.data, r.length, &server_mtu) == 0 || server_mtu < ATT_DEFAULT_LE_MTU)
+				{
+					LOG(Error, "Malformed MTU response");
+					fail(Disconnect(Disconnect::Reason::UnexpectedResponse, Disconnect::NoErrorCode));
+					return;
+				}
+
+				//Spec Vol 3, Part F, 3.4.2.2: both sides use the smaller of the two.
+				uint16_t negotiated = std::min(requested_mtu, server_mtu);
+				LOG(Info, "MTU negotiated: asked for " << requested_mtu << " server has " << server_mtu << " using " << negotiated);
+				dev.buf.resize(negotiated);
+				if(buf.size() < negotiated)
+					buf.resize(negotiated);
+
+				reset();
+				cb_mtu_exchanged();
 			}
 			//client is responding to our MTU request generated off their request
 			//VOL 3, PART F 3.4.2.2 Exchange MTU Request of bluetooth core spec
 			else if (r.type() == ATT_OP_MTU_RESP)
 			{
 				dev.process_att_mtu_response(r);
-				buf.resize(dev.buf.size());
+				if(buf.size() < dev.buf.size())
+					buf.resize(dev.buf.size());
 			}
 			else if(r.type() == ATT_OP_ERROR && PDUErrorResponse(r).request_opcode() != last_request)
 			{
@@ -733,8 +896,14 @@ namespace BLEPP
 						unexpected_error(r);
 					else
 					{
+						std::function<void()> cb;
+						swap(cb, write_cb);
 						reset();
-						cb_write_response();
+
+						if(cb)
+							cb();
+						else
+							cb_write_response();
 					}
 				}
 				else if(state == AwaitingReadResponse)
@@ -746,13 +915,17 @@ namespace BLEPP
 					else
 					{
 						uint16_t h = read_req_handle;
+						std::function<void(const PDUReadResponse&)> cb;
+						swap(cb, read_cb);
 						reset();
 
 						PDUReadResponse read(r);
 						Characteristic* c = characteristic_of_handle(h);
 						LOG(Debug, "Read response: handle requested was " << to_hex(h));
 
-						if(c)
+						if(cb)
+							cb(read);
+						else if(c)
 						{
 							if(c->cb_read)
 								c->cb_read(read);
@@ -763,7 +936,90 @@ namespace BLEPP
 						}
 					}
 				}
+				else if(state == AwaitingLongReadResponse)
+				{
+					if(r.type() == ATT_OP_ERROR)
+					{
+						//If the last response happened to fill the MTU exactly, the
+						//server may refuse the next blob rather than send nothing.
+						uint8_t e = PDUErrorResponse(r).error_code();
+						if(last_request == ATT_OP_READ_BLOB_REQ && (e == ATT_ECODE_ATTR_NOT_LONG || e == ATT_ECODE_INVALID_OFFSET))
+							finish_long_read();
+						else
+							unexpected_error(r);
+					}
+					else
+					{
+						std::pair<const uint8_t*, const uint8_t*> v;
+						if(r.type() == ATT_OP_READ_RESP)
+							v = PDUReadResponse(r).value();
+						else
+							v = PDUReadBlobResponse(r).value();
+
+						long_read.value->insert(long_read.value->end(), v.first, v.second);
+
+						//A response shorter than the MTU allows is the last one.
+						if(v.second - v.first == mtu() - 1 && long_read.value->size() < ATT_MAX_VALUE_LEN)
+							state_machine_write();
+						else
+							finish_long_read();
+					}
+				}
+				else if(state == AwaitingPrepareWriteResponse)
+				{
+					if(r.type() == ATT_OP_ERROR)
+						unexpected_error(r);
+					else
+					{
+						PDUPrepareWriteResponse p(r);
+						const uint8_t* sent = long_write.value.data() + long_write.offset;
+						auto v = p.value();
+
+						bool echoed = p.handle() == long_write.handle && p.offset() == long_write.offset 
+						              && v.second - v.first == (ptrdiff_t)long_write.segment && std::equal(v.first, v.second, sent);
+
+						if(!echoed && long_write.reliable)
+						{
+							LOG(Warning, "Prepare Write echo does not match at offset " << long_write.offset << ", cancelling");
+							long_write.cancelled = true;
+							state = AwaitingExecuteWriteResponse;
+						}
+						else
+						{
+							if(!echoed)
+								LOG(Warning, "Prepare Write echo does not match at offset " << long_write.offset);
+
+							long_write.offset += long_write.segment;
+							if(long_write.offset == long_write.value.size())
+								state = AwaitingExecuteWriteResponse;
+						}
+						state_machine_write();
+					}
+				}
+				else if(state == AwaitingExecuteWriteResponse)
+				{
+					if(r.type() == ATT_OP_ERROR)
+						unexpected_error(r);
+					else
+						finish_long_write();
+				}
+				else if(state == AwaitingMTUResponse)
+				{
+					//Only an error can get here. Servers which cannot do the
+					//exchange keep the default MTU, which is not a failure.
+					if(PDUErrorResponse(r).error_code() == ATT_ECODE_REQ_NOT_SUPP)
+					{
+						LOG(Info, "MTU exchange not supported, staying at " << dev.buf.size());
+						reset();
+						cb_mtu_exchanged();
+					}
+					else
+						unexpected_error(r);
+				}
 			}
+
+			//Start the next queued operation if that one is finished.
+			run_queue();
 		}
 		catch(BLEDevice::WriteError)
 		{
@@ -788,14 +1044,46 @@ namespace BLEPP
 		return nullptr;
 	}
 
-	void BLEGATTStateMachine::send_read_request(uint16_t handle)
+	void BLEGATTStateMachine::send_read_request(uint16_t handle, std::function<void(const PDUReadResponse&)> cb)
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
-		dev.send_read_request(handle);
-		read_req_handle = handle;
-		state = AwaitingReadResponse;
-		state_machine_write();
+		submit([this, handle, cb]()
+		{
+			dev.send_read_request(handle);
+			read_req_handle = handle;
+			read_cb = cb;
+			state = AwaitingReadResponse;
+			state_machine_write();
+		});
+	}
+
+	void BLEGATTStateMachine::request_mtu(uint16_t n)
+	{
+		if(n < ATT_DEFAULT_LE_MTU)
+			throw std::invalid_argument("ATT MTU must be at least 23");
+
+		//3/F/3.4.2.1: the client sends this at most once per connection.
+		if(mtu_exchange_requested)
+			throw std::logic_error("The ATT MTU has already been exchanged on this connection");
+
+		submit([this, n]()
+		{
+			//The response may be followed straight away by PDUs of the new size.
+			if(buf.size() < n)
+				buf.resize(n);
+
+			requested_mtu = n;
+			try{
+				dev.send_mtu_request(n);
+			}
+			catch(BLEDevice::WriteError)
+			{
+				fail(Disconnect(Disconnect::Reason::WriteError, errno));
+				return;
+			}
+			state = AwaitingMTUResponse;
+			state_machine_write();
+		});
+		mtu_exchange_requested = true;
 	}
 
 	void Characteristic::read_request()
@@ -803,13 +1091,64 @@ namespace BLEPP
 		s->send_read_request(value_handle);
 	}
 
-	void BLEGATTStateMachine::send_write_request(uint16_t handle, const uint8_t* data, int length)
+	void BLEGATTStateMachine::send_long_read_request(uint16_t handle, std::vector<uint8_t>& value, std::function<void(const LongReadResponse&)> cb)
+	{
+		submit([this, handle, &value, cb]()
+		{
+			value.clear();
+			long_read.handle = handle;
+			long_read.value = &value;
+			long_read.round_trips = 0;
+			long_read.cb = cb;
+			state = AwaitingLongReadResponse;
+			state_machine_write();
+		});
+	}
+
+	void BLEGATTStateMachine::send_long_read_request(uint16_t handle)
+	{
+		send_long_read_request(handle, long_read_buf);
+	}
+
+	void BLEGATTStateMachine::finish_long_read()
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
-		dev.send_write_request(handle, data, length);
-		state = AwaitingWriteResponse;
-		state_machine_write();
+		LongReadResponse result{long_read.handle, *long_read.value, long_read.round_trips};
+		std::function<void(const LongReadResponse&)> cb;
+		swap(cb, long_read.cb);
+		reset();
+
+		LOG(Debug, "Long read of " << to_hex(result.handle) << ": " << result.value.size() << " bytes in " << result.round_trips << " round trips");
+
+		if(cb)
+		{
+			cb(result);
+			return;
+		}
+
+		Characteristic* c = characteristic_of_handle(result.handle);
+		if(c && c->cb_long_read)
+			c->cb_long_read(result);
+		else if(c && cb_long_read)
+			cb_long_read(*c, result);
+		else
+			LOG(Warning, "Long read arrived, but no callback set\n");
+	}
+
+	void Characteristic::long_read_request()
+	{
+		s->send_long_read_request(value_handle);
+	}
+
+	void BLEGATTStateMachine::send_write_request(uint16_t handle, const uint8_t* data, int length, std::function<void()> cb)
+	{
+		std::vector<uint8_t> value(data, data + length);
+		submit([this, handle, value, cb]()
+		{
+			dev.send_write_request(handle, value.data(), value.size());
+			write_cb = cb;
+			state = AwaitingWriteResponse;
+			state_machine_write();
+		});
 	}
 
 	void Characteristic::write_request(const uint8_t*data, int length)
@@ -817,11 +1156,68 @@ namespace BLEPP
 		s->send_write_request(value_handle, data, length);
 	}
 
+	void BLEGATTStateMachine::send_long_write_request(uint16_t handle, const uint8_t* data, int length, bool reliable, std::function<void(const LongWriteResponse&)> cb)
+	{
+		if(length < 0 || length > ATT_MAX_VALUE_LEN)
+			throw std::invalid_argument("Attribute values are at most 512 bytes");
+
+		std::vector<uint8_t> value(data, data + length);
+		submit([this, handle, value, reliable, cb]()
+		{
+			long_write.handle = handle;
+			long_write.value = value;
+			long_write.offset = 0;
+			long_write.reliable = reliable;
+			long_write.cancelled = false;
+			long_write.round_trips = 0;
+			long_write.cb = cb;
+			state = AwaitingPrepareWriteResponse;
+			state_machine_write();
+		});
+	}
+
+	void BLEGATTStateMachine::finish_long_write()
+	{
+		LongWriteResponse result{long_write.handle, !long_write.cancelled, long_write.round_trips};
+		std::function<void(const LongWriteResponse&)> cb;
+		swap(cb, long_write.cb);
+		reset();
+
+		LOG(Debug, "Long write of " << to_hex(result.handle) << (result.committed?" committed":" cancelled") << " after " << result.round_trips << " round trips");
+
+		if(cb)
+		{
+			cb(result);
+			return;
+		}
+
+		Characteristic* c = characteristic_of_handle(result.handle);
+		if(c && c->cb_long_write)
+			c->cb_long_write(result);
+		else if(c && cb_long_write)
+			cb_long_write(*c, result);
+		else
+			LOG(Warning, "Long write finished, but no callback set\n");
+	}
+
+	void Characteristic::long_write_request(const uint8_t* data, int length, bool reliable)
+	{
+		s->send_long_write_request(value_handle, data, length, reliable);
+	}
+
 	void BLEGATTStateMachine::send_write_command(uint16_t handle, const uint8_t* data, int length)
 	{
-		if(state != Idle)
-			throw std::logic_error("Error trying to issue command mid state");
-		dev.send_write_command(handle, data, length);
+		//Skip copying into the queue when it would be sent at once anyway.
+		if(operations.empty() && !stream.active && state != Disconnected && state != Connecting)
+			dev.send_write_command(handle, data, length);
+		else
+		{
+			std::vector<uint8_t> value(data, data + length);
+			submit([this, handle, value]()
+			{
+				dev.send_write_command(handle, value.data(), value.size());
+			}, true);
+		}
 	}
 
 	void Characteristic::write_command(const uint8_t*data, int length)
@@ -829,11 +1225,78 @@ namespace BLEPP
 		s->send_write_command(value_handle, data, length);
 	}
 
+	void BLEGATTStateMachine::send_write_command_stream(uint16_t handle, const uint8_t* data, size_t length, std::function<void(const WriteStreamResponse&)> cb)
+	{
+		//Commands need no response, so they can go alongside requests.
+		if(state == Disconnected || state == Connecting)
+			throw std::logic_error("Error trying to stream while not connected");
+		if(stream.active)
+			throw std::logic_error("Error trying to start a stream while one is running");
+
+		stream.active = true;
+		io_changed();
+		stream.handle = handle;
+		stream.value.assign(data, data + length);
+		stream.offset = 0;
+		stream.chunks = 0;
+		stream.stalls = 0;
+		stream.start = std::chrono::steady_clock::now();
+		stream.cb = std::move(cb);
 
-	void Characteristic::set_notify_and_indicate(bool notify, bool indicate, WriteType type)
+		try{
+			pump_stream();
+		}
+		catch(BLEDevice::WriteError)
+		{
+			fail(Disconnect(Disconnect::Reason::WriteError, errno));
+		}
+	}
+
+	void BLEGATTStateMachine::pump_stream()
+	{
+		while(stream.offset < stream.value.size())
+		{
+			size_t n = std::min<size_t>(mtu() - 3, stream.value.size() - stream.offset);
+			if(!dev.try_send_write_command(stream.handle, stream.value.data() + stream.offset, n))
+			{
+				stream.stalls++;
+				return;
+			}
+			stream.offset += n;
+			stream.chunks++;
+		}
+
+		WriteStreamResponse result{stream.handle, stream.value.size(), stream.chunks, stream.stalls, std::chrono::steady_clock::now() - stream.start};
+		std::function<void(const WriteStreamResponse&)> cb;
+		swap(cb, stream.cb);
+		stream.active = false;
+		io_changed();
+
+		LOG(Debug, "Stream to " << to_hex(result.handle) << ": " << result.bytes << " bytes in " << result.elapsed.count() << "s, " << result.stalls << " stalls");
+
+		if(cb)
+		{
+			cb(result);
+			return;
+		}
+
+		Characteristic* c = characteristic_of_handle(result.handle);
+		if(c && c->cb_write_stream)
+			c->cb_write_stream(result);
+		else if(c && cb_write_stream)
+			cb_write_stream(*c, result);
+	}
+
+	void Characteristic::write_command_stream(const uint8_t* data, size_t length)
+	{
+		s->send_write_command_stream(value_handle, data, length);
+	}
+
+
+	void Characteristic::set_notify_and_indicate(bool notify, bool indicate, WriteType type, std::function<void()> cb)
 	{
 		LOG(Trace, "Characteristic::enable_indications()");
-		s->set_notify_and_indicate(*this, notify, indicate, type);
+		s->set_notify_and_indicate(*this, notify, indicate, type, std::move(cb));
 	}
 
 
@@ -892,7 +1355,7 @@ namespace BLEPP
 
 
 	//Handy utility function to do the sort of thing you'd normally do.
-	void BLEGATTStateMachine::setup_standard_scan(std::function<void()>& cb)
+	void BLEGATTStateMachine::setup_standard_scan(std::function<void()>& cb, uint16_t mtu)
 	{
 		ENTER();
 
@@ -914,10 +1377,18 @@ namespace BLEPP
 			cb();
 		};
 		
-		cb_connected = [this]()
+		cb_mtu_exchanged = [this]()
 		{
 			read_primary_services();
 		};
+
+		cb_connected = [this, mtu]()
+		{
+			if(mtu)
+				request_mtu(mtu);
+			else
+				read_primary_services();
+		};
 	}
 
 }
@@ -0,0 +1,277 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include <blepp/device_tracker.h>
+
+#include <cstring>
+#include <algorithm>
+
+namespace BLEPP
+{
+	const std::uint64_t DeviceTracker::empty_key;
+	const std::uint64_t DeviceTracker::deleted_key;
+	const std::uint32_t DeviceTracker::end_of_list;
+	const std::size_t DeviceTracker::wheel_size;
+
+	double TrackedDevice::rssi_mean() const
+	{
+		if(rssi_samples == 0)
+			return 0;
+		else
+			return static_cast<double>(rssi_sum) / rssi_samples;
+	}
+
+	DeviceTracker::DeviceTracker(std::size_t max_devices, Clock::duration departure_timeout)
+	:limit(max_devices), timeout(departure_timeout)
+	{
+		//Keep the load factor at or below 3/4
+		std::size_t n = 16;
+		while(n * 3 < max_devices * 4)
+			n *= 2;
+
+		keys.assign(n, empty_key);
+		devices.resize(n);
+		next.assign(n, end_of_list);
+		mask = n - 1;
+
+		//The wheel covers twice the timeout, so nothing is ever
+		//scheduled more than a full turn ahead.
+		resolution = std::max<Clock::duration>(timeout / (wheel_size/2), Clock::duration(1));
+		wheel.assign(wheel_size, end_of_list);
+	}
+
+	void DeviceTracker::set_listener(DeviceListener* l)
+	{
+		listener = l;
+	}
+
+	std::uint64_t DeviceTracker::key_of(const BLEAddress& a)
+	{
+		return a.to_uint64() | (static_cast<std::uint64_t>(a.type) << 48);
+	}
+
+	//Returns the slot holding key, or the slot it should go in.
+	std::size_t DeviceTracker::lookup(std::uint64_t key, std::size_t hash) const
+	{
+		std::size_t first_deleted = keys.size();
+
+		for(std::size_t i = hash & mask;; i = (i+1) & mask)
+		{
+			if(keys[i] == key)
+				return i;
+			else if(keys[i] == empty_key)
+				return first_deleted != keys.size() ? first_deleted : i;
+			else if(keys[i] == deleted_key && first_deleted == keys.size())
+				first_deleted = i;
+		}
+	}
+
+	std::int64_t DeviceTracker::tick_of(Clock::time_point t) const
+	{
+		return (t - epoch) / resolution;
+	}
+
+	//Put a device in the bucket after the one containing its departure time.
+	void DeviceTracker::schedule(std::uint32_t slot)
+	{
+		std::int64_t t = std::max(tick_of(devices[slot].last_seen + timeout) + 1, current_tick + 1);
+		std::uint32_t& head = wheel[t & (wheel_size-1)];
+		next[slot] = head;
+		head = slot;
+	}
+
+	void DeviceTracker::update(const AdvertisingView& a, Clock::time_point now)
+	{
+		if(!started)
+		{
+			epoch = now;
+			started = true;
+		}
+
+		expire(now);
+
+		std::uint64_t key = key_of(a.address);
+		std::size_t i = lookup(key, a.address.hash());
+		TrackedDevice& d = devices[i];
+
+		bool arrived = keys[i] != key;
+		bool is_scan_response = a.type == LeAdvertisingEventType::SCAN_RSP;
+		uint8_t length = std::min<uint8_t>(a.length, TrackedDevice::max_payload);
+
+		if(arrived)
+		{
+			if(live == limit)
+			{
+				num_overflows++;
+				return;
+			}
+
+			if(keys[i] == deleted_key)
+				deleted--;
+			keys[i] = key;
+			live++;
+
+			d.address = a.address;
+			d.first_seen = now;
+			d.adverts = 0;
+			d.rssi_samples = 0;
+			d.rssi_sum = 0;
+			d.rssi_min = 127;
+			d.rssi_max = -128;
+			d.rssi_last = 127;
+			d.payload_length = TrackedDevice::not_received;
+			d.scan_response_length = TrackedDevice::not_received;
+		}
+
+		d.last_seen = now;
+		d.adverts++;
+		d.last_type = a.type;
+
+		//127 means the RSSI is not available
+		if(a.rssi != 127)
+		{
+			d.rssi_last = a.rssi;
+			d.rssi_min = std::min(d.rssi_min, a.rssi);
+			d.rssi_max = std::max(d.rssi_max, a.rssi);
+			d.rssi_sum += a.rssi;
+			d.rssi_samples++;
+		}
+
+		uint8_t& stored_length = is_scan_response ? d.scan_response_length : d.payload_length;
+		uint8_t* stored = is_scan_response ? d.scan_response : d.payload;
+		bool changed = stored_length != TrackedDevice::not_received && (stored_length != length || memcmp(stored, a.data, length) != 0);
+		stored_length = length;
+		memcpy(stored, a.data, length);
+
+		if(arrived)
+		{
+			schedule(i);
+			if(listener)
+				listener->on_arrival(d);
+		}
+		else if(changed && listener)
+			listener->on_change(d);
+
+		//Too many deleted slots make probing slow.
+		if(live + deleted > keys.size() * 3 / 4)
+			rebuild();
+	}
+
+	void DeviceTracker::on_advertisement(const AdvertisingView& a)
+	{
+		update(a, a.timestamp);
+	}
+
+	void DeviceTracker::expire(Clock::time_point now)
+	{
+		if(!started)
+			return;
+
+		std::int64_t target = tick_of(now);
+
+		//Every bucket has been visited once there's been a whole turn.
+		if(target - current_tick > static_cast<std::int64_t>(wheel_size))
+			current_tick = target - wheel_size;
+
+		while(current_tick < target)
+		{
+			current_tick++;
+
+			std::uint32_t& head = wheel[current_tick & (wheel_size-1)];
+			std::uint32_t slot = head;
+			head = end_of_list;
+
+			while(slot != end_of_list)
+			{
+				std::uint32_t following = next[slot];
+
+				if(now - devices[slot].last_seen >= timeout)
+				{
+					if(listener)
+						listener->on_departure(devices[slot]);
+					keys[slot] = deleted_key;
+					live--;
+					deleted++;
+				}
+				else
+					schedule(slot);
+
+				slot = following;
+			}
+		}
+	}
+
+	//Rehash everything, to clear out the deleted slots. The wheel
+	//has to be rebuilt since devices change slot.
+	void DeviceTracker::rebuild()
+	{
+		std::vector<std::uint64_t> old_keys(keys.size(), empty_key);
+		std::vector<TrackedDevice> old_devices(devices.size());
+		old_keys.swap(keys);
+		old_devices.swap(devices);
+
+		std::fill(wheel.begin(), wheel.end(), end_of_list);
+		deleted = 0;
+
+		for(std::size_t i=0; i < old_keys.size(); i++)
+			if(old_keys[i] != empty_key && old_keys[i] != deleted_key)
+			{
+				std::size_t j = lookup(old_keys[i], old_devices[i].address.hash());
+				keys[j] = old_keys[i];
+				devices[j] = old_devices[i];
+				schedule(j);
+			}
+	}
+
+	const TrackedDevice* DeviceTracker::find(const BLEAddress& address) const
+	{
+		std::uint64_t key = key_of(address);
+		std::size_t i = lookup(key, address.hash());
+		return keys[i] == key ? &devices[i] : nullptr;
+	}
+
+	void DeviceTracker::for_each(const std::function<void(const TrackedDevice&)>& f) const
+	{
+		for(std::size_t i=0; i < keys.size(); i++)
+			if(keys[i] != empty_key && keys[i] != deleted_key)
+				f(devices[i]);
+	}
+
+	std::size_t DeviceTracker::size() const
+	{
+		return live;
+	}
+
+	std::size_t DeviceTracker::max_devices() const
+	{
+		return limit;
+	}
+
+	DeviceTracker::Clock::duration DeviceTracker::departure_timeout() const
+	{
+		return timeout;
+	}
+
+	std::uint64_t DeviceTracker::overflows() const
+	{
+		return num_overflows;
+	}
+}
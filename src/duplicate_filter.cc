@@ -0,0 +1,140 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include <blepp/duplicate_filter.h>
+
+namespace BLEPP
+{
+	DuplicateFilter::DuplicateFilter(std::size_t capacity, Clock::duration ttl)
+	:time_to_live(ttl)
+	{
+		set_capacity(capacity);
+	}
+
+	void DuplicateFilter::set_capacity(std::size_t capacity)
+	{
+		std::size_t n = probe_window;
+		while(n < capacity)
+			n *= 2;
+
+		slots.assign(n, Slot{0, Clock::time_point(), false});
+		mask = n - 1;
+		used_slots = 0;
+	}
+
+	void DuplicateFilter::set_ttl(Clock::duration ttl)
+	{
+		time_to_live = ttl;
+	}
+
+	void DuplicateFilter::clear()
+	{
+		for(auto& s: slots)
+			s.used = false;
+		used_slots = 0;
+	}
+
+	bool DuplicateFilter::expired(const Slot& s, Clock::time_point now) const
+	{
+		return time_to_live != Clock::duration::zero() && now - s.last_reported >= time_to_live;
+	}
+
+	bool DuplicateFilter::insert(const BLEAddress& address, std::uint8_t event_type, Clock::time_point now)
+	{
+		//48 bits of address, then the address type, then the event type.
+		std::uint64_t key = address.to_uint64() | (static_cast<std::uint64_t>(address.type) << 48) | (static_cast<std::uint64_t>(event_type) << 56);
+		std::size_t h = address.hash() ^ (event_type * 0x9e3779b97f4a7c15ULL);
+
+		//Slots are only ever overwritten, never emptied, so the first
+		//unused slot marks the end of the search.
+		Slot* empty = nullptr;
+		Slot* stale = nullptr;
+		Slot* oldest = nullptr;
+		for(std::size_t i=0; i < probe_window; i++)
+		{
+			Slot& s = slots[(h + i) & mask];
+
+			if(!s.used)
+			{
+				empty = &s;
+				break;
+			}
+			else if(s.key == key)
+			{
+				if(expired(s, now))
+				{
+					s.last_reported = now;
+					return true;
+				}
+				else
+					return false;
+			}
+			else if(expired(s, now))
+			{
+				if(!stale)
+					stale = &s;
+			}
+			else if(!oldest || s.last_reported < oldest->last_reported)
+				oldest = &s;
+		}
+		
+		//Prefer reusing a stale entry, to keep the probe sequences short.
+		Slot* victim;
+		if(stale)
+			victim = stale;
+		else if(empty)
+		{
+			victim = empty;
+			used_slots++;
+		}
+		else
+		{
+			victim = oldest;
+			num_evictions++;
+		}
+
+		victim->key = key;
+		victim->last_reported = now;
+		victim->used = true;
+
+		return true;
+	}
+
+	std::size_t DuplicateFilter::size() const
+	{
+		return used_slots;
+	}
+
+	std::size_t DuplicateFilter::capacity() const
+	{
+		return slots.size();
+	}
+
+	DuplicateFilter::Clock::duration DuplicateFilter::ttl() const
+	{
+		return time_to_live;
+	}
+
+	std::uint64_t DuplicateFilter::evictions() const
+	{
+		return num_evictions;
+	}
+}
@@ -0,0 +1,323 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include "blepp/hci_replay.h"
+#include "blepp/logging.h"
+
+#include <fstream>
+#include <iterator>
+#include <cstring>
+#include <cerrno>
+#include <unistd.h>
+#include <sys/socket.h>
+
+namespace BLEPP
+{
+	namespace
+	{
+		const uint8_t h4_event = 0x04;
+		const uint8_t le_meta_event = 0x3E;
+
+		//btsnoop, see RFC 1761 and the btmon source.
+		const uint32_t btsnoop_h1 = 1001;
+		const uint32_t btsnoop_h4 = 1002;
+		const uint32_t btsnoop_monitor = 2001;
+		const uint16_t monitor_event = 3;
+		const uint64_t btsnoop_epoch_offset = 0x00dcddb30f2f8000ULL; //Microseconds from 0AD to 1970
+
+		//pcap, see https://www.tcpdump.org/linktypes.html
+		const uint32_t linktype_h4 = 187;
+		const uint32_t linktype_h4_with_phdr = 201;
+		const uint32_t linktype_monitor = 254;
+
+		class Reader
+		{
+			private:
+				const std::vector<uint8_t>& d;
+				size_t pos=0;
+				bool little;
+
+			public:
+				Reader(const std::vector<uint8_t>& data, bool little_endian)
+				:d(data), little(little_endian)
+				{}
+
+				size_t left() const
+				{
+					return d.size() - pos;
+				}
+
+				const uint8_t* take(size_t n)
+				{
+					if(n > left())
+						throw HCIReplay::FormatError("Truncated capture");
+					pos += n;
+					return d.data() + pos - n;
+				}
+
+				uint64_t get(int bytes)
+				{
+					const uint8_t* p = take(bytes);
+					uint64_t v=0;
+					for(int i=0; i < bytes; i++)
+						v |= static_cast<uint64_t>(p[little?i:bytes-1-i]) << (8*i);
+					return v;
+				}
+		};
+
+		//Keep what the scanner's socket filter would let through.
+		void add_event(std::vector<HCIReplay::Packet>& out, uint64_t ts, const uint8_t* data, size_t len, bool has_type)
+		{
+			if(has_type)
+			{
+				if(len == 0 || data[0] != h4_event)
+					return;
+				data++;
+				len--;
+			}
+
+			if(len == 0 || data[0] != le_meta_event)
+				return;
+
+			HCIReplay::Packet p;
+			p.timestamp = std::chrono::microseconds(ts);
+			p.data.push_back(h4_event);
+			p.data.insert(p.data.end(), data, data+len);
+			out.push_back(std::move(p));
+		}
+
+		std::vector<HCIReplay::Packet> read_btsnoop(const std::vector<uint8_t>& file)
+		{
+			Reader r(file, false);
+			r.take(8);
+			uint32_t version = r.get(4);
+			uint32_t datalink = r.get(4);
+
+			if(version != 1)
+				throw HCIReplay::FormatError("Unsupported btsnoop version");
+			if(datalink != btsnoop_h1 && datalink != btsnoop_h4 && datalink != btsnoop_monitor)
+				throw HCIReplay::FormatError("Unsupported btsnoop datalink type " + std::to_string(datalink));
+
+			std::vector<HCIReplay::Packet> packets;
+			while(r.left())
+			{
+				r.get(4); //Original length
+				uint32_t included = r.get(4);
+				uint32_t flags = r.get(4);
+				r.get(4); //Cumulative drops
+				uint64_t ts = r.get(8) - btsnoop_epoch_offset;
+				const uint8_t* data = r.take(included);
+
+				if(datalink == btsnoop_h4)
+					add_event(packets, ts, data, included, true);
+				else if(datalink == btsnoop_h1 && (flags & 3) == 3) //Received command/event
+					add_event(packets, ts, data, included, false);
+				else if(datalink == btsnoop_monitor && (flags & 0xffff) == monitor_event)
+					add_event(packets, ts, data, included, false);
+			}
+			return packets;
+		}
+
+		std::vector<HCIReplay::Packet> read_pcap(const std::vector<uint8_t>& file)
+		{
+			uint32_t magic = file[0] | (file[1] << 8) | (file[2] << 16) | (static_cast<uint32_t>(file[3]) << 24);
+			bool little = (magic == 0xa1b2c3d4 || magic == 0xa1b23c4d);
+			Reader r(file, little);
+			magic = r.get(4);
+			if(magic != 0xa1b2c3d4 && magic != 0xa1b23c4d)
+				throw HCIReplay::FormatError("Not a btsnoop or pcap file");
+			bool nanoseconds = (magic == 0xa1b23c4d);
+
+			r.take(16); //Version, time zone, accuracy, snap length
+			uint32_t linktype = r.get(4) & 0x0fffffff;
+
+			if(linktype != linktype_h4 && linktype != linktype_h4_with_phdr && linktype != linktype_monitor)
+				throw HCIReplay::FormatError("Unsupported pcap link type " + std::to_string(linktype));
+
+			std::vector<HCIReplay::Packet> packets;
+			while(r.left())
+			{
+				uint64_t sec = r.get(4);
+				uint64_t frac = r.get(4);
+				uint32_t included = r.get(4);
+				r.get(4); //Original length
+				const uint8_t* data = r.take(included);
+				uint64_t ts = sec * 1000000 + (nanoseconds ? frac/1000 : frac);
+
+				if(linktype == linktype_h4)
+					add_event(packets, ts, data, included, true);
+				else if(linktype == linktype_h4_with_phdr && included >= 4)
+					add_event(packets, ts, data + 4, included - 4, true);
+				else if(linktype == linktype_monitor && included >= 4 && ((data[2] << 8) | data[3]) == monitor_event)
+					add_event(packets, ts, data + 4, included - 4, false);
+			}
+			return packets;
+		}
+	}
+
+	HCIReplay::HCIReplay(const std::string& filename)
+	{
+		std::ifstream in(filename, std::ios::binary);
+		if(!in)
+			throw std::runtime_error("Can't open " + filename);
+
+		std::vector<uint8_t> file((std::istreambuf_iterator<char>(in)), std::istreambuf_iterator<char>());
+
+		if(file.size() >= 8 && memcmp(file.data(), "btsnoop\0", 8) == 0)
+			packet_list = read_btsnoop(file);
+		else if(file.size() >= 24)
+			packet_list = read_pcap(file);
+		else
+			throw FormatError("Not a btsnoop or pcap file: " + filename);
+
+		//Timestamps are relative to the first packet.
+		if(!packet_list.empty())
+		{
+			auto t0 = packet_list[0].timestamp;
+			for(auto& p: packet_list)
+				p.timestamp -= t0;
+		}
+
+		LOG(LogLevels::Info, "Loaded " << packet_list.size() << " HCI events from " << filename);
+		open_socket();
+	}
+
+	HCIReplay::HCIReplay(std::vector<Packet> packets)
+	:packet_list(std::move(packets))
+	{
+		open_socket();
+	}
+
+	void HCIReplay::open_socket()
+	{
+		//SEQPACKET keeps the packet boundaries, like an HCI socket.
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, fds) < 0)
+			throw std::runtime_error(std::string("Creating replay socket: ") + strerror(errno));
+
+		//A larger buffer means fewer round trips through feed() when 
+		//playing back as fast as possible. It doesn't matter if this fails.
+		int size = 1 << 20;
+		setsockopt(fds[1], SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+
+		start();
+	}
+
+	HCIReplay::~HCIReplay()
+	{
+		close(fds[0]);
+		close(fds[1]);
+	}
+
+	const std::vector<HCIReplay::Packet>& HCIReplay::packets() const
+	{
+		return packet_list;
+	}
+
+	int HCIReplay::get_fd() const
+	{
+		return fds[0];
+	}
+
+	void HCIReplay::start(Pacing p, double s)
+	{
+		pacing = p;
+		speed = s;
+		position = 0;
+		started = std::chrono::steady_clock::now();
+	}
+
+	std::chrono::steady_clock::time_point HCIReplay::due(const Packet& p) const
+	{
+		return started + std::chrono::duration_cast<std::chrono::steady_clock::duration>(p.timestamp / speed);
+	}
+
+	bool HCIReplay::done() const
+	{
+		return position == packet_list.size();
+	}
+
+	int HCIReplay::next_due_ms() const
+	{
+		if(done())
+			return -1;
+		else if(pacing == Pacing::Fast)
+			return 0;
+
+		auto wait = due(packet_list[position]) - std::chrono::steady_clock::now();
+		if(wait <= std::chrono::steady_clock::duration::zero())
+			return 0;
+
+		//Round up, so the packet is due when poll returns.
+		return std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1;
+	}
+
+	size_t HCIReplay::feed()
+	{
+		auto now = std::chrono::steady_clock::now();
+		size_t written=0;
+
+		for(; position < packet_list.size(); position++)
+		{
+			const Packet& p = packet_list[position];
+
+			if(pacing == Pacing::RealTime && due(p) > now)
+				break;
+
+			if(send(fds[1], p.data.data(), p.data.size(), MSG_DONTWAIT) < 0)
+			{
+				if(errno == EAGAIN || errno == EWOULDBLOCK)
+					break;
+				throw std::runtime_error(std::string("Writing replay socket: ") + strerror(errno));
+			}
+			written++;
+		}
+
+		return written;
+	}
+
+	void HCIReplay::save_btsnoop(const std::string& filename, const std::vector<Packet>& packets)
+	{
+		std::ofstream out(filename, std::ios::binary);
+
+		auto put = [&](uint64_t v, int bytes)
+		{
+			for(int i=bytes-1; i >= 0; i--)
+				out.put(static_cast<char>(v >> (8*i)));
+		};
+
+		out.write("btsnoop\0", 8);
+		put(1, 4);
+		put(btsnoop_h4, 4);
+
+		for(const auto& p: packets)
+		{
+			put(p.data.size(), 4);
+			put(p.data.size(), 4);
+			put(1, 4); //Received
+			put(0, 4);
+			put(p.timestamp.count() + btsnoop_epoch_offset, 8);
+			out.write(reinterpret_cast<const char*>(p.data.data()), p.data.size());
+		}
+
+		if(!out)
+			throw std::runtime_error("Writing " + filename);
+	}
+}
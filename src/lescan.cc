@@ -1,12 +1,23 @@
 #include "blepp/lescan.h"
 #include "blepp/pretty_printers.h"
 #include "blepp/gap.h"
+#include "blepp/scan_merger.h"
 
 #include <bluetooth/hci_lib.h>
 #include <string>
 #include <cstring>
 #include <cerrno>
 #include <iomanip>
+#include <algorithm>
+#include <array>
+
+#include <poll.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+#include <sys/time.h>
+#include <linux/sock_diag.h>
 
 namespace BLEPP
 {
@@ -22,6 +33,11 @@ namespace BLEPP
 			{
 			}
 
+			Span(const uint8_t* d, size_t length)
+			:begin_(d),end_(d + length)
+			{
+			}
+
 			Span(const Span&) = default;
 
 			Span pop_front(size_t length)
@@ -114,8 +130,59 @@ namespace BLEPP
 	}
 
 
-	HCIScanner::HCIScanner(bool start_scan, FilterDuplicates filtering, ScanType st, std::string device)
+	HCIScanner::ScanParameters HCIScanner::ScanParameters::continuous()
+	{
+		return ScanParameters();
+	}
+
+	HCIScanner::ScanParameters HCIScanner::ScanParameters::balanced()
+	{
+		ScanParameters p;
+		p.interval = 0x0060;
+		p.window   = 0x0030;
+		return p;
+	}
+
+	HCIScanner::ScanParameters HCIScanner::ScanParameters::low_duty()
+	{
+		ScanParameters p;
+		p.interval = 0x0640;
+		p.window   = 0x0050;
+		return p;
+	}
+
+	void HCIScanner::ScanParameters::validate() const
 	{
+		//Ranges from 4.0/2/E.7.8.10
+		if(interval < 0x0004 || interval > 0x4000)
+			throw std::invalid_argument("Scan interval out of range");
+		if(window < 0x0004 || window > 0x4000)
+			throw std::invalid_argument("Scan window out of range");
+		if(window > interval)
+			throw std::invalid_argument("Scan window longer than scan interval");
+		if(filter_policy > 0x01)
+			throw std::invalid_argument("Invalid scan filter policy");
+	}
+
+	bool HCIScanner::ScanParameters::operator==(const ScanParameters& p) const
+	{
+		return interval == p.interval && window == p.window && own_address_type == p.own_address_type && filter_policy == p.filter_policy;
+	}
+
+	double HCIScanner::ScanRate::adverts_per_second() const
+	{
+		double t = std::chrono::duration_cast<std::chrono::duration<double>>(scanning_time).count();
+		if(t == 0)
+			return 0;
+		else
+			return adverts / t;
+	}
+
+	HCIScanner::HCIScanner(bool start_scan, FilterDuplicates filtering, ScanType st, std::string device, const ScanParameters& params)
+	:scan_parameters(params), read_buffer(HCI_MAX_EVENT_SIZE)
+	{
+		scan_parameters.validate();
+
 		if(filtering == FilterDuplicates::Hardware || filtering == FilterDuplicates::Both)
 			hardware_filtering = true;
 		else
@@ -128,7 +195,6 @@ namespace BLEPP
 
 		scan_type=st;
 
-		int	dev_id = 0;
 		if (device == "") {
 			//Get a route to any(?) BTLE adapter (?)
 			dev_id = hci_get_route(NULL);
@@ -144,6 +210,21 @@ namespace BLEPP
 		//FIXME check errors
 		hci_fd.set(hci_open_dev(dev_id));
 
+		//Magic incantations to get scan events. The socket is only ever
+		//read, so this is set once: commands go via command_socket().
+		struct hci_filter nf;
+		hci_filter_clear(&nf);
+		hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
+		hci_filter_set_event(EVT_LE_META_EVENT, &nf);
+		if (setsockopt(hci_fd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0)
+			throw IOError("Setting HCI filter socket options", errno);
+
+		enable_timestamps();
+
+		uint32_t drops, queued;
+		if(read_meminfo(drops, queued))
+			kernel_drops_at_open = drops;
+
 		if(start_scan)
 			start();
 	}
@@ -154,32 +235,74 @@ namespace BLEPP
 
 	}
 
-	void HCIScanner::start()
+	HCIScanner::HCIScanner(int fd, FilterDuplicates filtering)
+	:scan_type(ScanType::Passive), read_buffer(HCI_MAX_EVENT_SIZE)
+	{
+		external_source = true;
+		hardware_filtering = false;
+		software_filtering = filtering == FilterDuplicates::Software || filtering == FilterDuplicates::Both;
+
+		int dup_fd = fcntl(fd, F_DUPFD_CLOEXEC, 0);
+		if(dup_fd < 0)
+			throw IOError("Duplicating HCI source fd", errno);
+		hci_fd.set(dup_fd);
+		enable_timestamps();
+
+		uint32_t drops, queued;
+		if(read_meminfo(drops, queued))
+			kernel_drops_at_open = drops;
+
+		start();
+	}
+
+	void HCIScanner::start(const ScanParameters& params)
 	{
 		ENTER();
+		params.validate();
+
+		stop();
+		scan_parameters = params;
+		start();
+	}
+
+	const HCIScanner::ScanParameters& HCIScanner::get_scan_parameters() const
+	{
+		return scan_parameters;
+	}
+
+	std::vector<HCIScanner::ScanRate> HCIScanner::scan_rates() const
+	{
+		std::vector<ScanRate> r = rates;
+
 		if(running)
 		{
-			LOG(Trace, "Scanner is already running");
-			return;
+			r[current_rate].adverts += adverts_received - adverts_at_start;
+			r[current_rate].scanning_time += std::chrono::steady_clock::now() - scan_started;
 		}
 
-		//Cadged from the hcitool sources. No idea what
-		//these mean
-		uint16_t interval = htobs(0x0010);
-		uint16_t window = htobs(0x0010);
+		return r;
+	}
 
-		//Address for the adapter (I think). Use a public address.
-		//other option is random. Works either way it seems.
-		uint8_t own_type = LE_PUBLIC_ADDRESS;
+	//Send the HCI commands to start scanning
+	void HCIScanner::enable_scanning()
+	{
+		//See 4.0/2/E.7.8.10 and ScanParameters
+		uint16_t interval = htobs(scan_parameters.interval);
+		uint16_t window = htobs(scan_parameters.window);
+		uint8_t own_type = static_cast<uint8_t>(scan_parameters.own_address_type);
+		uint8_t filter_policy = scan_parameters.filter_policy;
 
-		//Don't use a whitelist (?)
-		uint8_t filter_policy = 0x00;
+		//A host managed accept list takes over the filter policy.
+		if(!accept_list.empty())
+			filter_policy = accept_list_in_controller?0x01:0x00;
 
 		
+		int cmd = command_socket();
+
 		//The 10,000 thing seems to be some sort of retry logic timeout
 		//thing. Number of miliseconds, but there are multiple tries
 		//where it gets reduced by 10ms each time. It's a bit odd.
-		int err = hci_le_set_scan_parameters(hci_fd, static_cast<int>(scan_type), interval, window,
+		int err = hci_le_set_scan_parameters(cmd, static_cast<int>(scan_type), interval, window,
 							own_type, filter_policy, 10000);
 		if(err < 0)
 		{
@@ -193,147 +316,982 @@ namespace BLEPP
 				//and so never cleaned up properly.
 				LOG(LogLevels::Warning, "Received I/O error while setting scan parameters.");
 				LOG(LogLevels::Warning, "Switching off HCI scanner");
-				err = hci_le_set_scan_enable(hci_fd, 0x00, 0x00, 10000);
+				err = hci_le_set_scan_enable(cmd, 0x00, 0x00, 10000);
 				if(err < 0)
 					throw IOError("Error disabling scan:", errno);
 
 
-				err = hci_le_set_scan_parameters(hci_fd, static_cast<int>(scan_type), interval, window, own_type, filter_policy, 10000);
+				err = hci_le_set_scan_parameters(cmd, static_cast<int>(scan_type), interval, window, own_type, filter_policy, 10000);
 				if(err < 0)
 					throw IOError("Error disabling scan:", errno);
 				else
 					LOG(LogLevels::Warning, "Setting scan parameters worked this time.");
 
 
-			}
+			}
+		}
+
+		//Removal of duplicates done on the adapter itself
+		uint8_t filter_dup = hardware_filtering?0x01:0x00;
+		
+		
+		//device disable/enable duplictes ????
+		err = hci_le_set_scan_enable(cmd, 0x01, filter_dup, 10000);
+		if(err < 0)
+			throw IOError("Enabling scan", errno);
+	}
+
+	void HCIScanner::start()
+	{
+		ENTER();
+		if(running)
+		{
+			LOG(Trace, "Scanner is already running");
+			return;
+		}
+
+		if(!external_source)
+			enable_scanning();
+
+		LOG(LogLevels::Info, "Starting scanner");
+		scanned_devices.clear();
+		next_refresh = std::chrono::steady_clock::now() + refresh_interval;
+		if(merger)
+			merger->clear();
+
+		//Find the rate counter for this configuration.
+		auto r = find_if(rates.begin(), rates.end(), [&](const ScanRate& r)
+		{
+			return r.parameters == scan_parameters && r.scan_type == scan_type;
+		});
+		
+		if(r == rates.end())
+		{
+			ScanRate rate;
+			rate.parameters = scan_parameters;
+			rate.scan_type = scan_type;
+			rate.adverts = 0;
+			rate.scanning_time = std::chrono::steady_clock::duration::zero();
+			rates.push_back(rate);
+			r = rates.end() - 1;
+		}
+		current_rate = r - rates.begin();
+		adverts_at_start = adverts_received;
+		scan_started = std::chrono::steady_clock::now();
+
+		running=true;
+	}
+
+	void HCIScanner::stop()
+	{
+		ENTER();
+		if(!running)
+		{
+			return;
+		}
+
+		LOG(LogLevels::Info, "Cleaning up HCI scanner");
+		if(!external_source)
+		{
+			int err = hci_le_set_scan_enable(command_socket(), 0x00, 0x00, 10000);
+
+			if(err < 0)
+				throw IOError("Error disabling scan:", errno);
+		}
+
+		rates[current_rate].adverts += adverts_received - adverts_at_start;
+		rates[current_rate].scanning_time += std::chrono::steady_clock::now() - scan_started;
+
+		running = false;
+	}
+
+	//hci_send_req() swaps the socket's filter and reads and discards
+	//events while it waits for its Command Complete, so commands must
+	//not go on hci_fd: the capture thread or the caller may be reading
+	//it, and would eat the reply or see events the scan filter drops.
+	int HCIScanner::command_socket()
+	{
+		if(command_fd == -1)
+		{
+			command_fd.set(hci_open_dev(dev_id));
+			if(command_fd == -1)
+				throw IOError("Opening HCI command socket", errno);
+		}
+		return command_fd;
+	}
+
+	int HCIScanner::get_fd() const
+	{
+		if(ring)
+			return capture_notify_fd;
+		else
+			return hci_fd;
+	}
+
+		
+	HCIScanner::~HCIScanner()
+	{
+		stop_capture_thread();
+
+		try
+		{
+			stop();
+		}
+		catch(IOError&)
+		{
+		}
+	}
+	
+	void HCIScanner::set_software_filter(size_t capacity, DuplicateFilter::Clock::duration ttl)
+	{
+		scanned_devices.set_capacity(capacity);
+		scanned_devices.set_ttl(ttl);
+	}
+
+	const DuplicateFilter& HCIScanner::software_filter() const
+	{
+		return scanned_devices;
+	}
+
+	size_t HCIScanner::accept_list_capacity()
+	{
+		if(!controller_accept_list_size && external_source)
+			controller_accept_list_size = 0;
+		else if(!controller_accept_list_size)
+		{
+			uint8_t size=0;
+			if(hci_le_read_white_list_size(command_socket(), &size, 1000) < 0)
+			{
+				LOG(LogLevels::Warning, "Reading accept list size failed: " << strerror(errno) << ". Accept list will be handled in software.");
+				size = 0;
+			}
+			controller_accept_list_size = size;
+		}
+
+		return *controller_accept_list_size;
+	}
+
+	void HCIScanner::update_controller_accept_list(const BLEAddress& address, bool add)
+	{
+		bdaddr_t bdaddr;
+		memcpy(bdaddr.b, address.bytes, sizeof(bdaddr.b));
+		uint8_t type = static_cast<uint8_t>(address.type);
+
+		if(add)
+		{
+			if(hci_le_add_white_list(command_socket(), &bdaddr, type, 1000) < 0)
+				throw IOError("Adding to accept list", errno);
+		}
+		else
+		{
+			if(hci_le_rm_white_list(command_socket(), &bdaddr, type, 1000) < 0)
+				throw IOError("Removing from accept list", errno);
+		}
+	}
+
+	//Make the controller's list match accept_list, or clear it if
+	//accept_list doesn't fit. The scan must not be running.
+	void HCIScanner::load_accept_list()
+	{
+		size_t capacity = accept_list_capacity();
+		if(capacity == 0)
+		{
+			accept_list_in_controller = false;
+			return;
+		}
+
+		if(hci_le_clear_white_list(command_socket(), 1000) < 0)
+			throw IOError("Clearing accept list", errno);
+		accept_list_in_controller = false;
+
+		if(accept_list.size() > capacity)
+		{
+			LOG(LogLevels::Warning, "Accept list has " << accept_list.size() << " entries but the controller holds " << capacity << ". Filtering in software.");
+			return;
+		}
+		else if(accept_list.empty())
+			return;
+
+		for(const auto& a: accept_list)
+			update_controller_accept_list(a, true);
+
+		accept_list_in_controller = true;
+	}
+
+	void HCIScanner::set_accept_list(const std::vector<BLEAddress>& addresses)
+	{
+		bool was_running = running;
+		stop();
+
+		accept_list.clear();
+		accept_list.insert(addresses.begin(), addresses.end());
+		load_accept_list();
+
+		if(was_running)
+			start();
+	}
+
+	void HCIScanner::clear_accept_list()
+	{
+		set_accept_list({});
+	}
+
+	void HCIScanner::add_to_accept_list(const BLEAddress& address)
+	{
+		if(!accept_list.insert(address).second)
+			return;
+
+		bool was_running = running;
+		if(accept_list_in_controller && accept_list.size() <= accept_list_capacity())
+		{
+			stop();
+			update_controller_accept_list(address, true);
+		}
+		else if(accept_list_in_controller || accept_list.size() <= accept_list_capacity())
+		{
+			//Either it's just overflowed, or it's the first entry.
+			stop();
+			load_accept_list();
+		}
+		else
+		{
+			//Already filtering in software, which takes effect immediately.
+			return;
+		}
+
+		if(was_running)
+			start();
+	}
+
+	void HCIScanner::remove_from_accept_list(const BLEAddress& address)
+	{
+		if(accept_list.erase(address) == 0)
+			return;
+
+		bool was_running = running;
+		if(accept_list_in_controller)
+		{
+			stop();
+			update_controller_accept_list(address, false);
+			if(accept_list.empty())
+				accept_list_in_controller = false;
+		}
+		else if(!accept_list.empty() && accept_list.size() <= accept_list_capacity())
+		{
+			//Small enough to go back in to the controller.
+			stop();
+			load_accept_list();
+		}
+		else
+			return;
+
+		if(was_running)
+			start();
+	}
+
+	HCIScanner::AcceptListStats HCIScanner::accept_list_stats() const
+	{
+		AcceptListStats s;
+		s.entries = accept_list.size();
+		s.controller_capacity = controller_accept_list_size.value_or(0);
+		s.in_controller = accept_list_in_controller;
+		s.overflowed_entries = (accept_list_in_controller || s.entries < s.controller_capacity) ? 0 : s.entries - s.controller_capacity;
+		s.hits = accept_list_hits;
+		s.misses = accept_list_misses;
+		return s;
+	}
+
+	void HCIScanner::set_nonblocking(bool nb)
+	{
+		int flags = fcntl(hci_fd, F_GETFL);
+		if(flags < 0)
+			throw IOError("Getting HCI socket flags", errno);
+
+		if(nb)
+			flags |= O_NONBLOCK;
+		else
+			flags &= ~O_NONBLOCK;
+
+		if(fcntl(hci_fd, F_SETFL, flags) < 0)
+			throw IOError("Setting HCI socket flags", errno);
+
+		nonblocking = nb;
+	}
+
+	bool HCIScanner::is_nonblocking() const
+	{
+		return nonblocking;
+	}
+
+	//Receive one packet without blocking, along with when it arrived. The
+	//kernel stamps packets with the real time clock, so the stamp is 
+	//converted to steady_clock by working out how long ago that was.
+	static int receive_packet(int fd, uint8_t* buffer, size_t size, std::chrono::steady_clock::time_point& arrival)
+	{
+		iovec iov;
+		iov.iov_base = buffer;
+		iov.iov_len = size;
+
+		union
+		{
+			cmsghdr align;
+			char buf[CMSG_SPACE(sizeof(timeval)) + 64];
+		} control;
+
+		msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = &control;
+		msg.msg_controllen = sizeof(control);
+
+		int len = recvmsg(fd, &msg, MSG_DONTWAIT);
+		if(len < 0)
+			return len;
+
+		arrival = std::chrono::steady_clock::now();
+
+		for(cmsghdr* c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+		{
+			if((c->cmsg_level == SOL_HCI && c->cmsg_type == HCI_CMSG_TSTAMP) || (c->cmsg_level == SOL_SOCKET && c->cmsg_type == SCM_TIMESTAMP))
+			{
+				timeval tv;
+				memcpy(&tv, CMSG_DATA(c), sizeof(tv));
+				std::chrono::system_clock::time_point received(std::chrono::seconds(tv.tv_sec) + std::chrono::microseconds(tv.tv_usec));
+
+				auto age = std::chrono::system_clock::now() - received;
+				if(age > std::chrono::system_clock::duration::zero())
+					arrival -= std::chrono::duration_cast<std::chrono::steady_clock::duration>(age);
+			}
+		}
+
+		return len;
+	}
+
+	void HCIScanner::enable_timestamps()
+	{
+		//HCI sockets have their own option. Anything else, e.g. a replay
+		//socket, gets the generic one.
+		int on = 1;
+		int err;
+		if(external_source)
+			err = setsockopt(hci_fd, SOL_SOCKET, SO_TIMESTAMP, &on, sizeof(on));
+		else
+			err = setsockopt(hci_fd, SOL_HCI, HCI_TIME_STAMP, &on, sizeof(on));
+
+		timestamps_enabled = (err == 0);
+		if(!timestamps_enabled)
+			LOG(LogLevels::Info, "No kernel timestamps: " << strerror(errno));
+	}
+
+	bool HCIScanner::kernel_timestamps() const
+	{
+		return timestamps_enabled;
+	}
+
+	size_t HCIScanner::read_with_retry()
+	{
+		int len;
+
+		while((len = receive_packet(hci_fd, read_buffer.data(), read_buffer.size(), read_timestamp)) < 0)
+		{
+			//Don't retry on EAGAIN: that would just spin.
+			if(errno == EAGAIN || errno == EWOULDBLOCK)
+				return 0;
+			else if(errno == EINTR)
+				throw Interrupted("interrupted reading HCI packet");
+			else
+				throw IOError("reading HCI packet", errno);
+		}
+
+		//A datagram socket only reads 0 bytes at EOF: HCI never sends
+		//empty packets.
+		if(len == 0)
+			source_closed = true;
+
+		return len;
+	}
+
+	std::vector<AdvertisingResponse> HCIScanner::get_advertisements()
+	{
+		return get_advertisements(nonblocking?0:-1);
+	}
+
+	namespace
+	{
+		//Builds the owning responses for the vector based interface.
+		class MaterializingSink: public AdvertisingSink
+		{
+			public:
+				std::vector<AdvertisingResponse> adverts;
+
+				void on_advertisement(const AdvertisingView& a) override
+				{
+					try
+					{
+						adverts.push_back(a.materialize());
+					}
+					catch(std::out_of_range& r)
+					{
+						LOG(LogLevels::Error, "Corrupted data sent by device " << a.address);
+					}
+				}
+		};
+
+		//Counts everything that's parsed.
+		class CountingSink: public AdvertisingSink
+		{
+			private:
+				uint64_t& count;
+				uint64_t& corrupt;
+				AdvertisingSink& next;
+
+			public:
+				CountingSink(uint64_t& c, uint64_t& bad, AdvertisingSink& n)
+				:count(c), corrupt(bad), next(n)
+				{
+				}
+
+				void on_advertisement(const AdvertisingView& a) override
+				{
+					count++;
+					next.on_advertisement(a);
+				}
+
+				void on_corrupt_advertisement(const AdvertisingView& a) override
+				{
+					corrupt++;
+					next.on_corrupt_advertisement(a);
+				}
+		};
+
+		//Drops reports from devices not on the accept list, unless
+		//the list is empty.
+		class AcceptListSink: public AdvertisingSink
+		{
+			private:
+				const std::unordered_set<BLEAddress>& list;
+				uint64_t& hits;
+				uint64_t& misses;
+				AdvertisingSink& next;
+
+			public:
+				AcceptListSink(const std::unordered_set<BLEAddress>& l, uint64_t& h, uint64_t& m, AdvertisingSink& n)
+				:list(l), hits(h), misses(m), next(n)
+				{
+				}
+
+				void on_advertisement(const AdvertisingView& a) override
+				{
+					if(list.empty())
+						next.on_advertisement(a);
+					else if(list.count(a.address))
+					{
+						hits++;
+						next.on_advertisement(a);
+					}
+					else
+						misses++;
+				}
+		};
+
+		//Applies the software duplicate filter in place, before
+		//passing reports on.
+		class DuplicateFilterSink: public AdvertisingSink
+		{
+			private:
+				DuplicateFilter& filter;
+				AdvertisingSink& next;
+
+			public:
+				DuplicateFilterSink(DuplicateFilter& f, AdvertisingSink& n)
+				:filter(f), next(n)
+				{
+				}
+
+				void on_advertisement(const AdvertisingView& a) override
+				{
+					if(filter.insert(a.address, static_cast<uint8_t>(a.type), a.timestamp))
+						next.on_advertisement(a);
+					else
+						LOG(Debug, "Entry " << a.address << " " << static_cast<int>(a.type) << " found already");
+				}
+		};
+
+		class MergeSink: public AdvertisingSink
+		{
+			private:
+				ScanResponseMerger& merger;
+				AdvertisingSink& next;
+
+			public:
+				MergeSink(ScanResponseMerger& m, AdvertisingSink& n)
+				:merger(m), next(n)
+				{
+				}
+
+				void on_advertisement(const AdvertisingView& a) override
+				{
+					merger.add(a, next);
+				}
+		};
+	}
+
+	std::vector<AdvertisingResponse> HCIScanner::get_advertisements(int timeout_ms)
+	{
+		MaterializingSink sink;
+		get_advertisements(sink, timeout_ms);
+		return std::move(sink.adverts);
+	}
+
+	void HCIScanner::get_advertisement_views(const std::function<void(const AdvertisingView&)>& callback)
+	{
+		get_advertisement_views(callback, nonblocking?0:-1);
+	}
+
+	void HCIScanner::get_advertisement_views(const std::function<void(const AdvertisingView&)>& callback, int timeout_ms)
+	{
+		auto sink = make_advertising_sink(callback);
+		get_advertisements(sink, timeout_ms);
+	}
+
+	void HCIScanner::get_advertisements(AdvertisingSink& sink)
+	{
+		get_advertisements(sink, nonblocking?0:-1);
+	}
+
+	void HCIScanner::get_advertisements(AdvertisingSink& sink, int timeout_ms)
+	{
+		//Otherwise the closed fd polls readable forever.
+		if(source_closed)
+			throw Closed("HCI source closed");
+
+		//Wake up in time to release held adverts.
+		int next_timeout = next_timeout_ms();
+		if(next_timeout >= 0 && (timeout_ms < 0 || next_timeout < timeout_ms))
+			timeout_ms = next_timeout;
+
+		if(timeout_ms != 0)
+		{
+			pollfd p;
+			p.fd = get_fd();
+			p.events = POLLIN;
+			p.revents = 0;
+
+			int err = poll(&p, 1, timeout_ms);
+
+			if(err < 0)
+			{
+				if(errno == EINTR)
+					throw Interrupted("interrupted waiting for HCI packet");
+				else
+					throw IOError("waiting for HCI packet", errno);
+			}
+			else if(err == 0)
+			{
+				release_merged(sink);
+
+				if(running && refresh_interval > std::chrono::steady_clock::duration::zero() && std::chrono::steady_clock::now() >= next_refresh)
+					refresh_duplicate_filters();
+				return;
+			}
+		}
+
+		if(ring)
+		{
+			//Hand over everything captured before complaining.
+			if(ring->occupancy() == 0)
+			{
+				if(capture_errno != 0)
+					throw IOError("reading HCI packet", capture_errno);
+				if(capture_closed)
+					throw Closed("HCI source closed");
+			}
+
+			uint64_t count;
+			if(read(capture_notify_fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+				throw IOError("reading capture eventfd", errno);
+
+			const uint8_t* packet;
+			size_t len;
+			std::chrono::steady_clock::time_point arrival;
+			for(int i=0; i < max_events_per_read && ring->peek(packet, len, arrival); i++)
+			{
+				try
+				{
+					process_packet(packet, len, sink, arrival);
+				}
+				catch(...)
+				{
+					ring->release();
+					throw;
+				}
+				ring->release();
+			}
+
+			//Leftovers. Make sure the fd stays readable. Once the capture
+			//thread has stopped on an error or a closed source, it won't 
+			//signal again, so the next call needs waking to report it.
+			if(ring->occupancy() != 0 || capture_closed || capture_errno != 0)
+			{
+				if(ring->occupancy() != 0)
+					full_reads++;
+				count = 1;
+				if(write(capture_notify_fd, &count, sizeof(count)) < 0)
+					throw IOError("writing capture eventfd", errno);
+			}
+		}
+		else
+		{
+			//Drain everything which is waiting, without blocking.
+			int i;
+			for(i=0; i < max_events_per_read; i++)
+			{
+				size_t len = read_with_retry();
+
+				if(len == 0)
+				{
+					if(source_closed && i == 0)
+						throw Closed("HCI source closed");
+					break;
+				}
+			
+				process_packet(read_buffer.data(), len, sink, read_timestamp);
+			}
+
+			if(i == max_events_per_read)
+				full_reads++;
+		}
+
+		release_merged(sink);
+
+		if(running && refresh_interval > std::chrono::steady_clock::duration::zero() && std::chrono::steady_clock::now() >= next_refresh)
+			refresh_duplicate_filters();
+	}
+
+	void HCIScanner::process_packet(const uint8_t* packet, size_t len, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival)
+	{
+		//Reports go through: count, accept list, scan response merging, 
+		//duplicate filter, then the sink. Merging goes before the duplicate 
+		//filter so that it sees adverts with their responses.
+		DuplicateFilterSink filter(scanned_devices, sink);
+		AdvertisingSink& deduplicated = software_filtering ? static_cast<AdvertisingSink&>(filter) : sink;
+
+		packets_read++;
+		try
+		{
+			if(merger)
+			{
+				MergeSink merge(*merger, deduplicated);
+				AcceptListSink accept(accept_list, accept_list_hits, accept_list_misses, merge);
+				CountingSink counter(adverts_received, corrupt_adverts, accept);
+				parse_packet(packet, len, counter, arrival);
+			}
+			else
+			{
+				AcceptListSink accept(accept_list, accept_list_hits, accept_list_misses, deduplicated);
+				CountingSink counter(adverts_received, corrupt_adverts, accept);
+				parse_packet(packet, len, counter, arrival);
+			}
+		}
+		catch(HCIError&)
+		{
+			//Already logged. Drop it, and keep everything else which
+			//arrived in the same read.
+			malformed_packets++;
+		}
+		catch(std::out_of_range&)
+		{
+			LOG(LogLevels::Error, "Truncated HCI packet");
+			malformed_packets++;
+		}
+	}
+
+	void HCIScanner::release_merged(AdvertisingSink& sink)
+	{
+		if(!merger || merger->pending() == 0)
+			return;
+
+		DuplicateFilterSink filter(scanned_devices, sink);
+		merger->release(std::chrono::steady_clock::now(), software_filtering ? static_cast<AdvertisingSink&>(filter) : sink);
+	}
+
+	void HCIScanner::set_scan_response_merging(std::chrono::steady_clock::duration window)
+	{
+		if(window <= std::chrono::steady_clock::duration::zero())
+			merger.reset();
+		else
+			merger.reset(new ScanResponseMerger(window));
+	}
+
+	const ScanResponseMerger* HCIScanner::scan_response_merger() const
+	{
+		return merger.get();
+	}
+
+	int HCIScanner::next_timeout_ms() const
+	{
+		std::chrono::steady_clock::time_point deadline, merge_deadline;
+		bool any = false;
+
+		if(running && refresh_interval > std::chrono::steady_clock::duration::zero())
+		{
+			deadline = next_refresh;
+			any = true;
 		}
 
-		LOG(LogLevels::Info, "Starting scanner");
-		scanned_devices.clear();
-
-		//Removal of duplicates done on the adapter itself
-		uint8_t filter_dup = hardware_filtering?0x01:0x00;
-		
-		
-		//Set up the filters. 
-		socklen_t olen = sizeof(old_filter);
-		if (getsockopt(hci_fd, SOL_HCI, HCI_FILTER, &old_filter, &olen) < 0) 
-			throw IOError("Getting HCI filter socket options", errno);
+		if(merger && merger->next_deadline(merge_deadline))
+		{
+			if(!any || merge_deadline < deadline)
+				deadline = merge_deadline;
+			any = true;
+		}
 
-		
-		//Magic incantations to get scan events
-		struct hci_filter nf;
-		hci_filter_clear(&nf);
-		hci_filter_set_ptype(HCI_EVENT_PKT, &nf);
-		hci_filter_set_event(EVT_LE_META_EVENT, &nf);
-		if (setsockopt(hci_fd, SOL_HCI, HCI_FILTER, &nf, sizeof(nf)) < 0)
-			throw IOError("Setting HCI filter socket options", errno);
+		if(!any)
+			return -1;
 
+		auto wait = deadline - std::chrono::steady_clock::now();
+		if(wait <= std::chrono::steady_clock::duration::zero())
+			return 0;
 
-		//device disable/enable duplictes ????
-		err = hci_le_set_scan_enable(hci_fd, 0x01, filter_dup, 10000);
-		if(err < 0)
-			throw IOError("Enabling scan", errno);
+		//Round up, so the work is due when poll returns.
+		return std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1;
+	}
 
-		running=true;
+	void HCIScanner::set_refresh_interval(std::chrono::steady_clock::duration interval)
+	{
+		refresh_interval = interval;
+		next_refresh = std::chrono::steady_clock::now() + interval;
 	}
 
-	void HCIScanner::stop()
+	void HCIScanner::refresh_duplicate_filters()
 	{
-		ENTER();
-		if(!running)
+		auto t0 = std::chrono::steady_clock::now();
+
+		//Toggling the scan is the only way to clear the controller's list.
+		if(hardware_filtering && !external_source)
 		{
-			return;
+			int cmd = command_socket();
+			if(hci_le_set_scan_enable(cmd, 0x00, 0x00, 1000) < 0)
+				throw IOError("Disabling scan for refresh", errno);
+			if(hci_le_set_scan_enable(cmd, 0x01, 0x01, 1000) < 0)
+				throw IOError("Enabling scan after refresh", errno);
+
+			last_refresh_gap = std::chrono::steady_clock::now() - t0;
+			max_refresh_gap = std::max(max_refresh_gap, last_refresh_gap);
+			total_refresh_gap += last_refresh_gap;
+			LOG(Info, "Refresh gap " << std::chrono::duration_cast<std::chrono::microseconds>(last_refresh_gap).count() << "us");
 		}
 
-		LOG(LogLevels::Info, "Cleaning up HCI scanner");
-		int err = hci_le_set_scan_enable(hci_fd, 0x00, 0x00, 10000);
+		scanned_devices.clear();
+		refreshes++;
 
-		if(err < 0)
-			throw IOError("Error disabling scan:", errno);
+		//Don't try to catch up if calls have been late.
+		next_refresh += refresh_interval;
+		if(next_refresh <= t0)
+			next_refresh = t0 + refresh_interval;
+	}
 
-		err = setsockopt(hci_fd, SOL_HCI, HCI_FILTER, &old_filter, sizeof(old_filter));
+	void HCIScanner::set_receive_buffer(size_t bytes)
+	{
+		int size = bytes;
 
-		if(err < 0)
-			throw IOError("Error resetting HCI socket:", errno);
+		if(setsockopt(hci_fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+			if(setsockopt(hci_fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size)) < 0)
+				throw IOError("Setting HCI receive buffer size", errno);
+	}
 
-		running = false;
+	size_t HCIScanner::receive_buffer() const
+	{
+		int size=0;
+		socklen_t len = sizeof(size);
+
+		if(getsockopt(hci_fd, SOL_SOCKET, SO_RCVBUF, &size, &len) < 0)
+			throw IOError("Getting HCI receive buffer size", errno);
+
+		return size;
 	}
 
-	int HCIScanner::get_fd() const
+	bool HCIScanner::read_meminfo(uint32_t& drops, uint32_t& queued) const
 	{
-		return hci_fd;
+#ifdef SO_MEMINFO
+		uint32_t info[SK_MEMINFO_VARS];
+		socklen_t len = sizeof(info);
+
+		if(getsockopt(hci_fd, SOL_SOCKET, SO_MEMINFO, info, &len) < 0 || len <= SK_MEMINFO_DROPS * sizeof(uint32_t))
+			return false;
+
+		drops = info[SK_MEMINFO_DROPS];
+		queued = info[SK_MEMINFO_RMEM_ALLOC];
+		return true;
+#else
+		return false;
+#endif
 	}
 
-		
-	HCIScanner::~HCIScanner()
+	HCIScanner::ScannerStats HCIScanner::stats() const
 	{
-		try
-		{
-			stop();
-		}
-		catch(IOError&)
-		{
-		}
+		ScannerStats s;
+		s.packets = packets_read;
+		s.adverts = adverts_received;
+		s.corrupt_adverts = corrupt_adverts;
+		s.malformed_packets = malformed_packets;
+		s.full_reads = full_reads;
+
+		uint32_t drops=0, queued=0;
+		s.kernel_drops_known = read_meminfo(drops, queued);
+		s.kernel_drops = s.kernel_drops_known ? drops - kernel_drops_at_open : 0;
+		s.receive_queued = queued;
+		s.receive_buffer = receive_buffer();
+
+		s.ring_overflows = earlier_overflows + overflows;
+
+		s.refreshes = refreshes;
+		s.last_refresh_gap = last_refresh_gap;
+		s.max_refresh_gap = max_refresh_gap;
+		s.total_refresh_gap = total_refresh_gap;
+		return s;
 	}
-	
-	HCIScanner::FilterEntry::FilterEntry(const AdvertisingResponse& a)
-	:mac_address(a.address),type(static_cast<int>(a.type))
-	{}
-	
-	bool HCIScanner::FilterEntry::operator<(const FilterEntry& f) const
+
+	void HCIScanner::start_capture_thread(size_t ring_slots)
 	{
-		//Simple lexi-sorting
-		if(mac_address < f.mac_address)
-			return true;
-		else if(mac_address == f.mac_address)
-			return type < f.type;
-		else
-			return false;
+		ENTER();
+		if(ring)
+			return;
+
+		int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(fd < 0)
+			throw IOError("Creating capture eventfd", errno);
+		capture_notify_fd.reset(fd);
+
+		fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+		if(fd < 0)
+			throw IOError("Creating capture eventfd", errno);
+		capture_quit_fd.reset(fd);
+
+		capture_errno = 0;
+		capture_closed = false;
+		captured = 0;
+		earlier_overflows += overflows;
+		overflows = 0;
+		ring_high_water = 0;
+		ring.reset(new PacketRing(ring_slots, HCI_MAX_EVENT_SIZE));
+
+		LOG(LogLevels::Info, "Starting HCI capture thread");
+		capture_thread = std::thread([this](){ capture_loop(); });
 	}
 
-	std::vector<uint8_t> HCIScanner::read_with_retry()
+	void HCIScanner::stop_capture_thread()
 	{
-		int len;
-		std::vector<uint8_t> buf(HCI_MAX_EVENT_SIZE);
+		ENTER();
+		if(!ring)
+			return;
 
+		uint64_t one = 1;
+		if(write(capture_quit_fd, &one, sizeof(one)) < 0)
+			LOG(LogLevels::Error, "Failed to signal capture thread: " << strerror(errno));
 
-		while((len = read(hci_fd, buf.data(), buf.size())) < 0)
-		{
-			if(errno == EAGAIN)
-				continue;
-			else if(errno == EINTR)
-				throw Interrupted("interrupted reading HCI packet");
-			else
-				throw IOError("reading HCI packet", errno);
-		}
+		capture_thread.join();
+		ring.reset();
+		capture_notify_fd.reset();
+		capture_quit_fd.reset();
+	}
+
+	bool HCIScanner::is_capturing() const
+	{
+		return ring != nullptr;
+	}
 
-		buf.resize(len);
-		return buf;
+	HCIScanner::CaptureStats HCIScanner::capture_stats() const
+	{
+		CaptureStats s;
+		s.ring_capacity = ring?ring->capacity():0;
+		s.ring_occupancy = ring?ring->occupancy():0;
+		s.ring_high_water = ring_high_water;
+		s.captured = captured;
+		s.overflows = overflows;
+		return s;
 	}
 
-	std::vector<AdvertisingResponse> HCIScanner::get_advertisements()
+	//This runs on its own thread, so no logging and no exceptions.
+	//Errors are handed to the consumer via capture_errno.
+	void HCIScanner::capture_loop()
 	{
-		std::vector<AdvertisingResponse> adverts = parse_packet(read_with_retry());
-		
-		if(software_filtering)
+		std::vector<uint8_t> overflow_buffer(HCI_MAX_EVENT_SIZE);
+		uint64_t one = 1;
+
+		pollfd fds[2];
+		fds[0].fd = hci_fd;
+		fds[0].events = POLLIN;
+		fds[1].fd = capture_quit_fd;
+		fds[1].events = POLLIN;
+
+		for(;;)
 		{
-			std::vector<AdvertisingResponse> filtered;
+			fds[0].revents = fds[1].revents = 0;
+			if(poll(fds, 2, -1) < 0)
+			{
+				if(errno == EINTR)
+					continue;
+				capture_errno = errno;
+				break;
+			}
+
+			if(fds[1].revents)
+				return;
 
-			for(const auto& a: adverts)
+			//Read everything that's waiting, then wake the consumer once.
+			bool got_any = false;
+			for(;;)
 			{
-				auto r = scanned_devices.insert(FilterEntry(a));
+				uint8_t* slot = ring->producer_slot();
+				uint8_t* dest = slot?slot:overflow_buffer.data();
+
+				std::chrono::steady_clock::time_point arrival;
+				int len = receive_packet(hci_fd, dest, HCI_MAX_EVENT_SIZE, arrival);
+
+				if(len == 0)
+				{
+					capture_closed = true;
+					break;
+				}
+				else if(len < 0)
+				{
+					if(errno == EAGAIN || errno == EWOULDBLOCK)
+						break;
+					else if(errno == EINTR)
+						continue;
+
+					capture_errno = errno;
+					break;
+				}
+
+				if(slot)
+				{
+					ring->commit(len, arrival);
+					captured++;
+					got_any = true;
 
-				if(r.second)
-					filtered.emplace_back(std::move(a));
+					size_t occ = ring->occupancy();
+					if(occ > ring_high_water)
+						ring_high_water = occ;
+				}
 				else
-					LOG(Debug, "Entry " << a.address << " " << static_cast<int>(a.type) << " found already");
+					overflows++;
 			}
 
-			return filtered;
+			if(got_any || capture_errno != 0 || capture_closed)
+				if(write(capture_notify_fd, &one, sizeof(one)) < 0)
+					capture_errno = errno;
+
+			if(capture_errno != 0 || capture_closed)
+				break;
 		}
-		else
-			return adverts;
+
+		//Make sure the consumer wakes up to see the error. If this fails
+		//there's nothing more that can be done.
+		if(write(capture_notify_fd, &one, sizeof(one)) < 0)
+			return;
 	}
 
 	/*
@@ -452,19 +1410,37 @@ namespace BLEPP
 
 	*/
 
-	std::vector<AdvertisingResponse> parse_event_packet(Span packet);
-	std::vector<AdvertisingResponse> parse_le_meta_event(Span packet);
-	std::vector<AdvertisingResponse> parse_le_meta_event_advertisement(Span packet);
+	void parse_event_packet(Span packet, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival);
+	void parse_le_meta_event(Span packet, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival);
+	void parse_le_meta_event_advertisement(Span packet, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival);
 
 	std::vector<AdvertisingResponse> HCIScanner::parse_packet(const std::vector<uint8_t>& p)
 	{
-		Span  packet(p);
-		LOG(Debug, to_hex(p));
+		MaterializingSink sink;
+		parse_packet(p.data(), p.size(), sink);
+		return std::move(sink.adverts);
+	}
+
+	void HCIScanner::parse_packet(const uint8_t* p, size_t length, const std::function<void(const AdvertisingView&)>& callback)
+	{
+		auto sink = make_advertising_sink(callback);
+		parse_packet(p, length, sink);
+	}
+
+	void HCIScanner::parse_packet(const uint8_t* p, size_t length, AdvertisingSink& sink)
+	{
+		parse_packet(p, length, sink, std::chrono::steady_clock::now());
+	}
+
+	void HCIScanner::parse_packet(const uint8_t* p, size_t length, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival)
+	{
+		Span  packet(p, length);
+		LOG(Debug, to_hex(packet));
 
 		if(packet.size() < 1)
 		{
 			LOG(LogLevels::Error, "Empty packet received");
-			return {};
+			return;
 		}
 
 		uint8_t packet_id = packet.pop_front();
@@ -473,7 +1449,7 @@ namespace BLEPP
 		if(packet_id == HCI_EVENT_PKT)
 		{
 			LOG(Debug, "Event packet received");
-			return parse_event_packet(packet);
+			parse_event_packet(packet, sink, arrival);
 		}
 		else
 		{
@@ -482,7 +1458,7 @@ namespace BLEPP
 		}
 	}
 
-	std::vector<AdvertisingResponse> parse_event_packet(Span packet)
+	void parse_event_packet(Span packet, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival)
 	{
 		if(packet.size() < 2)
 			throw HCIScanner::HCIError("Truncated event packet");
@@ -499,7 +1475,7 @@ namespace BLEPP
 			LOG(Info, "event_code = 0x" << std::hex << (int)event_code << ": Meta event" << std::dec);
 			LOGVAR(Info, length);
 
-			return parse_le_meta_event(packet);
+			parse_le_meta_event(packet, sink, arrival);
 		}
 		else
 		{
@@ -510,31 +1486,31 @@ namespace BLEPP
 	}
 
 
-	std::vector<AdvertisingResponse> parse_le_meta_event(Span packet)
+	void parse_le_meta_event(Span packet, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival)
 	{
 		uint8_t subevent_code = packet.pop_front();
 
 		if(subevent_code == 0x02) // see big blob of comments above
 		{
 			LOG(Info, "subevent_code = 0x02: LE Advertising Report Event");
-			return parse_le_meta_event_advertisement(packet);
+			parse_le_meta_event_advertisement(packet, sink, arrival);
 		}
 		else
 		{
 			LOGVAR(Info, subevent_code);
-			return {};
 		}
 	}
 
-	std::vector<AdvertisingResponse> parse_le_meta_event_advertisement(Span packet)
+	void parse_le_meta_event_advertisement(Span packet, AdvertisingSink& sink, std::chrono::steady_clock::time_point arrival)
 	{
-		std::vector<AdvertisingResponse> ret;
-
 		uint8_t num_reports = packet.pop_front();
 		LOGVAR(Info, num_reports);
 
 		for(int i=0; i < num_reports; i++)
 		{
+			AdvertisingView view;
+			view.timestamp = arrival;
+
 			LeAdvertisingEventType event_type = static_cast<LeAdvertisingEventType>(packet.pop_front());
 
 			if(event_type == LeAdvertisingEventType::ADV_IND)
@@ -555,24 +1531,14 @@ namespace BLEPP
 			if(address_type == 0)
 				LOG(Info, "Address type = 0: Public device address");
 			else if(address_type == 1)
-				LOG(Info, "Address type = 0: Random device address");
+				LOG(Info, "Address type = 1: Random device address");
 			else
 				LOG(Info, "Address type = 0x" << to_hex(address_type) << ": unknown");
 
+			view.type = event_type;
+			view.address = BLEAddress(packet.pop_front(6).data(), static_cast<AddressType>(address_type));
 
-			std::string address;
-			for(int j=0; j < 6; j++)
-			{
-				std::ostringstream s;
-				s << std::hex << std::setw(2) << std::setfill('0') << (int) packet.pop_front();
-				if(j != 0)
-					s << ":";
-
-				address = s.str() + address;
-			}
-
-
-			LOGVAR(Info, address);
+			LOG(Info, "address = " << view.address);
 
 			uint8_t length = packet.pop_front();
 			LOGVAR(Info, length);
@@ -591,112 +1557,419 @@ namespace BLEPP
 			else
 				LOG(Info, "RSSI = " << to_hex((uint8_t)rssi) << " unknown");
 
-			try{
-				AdvertisingResponse rsp;
-				rsp.address = address;
-				rsp.type = event_type;
-				rsp.rssi = rssi;
-				rsp.raw_packet.push_back({data.begin(), data.end()});
-
-				while(data.size() > 0)
-				{
-					LOGVAR(Debug, data.size());
-					LOG(Debug, "Packet = " << to_hex(data));
-					//Format is length, type, crap
-					int length = data.pop_front();
-					
-					LOGVAR(Debug, length);
+			view.rssi = rssi;
+			view.data = data.data();
+			view.length = length;
 
-					Span chunk = data.pop_front(length);
+			if(view.build_index())
+				sink.on_advertisement(view);
+			else
+			{
+				LOG(LogLevels::Error, "Corrupted data sent by device " << view.address);
+				sink.on_corrupt_advertisement(view);
+			}
+		}
+	}
 
-					uint8_t type = chunk[0];
-					LOGVAR(Debug, type);
+	bool AdvertisingView::build_index()
+	{
+		for(auto& p: index.present)
+			p = 0;
+		index.count = 0;
+		index.overflowed = false;
+		indexed = false;
 
-					if(type == GAP::flags)
-					{
-						rsp.flags = AdvertisingResponse::Flags({chunk.begin(), chunk.end()});
+		for(size_t pos=0; pos < length;)
+		{
+			uint8_t len = data[pos];
 
-						LOG(Info, "Flags = " << to_hex(rsp.flags->flag_data));
+			//Early termination, 4.0/3/C.11
+			if(len == 0)
+				break;
 
-						if(rsp.flags->LE_limited_discoverable)
-							LOG(Info, "        LE limited discoverable");
+			if(len > length - pos - 1)
+				return false;
 
-						if(rsp.flags->LE_general_discoverable)
-							LOG(Info, "        LE general discoverable");
+			uint8_t type = data[pos+1];
+			index.present[type >> 6] |= uint64_t(1) << (type & 63);
 
-						if(rsp.flags->BR_EDR_unsupported)
-							LOG(Info, "        BR/EDR unsupported");
+			if(index.count < Index::max_entries)
+			{
+				index.types[index.count] = type;
+				index.offsets[index.count] = pos;
+				index.count++;
+			}
+			else
+				index.overflowed = true;
 
-						if(rsp.flags->simultaneous_LE_BR_host)
-							LOG(Info, "        simultaneous LE BR host");
+			pos += len + 1;
+		}
 
-						if(rsp.flags->simultaneous_LE_BR_controller)
-							LOG(Info, "        simultaneous LE BR controller");
-					}
-					else if(type == GAP::incomplete_list_of_16_bit_UUIDs || type == GAP::complete_list_of_16_bit_UUIDs)
-					{
-						rsp.uuid_16_bit_complete = (type == GAP::complete_list_of_16_bit_UUIDs);
-						chunk.pop_front(); //remove the type field
-
-						while(!chunk.empty())
-						{
-							uint16_t u = chunk.pop_front() + chunk.pop_front()*256;
-							rsp.UUIDs.push_back(UUID(u));
-						}
-					}
-					else if(type == GAP::incomplete_list_of_128_bit_UUIDs || type == GAP::complete_list_of_128_bit_UUIDs)
-					{
-						rsp.uuid_128_bit_complete = (type == GAP::complete_list_of_128_bit_UUIDs);
-						chunk.pop_front(); //remove the type field
+		indexed = true;
+		return true;
+	}
 
-						while(!chunk.empty())
-							rsp.UUIDs.push_back(UUID::from(att_get_uuid128(chunk.pop_front(16).data())));
-					}
-					else if(type == GAP::shortened_local_name || type == GAP::complete_local_name)
-					{
-						chunk.pop_front();
-						AdvertisingResponse::Name n;
-						n.complete = type==GAP::complete_local_name;
-						n.name = std::string(chunk.begin(), chunk.end());
-						rsp.local_name = n;
+	bool AdvertisingView::has(uint8_t type) const
+	{
+		if(indexed)
+			return index.present[type >> 6] & (uint64_t(1) << (type & 63));
+		else
+			return bool(find(type));
+	}
 
-						LOG(Info, "Name (" << (n.complete?"complete":"incomplete") << "): " << n.name);
-					}
-					else if(type == GAP::manufacturer_data)
-					{
-						chunk.pop_front();
-						rsp.manufacturer_specific_data.push_back({chunk.begin(), chunk.end()});
-						LOG(Info, "Manufacturer data: " << to_hex(chunk));
-					}
-					else
-					{
-						rsp.unparsed_data_with_types.push_back({chunk.begin(), chunk.end()});
+	boost::optional<ADStructure> AdvertisingView::find(uint8_t type) const
+	{
+		if(indexed)
+		{
+			if(!has(type))
+				return boost::none;
 
-						LOG(Info, "Unparsed chunk " << to_hex(chunk));
-					}
+			for(int i=0; i < index.count; i++)
+				if(index.types[i] == type)
+				{
+					const uint8_t* p = data + index.offsets[i];
+					return ADStructure{p[1], p+2, static_cast<uint8_t>(p[0]-1)};
 				}
+			
+			//Only if it's beyond the end of the index
+		}
 
-				if(rsp.UUIDs.size() > 0)
-				{
-					LOG(Info, "UUIDs (128 bit " << (rsp.uuid_128_bit_complete?"complete":"incomplete")
-						  << ", 16 bit " << (rsp.uuid_16_bit_complete?"complete":"incomplete") << " ):");
+		for(const ADStructure& a: *this)
+			if(a.type == type)
+				return a;
 
-					for(const auto& uuid: rsp.UUIDs)
-						LOG(Info, "    " << to_str(uuid));
-				}
+		return boost::none;
+	}
+
+	////////////////////////////////////////////////////////////////////////////////
+	//
+	// Decoding of individual AD types, shared by the lazy accessors and materialize().
+	//
+	namespace
+	{
+		AdvertisingResponse::Name decode_name(const ADStructure& a)
+		{
+			AdvertisingResponse::Name n;
+			n.complete = a.type==GAP::complete_local_name;
+			n.name = std::string(a.data, a.data + a.length);
+			return n;
+		}
+
+		AdvertisingResponse::Flags decode_flags(const ADStructure& a)
+		{
+			std::vector<uint8_t> flag_data(1, a.type);
+			flag_data.insert(flag_data.end(), a.data, a.data + a.length);
+			return AdvertisingResponse::Flags(std::move(flag_data));
+		}
+
+		int8_t decode_tx_power(const ADStructure& a)
+		{
+			//CSS A.1.5
+			return Span(a.data, a.length).pop_front();
+		}
+
+		uint16_t decode_appearance(const ADStructure& a)
+		{
+			//CSS A.1.12
+			Span chunk(a.data, a.length);
+			return att_get_u16(chunk.pop_front(2).data());
+		}
 
-				ret.push_back(rsp);
+		UUID pop_uuid(Span& chunk, size_t width)
+		{
+			Span u = chunk.pop_front(width);
 
+			if(width == 2)
+				return UUID(att_get_u16(u.data()));
+			else if(width == 4)
+			{
+				UUID uuid;
+				bt_uuid32_create(&uuid, att_get_u32(u.data()));
+				return uuid;
+			}
+			else
+				return UUID::from(att_get_uuid128(u.data()));
+		}
 
+		size_t uuid_width(uint8_t type)
+		{
+			switch(type)
+			{
+				case GAP::incomplete_list_of_16_bit_UUIDs:
+				case GAP::complete_list_of_16_bit_UUIDs:
+				case GAP::service_data_16_bit_UUID:
+					return 2;
+				case GAP::incomplete_list_of_32_bit_UUIDs:
+				case GAP::complete_list_of_32_bit_UUIDs:
+				case GAP::service_data_32_bit_UUID:
+					return 4;
+				default:
+					return 16;
 			}
-			catch(std::out_of_range& r)
+		}
+
+		void decode_uuids(const ADStructure& a, std::vector<UUID>& uuids)
+		{
+			Span chunk(a.data, a.length);
+			size_t width = uuid_width(a.type);
+
+			//The list must be a whole number of UUIDs
+			if(chunk.size() % width)
+				throw std::out_of_range("");
+
+			while(!chunk.empty())
+				uuids.push_back(pop_uuid(chunk, width));
+		}
+
+		AdvertisingResponse::ServiceData decode_service_data(const ADStructure& a)
+		{
+			//CSS A.1.11: the UUID followed by the data
+			Span chunk(a.data, a.length);
+			AdvertisingResponse::ServiceData d;
+			d.uuid = pop_uuid(chunk, uuid_width(a.type));
+			d.data.assign(chunk.begin(), chunk.end());
+			return d;
+		}
+
+		typedef void (*ADDecoder)(AdvertisingResponse&, const ADStructure&);
+
+		struct ADType
+		{
+			const char* name;
+			ADDecoder decode;  //nullptr means the data ends up in unparsed_data_with_types
+		};
+
+		void flags_to_response(AdvertisingResponse& rsp, const ADStructure& a)
+		{
+			rsp.flags = decode_flags(a);
+
+			LOG(Info, "Flags = " << to_hex(rsp.flags->flag_data));
+
+			if(rsp.flags->LE_limited_discoverable)
+				LOG(Info, "        LE limited discoverable");
+
+			if(rsp.flags->LE_general_discoverable)
+				LOG(Info, "        LE general discoverable");
+
+			if(rsp.flags->BR_EDR_unsupported)
+				LOG(Info, "        BR/EDR unsupported");
+
+			if(rsp.flags->simultaneous_LE_BR_host)
+				LOG(Info, "        simultaneous LE BR host");
+
+			if(rsp.flags->simultaneous_LE_BR_controller)
+				LOG(Info, "        simultaneous LE BR controller");
+		}
+
+		void uuids_to_response(AdvertisingResponse& rsp, const ADStructure& a)
+		{
+			switch(a.type)
 			{
-				LOG(LogLevels::Error, "Corrupted data sent by device " << address);
+				case GAP::complete_list_of_16_bit_UUIDs:  rsp.uuid_16_bit_complete = true; break;
+				case GAP::complete_list_of_32_bit_UUIDs:  rsp.uuid_32_bit_complete = true; break;
+				case GAP::complete_list_of_128_bit_UUIDs: rsp.uuid_128_bit_complete = true; break;
 			}
+
+			decode_uuids(a, rsp.UUIDs);
+		}
+
+		void name_to_response(AdvertisingResponse& rsp, const ADStructure& a)
+		{
+			rsp.local_name = decode_name(a);
+			LOG(Info, "Name (" << (rsp.local_name->complete?"complete":"incomplete") << "): " << rsp.local_name->name);
+		}
+
+		void tx_power_to_response(AdvertisingResponse& rsp, const ADStructure& a)
+		{
+			rsp.tx_power = decode_tx_power(a);
+			LOG(Info, "TX power: " << (int)*rsp.tx_power << " dBm");
+		}
+
+		void appearance_to_response(AdvertisingResponse& rsp, const ADStructure& a)
+		{
+			rsp.appearance = decode_appearance(a);
+			LOG(Info, "Appearance: 0x" << std::hex << *rsp.appearance << std::dec);
+		}
+
+		void service_data_to_response(AdvertisingResponse& rsp, const ADStructure& a)
+		{
+			rsp.service_data_by_uuid.push_back(decode_service_data(a));
+			rsp.service_data.push_back({a.data, a.data + a.length});
+			LOG(Info, "Service data for " << to_str(rsp.service_data_by_uuid.back().uuid) << ": " << to_hex(rsp.service_data_by_uuid.back().data));
+		}
+
+		void manufacturer_data_to_response(AdvertisingResponse& rsp, const ADStructure& a)
+		{
+			rsp.manufacturer_specific_data.push_back({a.data, a.data + a.length});
+			LOG(Info, "Manufacturer data: " << to_hex(a.data, a.length));
+		}
+
+		//Every assigned AD type, indexed by type, so dispatch is a single lookup.
+		std::array<ADType, 256> make_ad_types()
+		{
+			std::array<ADType, 256> t;
+			for(auto& e: t)
+				e = ADType{nullptr, nullptr};
+
+			t[GAP::flags]                                     = {"Flags", flags_to_response};
+			t[GAP::incomplete_list_of_16_bit_UUIDs]           = {"Incomplete List of 16-bit Service UUIDs", uuids_to_response};
+			t[GAP::complete_list_of_16_bit_UUIDs]             = {"Complete List of 16-bit Service UUIDs", uuids_to_response};
+			t[GAP::incomplete_list_of_32_bit_UUIDs]           = {"Incomplete List of 32-bit Service UUIDs", uuids_to_response};
+			t[GAP::complete_list_of_32_bit_UUIDs]             = {"Complete List of 32-bit Service UUIDs", uuids_to_response};
+			t[GAP::incomplete_list_of_128_bit_UUIDs]          = {"Incomplete List of 128-bit Service UUIDs", uuids_to_response};
+			t[GAP::complete_list_of_128_bit_UUIDs]            = {"Complete List of 128-bit Service UUIDs", uuids_to_response};
+			t[GAP::shortened_local_name]                      = {"Shortened Local Name", name_to_response};
+			t[GAP::complete_local_name]                       = {"Complete Local Name", name_to_response};
+			t[GAP::tx_power_level]                            = {"Tx Power Level", tx_power_to_response};
+			t[GAP::class_of_device]                           = {"Class of Device", nullptr};
+			t[GAP::simple_pairing_hash_C192]                  = {"Simple Pairing Hash C-192", nullptr};
+			t[GAP::simple_pairing_randomizer_R192]            = {"Simple Pairing Randomizer R-192", nullptr};
+			t[GAP::device_id]                                 = {"Device ID", nullptr};
+			t[GAP::security_manager_out_of_band_flags]        = {"Security Manager Out of Band Flags", nullptr};
+			t[GAP::peripheral_connection_interval_range]      = {"Peripheral Connection Interval Range", nullptr};
+			t[GAP::list_of_16_bit_service_solicitation_UUIDs] = {"List of 16-bit Service Solicitation UUIDs", nullptr};
+			t[GAP::list_of_128_bit_service_solicitation_UUIDs]= {"List of 128-bit Service Solicitation UUIDs", nullptr};
+			t[GAP::service_data_16_bit_UUID]                  = {"Service Data - 16-bit UUID", service_data_to_response};
+			t[GAP::public_target_address]                     = {"Public Target Address", nullptr};
+			t[GAP::random_target_address]                     = {"Random Target Address", nullptr};
+			t[GAP::appearance]                                = {"Appearance", appearance_to_response};
+			t[GAP::advertising_interval]                      = {"Advertising Interval", nullptr};
+			t[GAP::LE_bluetooth_device_address]               = {"LE Bluetooth Device Address", nullptr};
+			t[GAP::LE_role]                                   = {"LE Role", nullptr};
+			t[GAP::simple_pairing_hash_C256]                  = {"Simple Pairing Hash C-256", nullptr};
+			t[GAP::simple_pairing_randomizer_R256]            = {"Simple Pairing Randomizer R-256", nullptr};
+			t[GAP::list_of_32_bit_service_solicitation_UUIDs] = {"List of 32-bit Service Solicitation UUIDs", nullptr};
+			t[GAP::service_data_32_bit_UUID]                  = {"Service Data - 32-bit UUID", service_data_to_response};
+			t[GAP::service_data_128_bit_UUID]                 = {"Service Data - 128-bit UUID", service_data_to_response};
+			t[GAP::LE_secure_connections_confirmation_value]  = {"LE Secure Connections Confirmation Value", nullptr};
+			t[GAP::LE_secure_connections_random_value]        = {"LE Secure Connections Random Value", nullptr};
+			t[GAP::URI]                                       = {"URI", nullptr};
+			t[GAP::indoor_positioning]                        = {"Indoor Positioning", nullptr};
+			t[GAP::transport_discovery_data]                  = {"Transport Discovery Data", nullptr};
+			t[GAP::LE_supported_features]                     = {"LE Supported Features", nullptr};
+			t[GAP::channel_map_update_indication]             = {"Channel Map Update Indication", nullptr};
+			t[GAP::PB_ADV]                                    = {"PB-ADV", nullptr};
+			t[GAP::mesh_message]                              = {"Mesh Message", nullptr};
+			t[GAP::mesh_beacon]                               = {"Mesh Beacon", nullptr};
+			t[GAP::BIGInfo]                                   = {"BIGInfo", nullptr};
+			t[GAP::broadcast_code]                            = {"Broadcast_Code", nullptr};
+			t[GAP::resolvable_set_identifier]                 = {"Resolvable Set Identifier", nullptr};
+			t[GAP::advertising_interval_long]                 = {"Advertising Interval - long", nullptr};
+			t[GAP::broadcast_name]                            = {"Broadcast_Name", nullptr};
+			t[GAP::encrypted_advertising_data]                = {"Encrypted Advertising Data", nullptr};
+			t[GAP::periodic_advertising_response_timing_information] = {"Periodic Advertising Response Timing Information", nullptr};
+			t[GAP::electronic_shelf_label]                    = {"Electronic Shelf Label", nullptr};
+			t[GAP::three_d_information_data]                  = {"3D Information Data", nullptr};
+			t[GAP::manufacturer_data]                         = {"Manufacturer Specific Data", manufacturer_data_to_response};
+
+			return t;
+		}
+
+		const std::array<ADType, 256> ad_types = make_ad_types();
+	}
+
+	const char* ad_type_name(uint8_t type)
+	{
+		return ad_types[type].name ? ad_types[type].name : "Unknown";
+	}
+
+	boost::optional<AdvertisingResponse::Name> AdvertisingView::local_name() const
+	{
+		//Prefer the complete name
+		if(auto a = find(GAP::complete_local_name))
+			return decode_name(*a);
+		else if(auto b = find(GAP::shortened_local_name))
+			return decode_name(*b);
+		else
+			return boost::none;
+	}
+
+	boost::optional<AdvertisingResponse::Flags> AdvertisingView::flags() const
+	{
+		if(auto a = find(GAP::flags))
+			return decode_flags(*a);
+		else
+			return boost::none;
+	}
+
+	boost::optional<int8_t> AdvertisingView::tx_power() const
+	{
+		if(auto a = find(GAP::tx_power_level))
+			return decode_tx_power(*a);
+		else
+			return boost::none;
+	}
+
+	boost::optional<uint16_t> AdvertisingView::appearance() const
+	{
+		if(auto a = find(GAP::appearance))
+			return decode_appearance(*a);
+		else
+			return boost::none;
+	}
+
+	std::vector<UUID> AdvertisingView::uuids() const
+	{
+		std::vector<UUID> uuids;
+		if(has(GAP::incomplete_list_of_16_bit_UUIDs) || has(GAP::complete_list_of_16_bit_UUIDs) ||
+		   has(GAP::incomplete_list_of_32_bit_UUIDs) || has(GAP::complete_list_of_32_bit_UUIDs) ||
+		   has(GAP::incomplete_list_of_128_bit_UUIDs) || has(GAP::complete_list_of_128_bit_UUIDs))
+		{
+			for(const ADStructure& a: *this)
+				if(a.type >= GAP::incomplete_list_of_16_bit_UUIDs && a.type <= GAP::complete_list_of_128_bit_UUIDs)
+					decode_uuids(a, uuids);
 		}
+		return uuids;
+	}
 
-		return ret;
+	std::vector<AdvertisingResponse::ServiceData> AdvertisingView::service_data() const
+	{
+		std::vector<AdvertisingResponse::ServiceData> data;
+		if(has(GAP::service_data_16_bit_UUID) || has(GAP::service_data_32_bit_UUID) || has(GAP::service_data_128_bit_UUID))
+		{
+			for(const ADStructure& a: *this)
+				if(a.type == GAP::service_data_16_bit_UUID || a.type == GAP::service_data_32_bit_UUID || a.type == GAP::service_data_128_bit_UUID)
+					data.push_back(decode_service_data(a));
+		}
+		return data;
 	}
 
+	AdvertisingResponse AdvertisingView::materialize() const
+	{
+		AdvertisingResponse rsp;
+		rsp.address = address;
+		rsp.type = type;
+		rsp.rssi = rssi;
+		rsp.timestamp = timestamp;
+		rsp.raw_packet.push_back({data, data + length});
+
+		for(const ADStructure& a: *this)
+		{
+			LOGVAR(Debug, a.type);
+			const ADType& t = ad_types[a.type];
+
+			if(t.decode)
+				t.decode(rsp, a);
+			else
+			{
+				std::vector<uint8_t> unparsed(1, a.type);
+				unparsed.insert(unparsed.end(), a.data, a.data + a.length);
+				rsp.unparsed_data_with_types.push_back(std::move(unparsed));
+
+				LOG(Info, "Unparsed chunk (" << ad_type_name(a.type) << ") " << to_hex(rsp.unparsed_data_with_types.back()));
+			}
+		}
+
+		if(rsp.UUIDs.size() > 0)
+		{
+			LOG(Info, "UUIDs (128 bit " << (rsp.uuid_128_bit_complete?"complete":"incomplete")
+				  << ", 32 bit " << (rsp.uuid_32_bit_complete?"complete":"incomplete")
+				  << ", 16 bit " << (rsp.uuid_16_bit_complete?"complete":"incomplete") << " ):");
+
+			for(const auto& uuid: rsp.UUIDs)
+				LOG(Info, "    " << to_str(uuid));
+		}
 
+		return rsp;
+	}
 }
@@ -0,0 +1,416 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include "blepp/multi_lescan.h"
+
+#include <cerrno>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+namespace BLEPP
+{
+	//Per adapter glue: records the RSSI, applies the shared filter
+	//and tags the report with the adapter.
+	class MultiHCIScanner::AdapterSink: public AdvertisingSink
+	{
+		private:
+			MultiHCIScanner& m;
+			size_t adapter;
+			MultiAdvertisingSink& next;
+
+		public:
+			AdapterSink(MultiHCIScanner& m_, size_t a, MultiAdvertisingSink& n)
+			:m(m_), adapter(a), next(n)
+			{
+			}
+
+			void on_advertisement(const AdvertisingView& a) override
+			{
+				m.record(adapter, a, a.timestamp);
+
+				if(!m.software_filtering || m.filter.insert(a.address, static_cast<uint8_t>(a.type), a.timestamp))
+					next.on_advertisement(adapter, a);
+				else
+					LOG(Debug, "Entry " << a.address << " " << static_cast<int>(a.type) << " found already on adapter " << adapter);
+			}
+	};
+
+	MultiHCIScanner::MultiHCIScanner(const std::vector<std::string>& devices, bool start_scan, HCIScanner::FilterDuplicates duplicates, HCIScanner::ScanType type, const HCIScanner::ScanParameters& params)
+	:names(devices)
+	{
+		ENTER();
+		if(devices.empty())
+			throw HCIScanner::HCIError("No HCI devices given to MultiHCIScanner");
+
+		software_filtering = duplicates == HCIScanner::FilterDuplicates::Software || duplicates == HCIScanner::FilterDuplicates::Both;
+		bool hardware = duplicates == HCIScanner::FilterDuplicates::Hardware || duplicates == HCIScanner::FilterDuplicates::Both;
+
+		//The individual scanners never filter in software: that's done
+		//here, across all of them.
+		for(const auto& d: devices)
+			adapters.emplace_back(new HCIScanner(false, hardware?HCIScanner::FilterDuplicates::Hardware:HCIScanner::FilterDuplicates::Off, type, d, params));
+
+		set_rssi_capacity(4096);
+		register_fds();
+
+		if(start_scan)
+			start();
+	}
+
+	MultiHCIScanner::MultiHCIScanner(const std::vector<int>& fds, HCIScanner::FilterDuplicates duplicates)
+	{
+		ENTER();
+		if(fds.empty())
+			throw HCIScanner::HCIError("No HCI sources given to MultiHCIScanner");
+
+		software_filtering = duplicates == HCIScanner::FilterDuplicates::Software || duplicates == HCIScanner::FilterDuplicates::Both;
+
+		for(int fd: fds)
+		{
+			adapters.emplace_back(new HCIScanner(fd, HCIScanner::FilterDuplicates::Off));
+			names.push_back("fd " + std::to_string(fd));
+		}
+
+		set_rssi_capacity(4096);
+		register_fds();
+		start();
+	}
+
+	MultiHCIScanner::~MultiHCIScanner()
+	{
+		//The adapters clean up after themselves.
+		if(epoll_fd >= 0)
+			close(epoll_fd);
+	}
+
+	void MultiHCIScanner::register_fds()
+	{
+		if(epoll_fd < 0)
+		{
+			epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+			if(epoll_fd < 0)
+				throw HCIScanner::IOError("Creating epoll fd", errno);
+		}
+
+		for(size_t i=0; i < adapters.size(); i++)
+		{
+			epoll_event e;
+			e.events = EPOLLIN;
+			e.data.u64 = i;
+
+			//The fd changes when capture threads are started or stopped,
+			//so everything is re-registered from scratch.
+			if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, adapters[i]->get_fd(), &e) < 0)
+			{
+				if(errno != EEXIST || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, adapters[i]->get_fd(), &e) < 0)
+					throw HCIScanner::IOError("Adding HCI fd to epoll set", errno);
+			}
+		}
+	}
+
+	void MultiHCIScanner::start()
+	{
+		filter.clear();
+		next_refresh = std::chrono::steady_clock::now() + refresh_interval;
+		for(auto& a: adapters)
+			a->start();
+	}
+
+	void MultiHCIScanner::stop()
+	{
+		for(auto& a: adapters)
+			a->stop();
+	}
+
+	void MultiHCIScanner::start_capture_threads(size_t ring_slots)
+	{
+		for(auto& a: adapters)
+		{
+			//Closed fds leave the epoll set on their own, but the HCI fd
+			//stays open, so it has to be removed by hand.
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, a->get_fd(), nullptr);
+			a->start_capture_thread(ring_slots);
+		}
+		register_fds();
+	}
+
+	void MultiHCIScanner::stop_capture_threads()
+	{
+		for(auto& a: adapters)
+			a->stop_capture_thread();
+		register_fds();
+	}
+
+	int MultiHCIScanner::get_fd() const
+	{
+		return epoll_fd;
+	}
+
+	int MultiHCIScanner::next_timeout_ms() const
+	{
+		int timeout = -1;
+
+		if(refresh_interval > std::chrono::steady_clock::duration::zero())
+		{
+			auto wait = next_refresh - std::chrono::steady_clock::now();
+			if(wait <= std::chrono::steady_clock::duration::zero())
+				return 0;
+
+			//Round up, so the work is due when epoll returns.
+			timeout = std::chrono::duration_cast<std::chrono::milliseconds>(wait).count() + 1;
+		}
+
+		for(const auto& a: adapters)
+		{
+			int t = a->next_timeout_ms();
+			if(t >= 0 && (timeout < 0 || t < timeout))
+				timeout = t;
+		}
+		return timeout;
+	}
+
+	size_t MultiHCIScanner::num_adapters() const
+	{
+		return adapters.size();
+	}
+
+	const std::string& MultiHCIScanner::adapter_name(size_t i) const
+	{
+		return names.at(i);
+	}
+
+	HCIScanner& MultiHCIScanner::adapter(size_t i)
+	{
+		return *adapters.at(i);
+	}
+
+	const DuplicateFilter& MultiHCIScanner::software_filter() const
+	{
+		return filter;
+	}
+
+	void MultiHCIScanner::set_software_filter(size_t capacity, DuplicateFilter::Clock::duration ttl)
+	{
+		filter.set_capacity(capacity);
+		filter.set_ttl(ttl);
+	}
+
+	void MultiHCIScanner::set_refresh_interval(std::chrono::steady_clock::duration interval)
+	{
+		refresh_interval = interval;
+		next_refresh = std::chrono::steady_clock::now() + interval;
+
+		//The adapters don't filter in software, but their controllers'
+		//lists need resetting too.
+		for(auto& a: adapters)
+			a->set_refresh_interval(interval);
+	}
+
+	void MultiHCIScanner::set_rssi_ttl(std::chrono::steady_clock::duration ttl)
+	{
+		rssi_ttl = ttl;
+	}
+
+	void MultiHCIScanner::set_rssi_capacity(size_t capacity)
+	{
+		size_t n = probe_window;
+		while(n < capacity)
+			n *= 2;
+
+		devices.assign(n, Device{0, std::chrono::steady_clock::time_point(), false});
+		sightings.assign(n * adapters.size(), Sighting{127, std::chrono::steady_clock::time_point()});
+		device_mask = n - 1;
+	}
+
+	void MultiHCIScanner::get_advertisements(MultiAdvertisingSink& sink, int timeout_ms)
+	{
+		//Adapters with timed work, such as releasing adverts held for
+		//scan responses or refreshing the duplicate filters, need a call
+		//in time to do it, even if they've gone quiet.
+		int next_timeout = next_timeout_ms();
+		if(next_timeout >= 0 && (timeout_ms < 0 || next_timeout < timeout_ms))
+			timeout_ms = next_timeout;
+
+		const int max_events=16;
+		epoll_event events[max_events];
+
+		int n = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				throw HCIScanner::Interrupted("interrupted waiting for HCI packet");
+			else
+				throw HCIScanner::IOError("waiting for HCI packet", errno);
+		}
+
+		for(int i=0; i < n; i++)
+		{
+			size_t a = events[i].data.u64;
+			AdapterSink adapter_sink(*this, a, sink);
+			adapters[a]->get_advertisements(adapter_sink, 0);
+		}
+
+		for(size_t a=0; a < adapters.size(); a++)
+			if(adapters[a]->next_timeout_ms() == 0)
+			{
+				AdapterSink adapter_sink(*this, a, sink);
+				adapters[a]->get_advertisements(adapter_sink, 0);
+			}
+
+		auto now = std::chrono::steady_clock::now();
+		if(refresh_interval > std::chrono::steady_clock::duration::zero() && now >= next_refresh)
+		{
+			filter.clear();
+
+			//Don't try to catch up if calls have been late.
+			next_refresh += refresh_interval;
+			if(next_refresh <= now)
+				next_refresh = now + refresh_interval;
+		}
+	}
+
+	std::vector<MultiAdvertisingResponse> MultiHCIScanner::get_advertisements(int timeout_ms)
+	{
+		struct MaterializingSink: public MultiAdvertisingSink
+		{
+			std::vector<MultiAdvertisingResponse> adverts;
+
+			void on_advertisement(size_t adapter, const AdvertisingView& a) override
+			{
+				try
+				{
+					adverts.push_back(MultiAdvertisingResponse{adapter, a.materialize()});
+				}
+				catch(std::out_of_range&)
+				{
+					LOG(LogLevels::Error, "Corrupted data sent by device " << a.address);
+				}
+			}
+		} sink;
+
+		get_advertisements(sink, timeout_ms);
+		return std::move(sink.adverts);
+	}
+
+	static uint64_t device_key(const BLEAddress& address)
+	{
+		return address.to_uint64() | (static_cast<uint64_t>(address.type) << 48);
+	}
+
+	size_t MultiHCIScanner::find_device(const BLEAddress& address) const
+	{
+		uint64_t key = device_key(address);
+		size_t h = address.hash();
+
+		//Slots are never emptied, only reused, so an unused one ends the search.
+		for(size_t i=0; i < probe_window; i++)
+		{
+			size_t n = (h + i) & device_mask;
+			if(!devices[n].used)
+				break;
+			if(devices[n].key == key)
+				return n;
+		}
+
+		return devices.size();
+	}
+
+	void MultiHCIScanner::record(size_t adapter, const AdvertisingView& a, std::chrono::steady_clock::time_point now)
+	{
+		//127 means the RSSI is not available
+		if(a.rssi == 127)
+			return;
+
+		uint64_t key = device_key(a.address);
+		size_t h = a.address.hash();
+		size_t victim = devices.size();
+		bool found=false;
+
+		//Reuse a slot in order of preference: the device's own, an unused
+		//one, a forgotten one, then the one heard least recently.
+		auto forgotten = [&](size_t n){ return now - devices[n].last_heard >= rssi_ttl; };
+
+		for(size_t i=0; i < probe_window; i++)
+		{
+			size_t n = (h + i) & device_mask;
+			const Device& d = devices[n];
+
+			if(d.used && d.key == key)
+			{
+				victim = n;
+				found = true;
+				break;
+			}
+			else if(!d.used)
+			{
+				if(victim == devices.size() || !forgotten(victim))
+					victim = n;
+				break;
+			}
+			else if(victim == devices.size() || (!forgotten(victim) && (forgotten(n) || d.last_heard < devices[victim].last_heard)))
+				victim = n;
+		}
+
+		Sighting* s = &sightings[victim * adapters.size()];
+		if(!found)
+		{
+			devices[victim].key = key;
+			devices[victim].used = true;
+			for(size_t i=0; i < adapters.size(); i++)
+				s[i] = Sighting{127, std::chrono::steady_clock::time_point()};
+		}
+
+		devices[victim].last_heard = now;
+		s[adapter].rssi = a.rssi;
+		s[adapter].when = now;
+	}
+
+	boost::optional<int8_t> MultiHCIScanner::rssi(const BLEAddress& address, size_t adapter) const
+	{
+		size_t d = find_device(address);
+		if(d == devices.size() || adapter >= adapters.size())
+			return boost::none;
+
+		const Sighting& s = sightings[d * adapters.size() + adapter];
+		if(s.rssi == 127 || std::chrono::steady_clock::now() - s.when >= rssi_ttl)
+			return boost::none;
+
+		return s.rssi;
+	}
+
+	boost::optional<size_t> MultiHCIScanner::best_adapter(const BLEAddress& address) const
+	{
+		boost::optional<size_t> best;
+		int8_t best_rssi=0;
+
+		for(size_t a=0; a < adapters.size(); a++)
+		{
+			boost::optional<int8_t> r = rssi(address, a);
+			if(r && (!best || *r > best_rssi))
+			{
+				best = a;
+				best_rssi = *r;
+			}
+		}
+
+		return best;
+	}
+}
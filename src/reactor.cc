@@ -0,0 +1,337 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include "blepp/reactor.h"
+#include "blepp/logging.h"
+
+#include <cerrno>
+#include <algorithm>
+#include <exception>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+namespace BLEPP
+{
+	Reactor::Reactor()
+	{
+		epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+		if(epoll_fd < 0)
+			throw HCIScanner::IOError("Creating epoll fd", errno);
+	}
+
+	Reactor::~Reactor()
+	{
+		for(auto& e: entries)
+			if(e.gatt && !e.removed)
+				e.gatt->cb_io_changed = nullptr;
+		close(epoll_fd);
+	}
+
+	void Reactor::add(BLEGATTStateMachine& gatt)
+	{
+		Entry& e = add(Entry{&gatt, nullptr, nullptr, -1, 0, false, false, false}, &gatt);
+		gatt.cb_io_changed = [this, &e](){ mark(e); };
+	}
+
+	void Reactor::add(HCIScanner& scanner, AdvertisingSink& sink)
+	{
+		check_timer(add(Entry{nullptr, &scanner, &sink, -1, 0, false, false, false}, &scanner));
+	}
+
+	void Reactor::remove(BLEGATTStateMachine& gatt)
+	{
+		remove(&gatt);
+		gatt.cb_io_changed = nullptr;
+	}
+
+	void Reactor::remove(HCIScanner& scanner)
+	{
+		remove(&scanner);
+	}
+
+	void Reactor::update(HCIScanner& scanner)
+	{
+		auto i = index.find(&scanner);
+		if(i == index.end())
+			throw std::logic_error("Object not registered with reactor");
+
+		mark(*i->second);
+		check_timer(*i->second);
+	}
+
+	Reactor::Entry& Reactor::add(Entry e, const void* key)
+	{
+		if(index.count(key))
+			throw std::logic_error("Object already registered with reactor");
+
+		entries.push_back(e);
+		auto i = --entries.end();
+		index[key] = i;
+		sync(*i, false);
+		return *i;
+	}
+
+	void Reactor::mark(Entry& e)
+	{
+		if(!e.dirty && !e.removed)
+		{
+			e.dirty = true;
+			dirty.push_back(&e);
+		}
+	}
+
+	void Reactor::check_timer(Entry& e)
+	{
+		if(!e.timed && !e.removed && e.scanner->next_timeout_ms() >= 0)
+		{
+			e.timed = true;
+			timed.push_back(&e);
+		}
+	}
+
+	void Reactor::remove(const void* key)
+	{
+		auto i = index.find(key);
+		if(i == index.end())
+			throw std::logic_error("Object not registered with reactor");
+
+		unregister(*i->second);
+		i->second->removed = true;
+		removed.push_back(i->second);
+		index.erase(i);
+
+		//Events for this entry may still be pending in the current batch,
+		//so it's only freed once the batch is complete.
+		if(!dispatching)
+			purge();
+	}
+
+	void Reactor::purge()
+	{
+		if(removed.empty())
+			return;
+
+		auto gone = [](const Entry* e){ return e->removed; };
+		dirty.erase(std::remove_if(dirty.begin(), dirty.end(), gone), dirty.end());
+		timed.erase(std::remove_if(timed.begin(), timed.end(), gone), timed.end());
+
+		for(auto i: removed)
+			entries.erase(i);
+		removed.clear();
+	}
+
+	void Reactor::unregister(Entry& e)
+	{
+		//The fd may have been closed already, in which case the kernel
+		//has removed it from the set, so errors here are expected.
+		if(e.fd != -1)
+			epoll_ctl(epoll_fd, EPOLL_CTL_DEL, e.fd, nullptr);
+		e.fd = -1;
+		e.events = 0;
+	}
+
+	void Reactor::sync(Entry& e, bool force)
+	{
+		int fd;
+		uint32_t events;
+
+		if(e.gatt)
+		{
+			fd = e.gatt->socket();
+
+			//Reading while connecting is an error in the state machine. A
+			//stream of writes waits for room, but responses still arrive.
+			if(!e.gatt->wait_on_write())
+				events = EPOLLIN;
+			else if(e.gatt->is_streaming())
+				events = EPOLLIN | EPOLLOUT;
+			else
+				events = EPOLLOUT;
+		}
+		else
+		{
+			fd = e.scanner->get_fd();
+			events = EPOLLIN;
+		}
+
+		if(fd != e.fd)
+			unregister(e);
+		else if(events == e.events && !force)
+			return;
+
+		if(fd == -1)
+			return;
+
+		epoll_event ev;
+		ev.events = events;
+		ev.data.ptr = &e;
+
+		//A closed fd silently leaves the set, and the number may be reused by
+		//the next connection, so a failed modify falls back to adding.
+		if(e.fd == -1 || epoll_ctl(epoll_fd, EPOLL_CTL_MOD, fd, &ev) < 0)
+			if(epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) < 0)
+				throw HCIScanner::IOError("Adding fd to epoll set", errno);
+
+		e.fd = fd;
+		e.events = events;
+	}
+
+	void Reactor::dispatch(Entry& e, uint32_t events)
+	{
+		if(e.scanner)
+		{
+			e.scanner->get_advertisements(*e.sink, 0);
+			return;
+		}
+
+		BLEGATTStateMachine& gatt = *e.gatt;
+
+		//Errors during connection are reported by SO_ERROR, which 
+		//write_and_process_next() checks.
+		bool connecting = gatt.wait_on_write() && !gatt.is_streaming();
+
+		if(gatt.wait_on_write() && (events & (EPOLLOUT | EPOLLERR | EPOLLHUP)))
+			gatt.write_and_process_next();
+
+		if(!connecting && gatt.socket() != -1 && (events & (EPOLLIN | EPOLLERR | EPOLLHUP)))
+			gatt.read_and_process_next();
+	}
+
+	int Reactor::run_once(int timeout_ms)
+	{
+		ENTER();
+
+		//Pick up changes made outside of callbacks. The fd number may have
+		//been reused by a new socket, so changed entries are always resynced.
+		while(!dirty.empty())
+		{
+			Entry& e = *dirty.back();
+			dirty.pop_back();
+			e.dirty = false;
+			sync(e, true);
+		}
+
+		//Scanners with timed work, such as releasing adverts held for
+		//scan responses, need a call in time to do it.
+		for(size_t i=0; i < timed.size();)
+		{
+			int t = timed[i]->scanner->next_timeout_ms();
+			if(t < 0)
+			{
+				timed[i]->timed = false;
+				timed[i] = timed.back();
+				timed.pop_back();
+				continue;
+			}
+
+			if(timeout_ms < 0 || t < timeout_ms)
+				timeout_ms = t;
+			i++;
+		}
+
+		const int max_events=64;
+		epoll_event events[max_events];
+
+		int n = epoll_wait(epoll_fd, events, max_events, timeout_ms);
+		if(n < 0)
+		{
+			if(errno == EINTR)
+				throw HCIScanner::Interrupted("interrupted waiting for events");
+			else
+				throw HCIScanner::IOError("waiting for events", errno);
+		}
+
+		std::exception_ptr error;
+		dispatching=true;
+
+		for(int i=0; i < n; i++)
+		{
+			Entry& e = *static_cast<Entry*>(events[i].data.ptr);
+			if(e.removed)
+				continue;
+
+			try
+			{
+				dispatch(e, events[i].events);
+
+				//The callbacks may have closed or reconnected the machine,
+				//possibly reusing the same fd number, so always resync.
+				if(!e.removed)
+				{
+					sync(e, true);
+					if(e.scanner)
+						check_timer(e);
+				}
+			}
+			catch(...)
+			{
+				if(!error)
+					error = std::current_exception();
+			}
+		}
+
+		//Entries added to timed by callbacks are handled on the next call.
+		for(size_t i=0, end=timed.size(); i < end; i++)
+		{
+			Entry& e = *timed[i];
+			try
+			{
+				if(!e.removed && e.scanner->next_timeout_ms() == 0)
+					e.scanner->get_advertisements(*e.sink, 0);
+			}
+			catch(...)
+			{
+				if(!error)
+					error = std::current_exception();
+			}
+		}
+
+		dispatching=false;
+		purge();
+
+		if(error)
+			std::rethrow_exception(error);
+
+		return n;
+	}
+
+	void Reactor::run()
+	{
+		stopping=false;
+		while(!stopping)
+			run_once();
+	}
+
+	void Reactor::stop()
+	{
+		stopping=true;
+	}
+
+	size_t Reactor::size() const
+	{
+		return index.size();
+	}
+
+	int Reactor::get_fd() const
+	{
+		return epoll_fd;
+	}
+}
@@ -0,0 +1,186 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include "blepp/scan_merger.h"
+#include "blepp/logging.h"
+
+#include <cstring>
+#include <algorithm>
+
+namespace BLEPP
+{
+	//Length of the AD data up to the first zero length field, which ends
+	//it (4.0/3/C.11). Devices often pad their adverts with zeros, and
+	//anything appended after the padding would never be seen.
+	static std::size_t significant_length(const uint8_t* data, std::size_t length)
+	{
+		std::size_t pos=0;
+		while(pos < length && data[pos] != 0)
+			pos += data[pos] + 1;
+
+		return std::min(pos, length);
+	}
+
+	ScanResponseMerger::ScanResponseMerger(Clock::duration w, std::size_t max_pending)
+	:window_(w), slots(max_pending ? max_pending : 1)
+	{
+		clear();
+	}
+
+	void ScanResponseMerger::clear()
+	{
+		for(auto& s: slots)
+			s.used = false;
+		num_pending = 0;
+	}
+
+	void ScanResponseMerger::emit(Pending& p, AdvertisingSink& out)
+	{
+		p.advert.data = p.data;
+		p.advert.length = p.length;
+		p.advert.build_index();
+		p.used = false;
+		num_pending--;
+		out.on_advertisement(p.advert);
+	}
+
+	void ScanResponseMerger::release(Clock::time_point now, AdvertisingSink& out)
+	{
+		//Oldest first, so the order of reports is kept.
+		while(num_pending)
+		{
+			Pending* oldest = nullptr;
+			for(auto& s: slots)
+				if(s.used && (!oldest || s.deadline < oldest->deadline))
+					oldest = &s;
+
+			if(oldest->deadline > now)
+				return;
+
+			num_timed_out++;
+			emit(*oldest, out);
+		}
+	}
+
+	void ScanResponseMerger::release_all(AdvertisingSink& out)
+	{
+		release(Clock::time_point::max(), out);
+	}
+
+	bool ScanResponseMerger::next_deadline(Clock::time_point& deadline) const
+	{
+		if(num_pending == 0)
+			return false;
+
+		deadline = Clock::time_point::max();
+		for(const auto& s: slots)
+			if(s.used && s.deadline < deadline)
+				deadline = s.deadline;
+		return true;
+	}
+
+	void ScanResponseMerger::add(const AdvertisingView& a, AdvertisingSink& out)
+	{
+		release(a.timestamp, out);
+
+		Pending* same = nullptr;
+		if(num_pending)
+			for(auto& s: slots)
+				if(s.used && s.advert.address == a.address)
+				{
+					same = &s;
+					break;
+				}
+
+		if(a.type == LeAdvertisingEventType::ADV_IND || a.type == LeAdvertisingEventType::ADV_SCAN_IND)
+		{
+			std::size_t length = significant_length(a.data, a.length);
+			if(length > sizeof(Pending::data) / 2)
+			{
+				out.on_advertisement(a);
+				return;
+			}
+
+			//A second advert means the response to the first was missed.
+			if(same)
+			{
+				num_timed_out++;
+				emit(*same, out);
+			}
+
+			Pending* slot = nullptr;
+			for(auto& s: slots)
+				if(!s.used)
+				{
+					slot = &s;
+					break;
+				}
+
+			if(!slot)
+			{
+				LOG(Debug, "Scan response merger full");
+				Pending* oldest = &slots[0];
+				for(auto& s: slots)
+					if(s.deadline < oldest->deadline)
+						oldest = &s;
+				num_timed_out++;
+				emit(*oldest, out);
+				slot = oldest;
+			}
+
+			slot->advert = a;
+			slot->length = length;
+			memcpy(slot->data, a.data, length);
+			slot->deadline = a.timestamp + window_;
+			slot->used = true;
+			num_pending++;
+		}
+		else if(a.type == LeAdvertisingEventType::SCAN_RSP && same && same->length + a.length <= sizeof(Pending::data))
+		{
+			memcpy(same->data + same->length, a.data, a.length);
+			same->length += a.length;
+			num_merged++;
+			emit(*same, out);
+		}
+		else
+			out.on_advertisement(a);
+	}
+
+	ScanResponseMerger::Clock::duration ScanResponseMerger::window() const
+	{
+		return window_;
+	}
+
+	std::size_t ScanResponseMerger::pending() const
+	{
+		return num_pending;
+	}
+
+	std::uint64_t ScanResponseMerger::merged() const
+	{
+		return num_merged;
+	}
+
+	std::uint64_t ScanResponseMerger::timed_out() const
+	{
+		return num_timed_out;
+	}
+}
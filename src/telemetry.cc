@@ -0,0 +1,264 @@
+/*
+ *
+ *  blepp - Implementation of the Generic ATTribute Protocol
+ *
+ *  Copyright (C) 2013, 2014 Edward Rosten
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation; either version 2 of the License, or
+ *  (at your option) any later version.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+#include "blepp/telemetry.h"
+#include "blepp/gap.h"
+
+#include <cstring>
+
+namespace BLEPP
+{
+	TelemetryRegistry::TelemetryRegistry(bool builtin)
+	{
+		if(builtin)
+		{
+			add_manufacturer_decoder(Telemetry::apple_company_id, Telemetry::decode_ibeacon);
+			add_service_decoder(UUID(Telemetry::eddystone_uuid), Telemetry::decode_eddystone);
+		}
+	}
+
+	size_t TelemetryRegistry::Key128Hash::operator()(const Key128& k) const
+	{
+		uint64_t a, b;
+		memcpy(&a, k.data(), 8);
+		memcpy(&b, k.data()+8, 8);
+		return std::hash<uint64_t>()(a ^ (b * 0x9E3779B97F4A7C15ull));
+	}
+
+	//All UUIDs are keyed in their 128 bit form.
+	TelemetryRegistry::Key128 TelemetryRegistry::key(const UUID& uuid)
+	{
+		bt_uuid_t full;
+		bt_uuid_to_uuid128(&uuid, &full);
+		Key128 k;
+		memcpy(k.data(), full.value.u128.data, 16);
+		return k;
+	}
+
+	void TelemetryRegistry::add_manufacturer_decoder(uint16_t company_id, const TelemetryDecoder& d)
+	{
+		manufacturer_decoders[company_id] = d;
+	}
+
+	void TelemetryRegistry::add_service_decoder(const UUID& uuid, const TelemetryDecoder& d)
+	{
+		service_decoders[key(uuid)] = d;
+	}
+
+	uint64_t TelemetryRegistry::malformed() const
+	{
+		return malformed_count;
+	}
+
+	bool TelemetryRegistry::run(const TelemetryDecoder& d, const uint8_t* data, size_t length, ReadingSink& sink) const
+	{
+		if(d(data, length, sink))
+			return true;
+
+		malformed_count++;
+		return false;
+	}
+
+	int TelemetryRegistry::decode_manufacturer_data(const uint8_t* data, size_t length, ReadingSink& sink) const
+	{
+		if(length < 2 || manufacturer_decoders.empty())
+			return 0;
+
+		auto d = manufacturer_decoders.find(data[0] | (data[1] << 8));
+		if(d == manufacturer_decoders.end())
+			return 0;
+
+		return run(d->second, data+2, length-2, sink);
+	}
+
+	int TelemetryRegistry::decode_service_data(const UUID& uuid, const uint8_t* data, size_t length, ReadingSink& sink) const
+	{
+		auto d = service_decoders.find(key(uuid));
+		if(d == service_decoders.end())
+			return 0;
+
+		return run(d->second, data, length, sink);
+	}
+
+	int TelemetryRegistry::decode(const AdvertisingView& advert, ReadingSink& sink) const
+	{
+		int decoded=0;
+
+		for(const ADStructure& a: advert)
+		{
+			if(a.type == GAP::manufacturer_data)
+				decoded += decode_manufacturer_data(a.data, a.length, sink);
+			else if(!service_decoders.empty())
+			{
+				UUID uuid;
+				size_t width;
+
+				if(a.type == GAP::service_data_16_bit_UUID && a.length >= 2)
+				{
+					uuid = UUID(att_get_u16(a.data));
+					width = 2;
+				}
+				else if(a.type == GAP::service_data_32_bit_UUID && a.length >= 4)
+				{
+					bt_uuid32_create(&uuid, att_get_u32(a.data));
+					width = 4;
+				}
+				else if(a.type == GAP::service_data_128_bit_UUID && a.length >= 16)
+				{
+					uuid = UUID::from(att_get_uuid128(a.data));
+					width = 16;
+				}
+				else
+					continue;
+
+				decoded += decode_service_data(uuid, a.data + width, a.length - width, sink);
+			}
+		}
+
+		return decoded;
+	}
+
+	int TelemetryRegistry::decode(const AdvertisingResponse& advert, ReadingSink& sink) const
+	{
+		int decoded=0;
+
+		for(const auto& m: advert.manufacturer_specific_data)
+			decoded += decode_manufacturer_data(m.data(), m.size(), sink);
+
+		for(const auto& s: advert.service_data_by_uuid)
+			decoded += decode_service_data(s.uuid, s.data.data(), s.data.size(), sink);
+
+		return decoded;
+	}
+
+	namespace Telemetry
+	{
+		static uint16_t get_be16(const uint8_t* p)
+		{
+			return (p[0] << 8) | p[1];
+		}
+
+		static uint32_t get_be32(const uint8_t* p)
+		{
+			return (static_cast<uint32_t>(p[0]) << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+		}
+
+		static void emit(ReadingSink& sink, const char* source, Reading::Type type, double value)
+		{
+			sink.on_reading(Reading{source, type, value, nullptr, 0});
+		}
+
+		static void emit(ReadingSink& sink, const char* source, Reading::Type type, const uint8_t* data, uint8_t length)
+		{
+			sink.on_reading(Reading{source, type, 0, data, length});
+		}
+
+		bool decode_ibeacon(const uint8_t* data, size_t length, ReadingSink& sink)
+		{
+			//Type 0x02, length 0x15, proximity UUID, major, minor, measured power.
+			//All big endian.
+			if(length != 23 || data[0] != 0x02 || data[1] != 0x15)
+				return false;
+
+			const char* s = "iBeacon";
+			emit(sink, s, Reading::Identifier, data+2, 16);
+			emit(sink, s, Reading::Major, get_be16(data+18));
+			emit(sink, s, Reading::Minor, get_be16(data+20));
+			emit(sink, s, Reading::TxPower, static_cast<int8_t>(data[22]));
+			return true;
+		}
+
+		//See https://github.com/google/eddystone/blob/master/protocol-specification.md
+		bool decode_eddystone(const uint8_t* data, size_t length, ReadingSink& sink)
+		{
+			if(length < 1)
+				return false;
+
+			uint8_t frame = data[0];
+
+			if(frame == 0x00 && (length == 18 || length == 20)) //UID, optionally with 2 reserved bytes
+			{
+				const char* s = "Eddystone-UID";
+				emit(sink, s, Reading::TxPower, static_cast<int8_t>(data[1]));
+				emit(sink, s, Reading::Identifier, data+2, 16);
+				return true;
+			}
+			else if(frame == 0x10 && length >= 3 && length <= 20) //URL
+			{
+				const char* s = "Eddystone-URL";
+				emit(sink, s, Reading::TxPower, static_cast<int8_t>(data[1]));
+				emit(sink, s, Reading::URL, data+2, length-2);
+				return true;
+			}
+			else if(frame == 0x20 && length == 14 && data[1] == 0x00) //Unencrypted TLM
+			{
+				const char* s = "Eddystone-TLM";
+				uint16_t mv = get_be16(data+2);
+				int16_t temp = static_cast<int16_t>(get_be16(data+4));
+
+				//Zero and 0x8000 mean not supported
+				if(mv != 0)
+					emit(sink, s, Reading::BatteryVoltage, mv / 1000.0);
+				if(temp != -0x8000)
+					emit(sink, s, Reading::Temperature, temp / 256.0);
+
+				emit(sink, s, Reading::AdvertCount, get_be32(data+6));
+				emit(sink, s, Reading::Uptime, get_be32(data+10) / 10.0);
+				return true;
+			}
+			else if(frame == 0x30 && length == 10) //EID
+			{
+				const char* s = "Eddystone-EID";
+				emit(sink, s, Reading::TxPower, static_cast<int8_t>(data[1]));
+				emit(sink, s, Reading::Identifier, data+2, 8);
+				return true;
+			}
+			else
+				return false;
+		}
+
+		std::string eddystone_url(const uint8_t* data, size_t length)
+		{
+			static const char* schemes[] = {"http://www.", "https://www.", "http://", "https://"};
+			static const char* expansions[] = {
+				".com/", ".org/", ".edu/", ".net/", ".info/", ".biz/", ".gov/",
+				".com", ".org", ".edu", ".net", ".info", ".biz", ".gov"
+			};
+
+			std::string url;
+			if(length == 0)
+				return url;
+
+			if(data[0] < 4)
+				url = schemes[data[0]];
+
+			for(size_t i=1; i < length; i++)
+			{
+				if(data[i] < 14)
+					url += expansions[data[i]];
+				else
+					url += static_cast<char>(data[i]);
+			}
+
+			return url;
+		}
+	}
+}
@@ -0,0 +1,52 @@
+#ifndef BLEPP_TESTS_FAKE_SERVER_H
+#define BLEPP_TESTS_FAKE_SERVER_H
+
+//The far end of an ATT connection, played by the test over a socketpair.
+
+#include <blepp/blestatemachine.h>
+#include <vector>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/socket.h>
+
+struct FakeServer
+{
+	int fd = -1;
+
+	//Hand the other end of a fresh socket pair to the machine.
+	void connect(BLEPP::BLEGATTStateMachine& gatt)
+	{
+		if(fd != -1)
+			::close(fd);
+
+		int fds[2];
+		if(socketpair(AF_UNIX, SOCK_SEQPACKET, 0, fds) != 0)
+			throw std::runtime_error("socketpair failed");
+		fd = fds[0];
+		gatt.connect(fds[1]);
+	}
+
+	std::vector<uint8_t> read_pdu()
+	{
+		std::vector<uint8_t> p(1024);
+		int n = ::read(fd, p.data(), p.size());
+		if(n <= 0)
+			throw std::runtime_error("FakeServer: nothing to read");
+		p.resize(n);
+		return p;
+	}
+
+	void write_pdu(const std::vector<uint8_t>& p)
+	{
+		if(::write(fd, p.data(), p.size()) != (ssize_t)p.size())
+			throw std::runtime_error("FakeServer: short write");
+	}
+
+	~FakeServer()
+	{
+		if(fd != -1)
+			::close(fd);
+	}
+};
+
+#endif
@@ -0,0 +1,43 @@
+#ifndef BLEPP_TESTS_HCI_PACKETS_H
+#define BLEPP_TESTS_HCI_PACKETS_H
+
+//HCI events built by hand for the tests, framed as they are read from an
+//HCI socket (i.e. starting with the 0x04 event packet indicator).
+
+#include <blepp/lescan.h>
+#include <blepp/gap.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+//An LE Advertising Report event carrying a single report.
+inline std::vector<uint8_t> advertising_report(const BLEPP::BLEAddress& address, const std::vector<uint8_t>& ad, int8_t rssi=-64, BLEPP::LeAdvertisingEventType type=BLEPP::LeAdvertisingEventType::ADV_IND)
+{
+	std::vector<uint8_t> p(15 + ad.size());
+	uint8_t header[] = {0x04, 0x3E, static_cast<uint8_t>(12 + ad.size()), 0x02, 0x01, static_cast<uint8_t>(type), static_cast<uint8_t>(address.type)};
+	std::copy(header, header + sizeof(header), p.begin());
+	std::copy(address.bytes, address.bytes + 6, p.begin() + 7);
+	p[13] = ad.size();
+	std::copy(ad.begin(), ad.end(), p.begin() + 14);
+	p.back() = static_cast<uint8_t>(rssi);
+	return p;
+}
+
+//Device n of a made up crowd: 55:44:33:22:11:nn
+inline BLEPP::BLEAddress device(uint8_t n)
+{
+	const uint8_t bytes[6] = {n, 0x11, 0x22, 0x33, 0x44, 0x55};
+	return BLEPP::BLEAddress(bytes);
+}
+
+//A Complete Local Name AD structure.
+inline std::vector<uint8_t> name_ad(const std::string& name)
+{
+	std::vector<uint8_t> ad(2 + name.size());
+	ad[0] = 1 + name.size();
+	ad[1] = BLEPP::GAP::complete_local_name;
+	std::copy(name.begin(), name.end(), ad.begin() + 2);
+	return ad;
+}
+
+#endif
@@ -0,0 +1,94 @@
+#include <blepp/lescan.h>
+#include <blepp/hci_replay.h>
+#include "hci_packets.h"
+#include <iostream>
+#include <cstdlib>
+#include <set>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	log_level = LogLevels::Error;
+
+	vector<HCIReplay::Packet> packets;
+	for(int i=0; i < 10; i++)
+		packets.push_back({microseconds(0), advertising_report(device(i), name_ad("blepp"))});
+	HCIReplay replay(packets);
+
+	//A replay has no controller, so the list is always in software.
+	HCIScanner scanner(replay.get_fd(), HCIScanner::FilterDuplicates::Off);
+
+	auto heard = [&]()
+	{
+		replay.start();
+		replay.feed();
+		set<BLEAddress> s;
+		for(const auto& a: scanner.get_advertisements(1000))
+			s.insert(a.address);
+		return s;
+	};
+
+	//Empty means everything, and nothing is counted.
+	check(heard().size() == 10);
+	HCIScanner::AcceptListStats s = scanner.accept_list_stats();
+	check(s.entries == 0);
+	check(s.hits == 0 && s.misses == 0);
+	check(!s.in_controller);
+
+	scanner.set_accept_list({device(1), device(2)});
+	check(scanner.accept_list_capacity() == 0);
+	check(heard() == (set<BLEAddress>{device(1), device(2)}));
+
+	s = scanner.accept_list_stats();
+	check(s.entries == 2);
+	check(s.controller_capacity == 0);
+	check(!s.in_controller);
+	check(s.overflowed_entries == 2);
+	check(s.hits == 2);
+	check(s.misses == 8);
+
+	//Changes take effect straight away.
+	scanner.add_to_accept_list(device(3));
+	scanner.add_to_accept_list(device(3));
+	scanner.add_to_accept_list(device(42));
+	check(heard() == (set<BLEAddress>{device(1), device(2), device(3)}));
+
+	s = scanner.accept_list_stats();
+	check(s.entries == 4);
+	check(s.overflowed_entries == 4);
+	check(s.hits == 5);
+	check(s.misses == 15);
+
+	scanner.remove_from_accept_list(device(1));
+	scanner.remove_from_accept_list(device(7));
+	check(heard() == (set<BLEAddress>{device(2), device(3)}));
+	check(scanner.accept_list_stats().entries == 3);
+
+	//Stopping and starting keeps the list.
+	scanner.stop();
+	scanner.start();
+	check(heard() == (set<BLEAddress>{device(2), device(3)}));
+
+	//Addresses only match with the same type.
+	scanner.set_accept_list({BLEAddress(device(4).str(), AddressType::Random)});
+	check(heard().empty());
+
+	scanner.clear_accept_list();
+	check(heard().size() == 10);
+
+	s = scanner.accept_list_stats();
+	check(s.entries == 0);
+	check(s.overflowed_entries == 0);
+	check(s.hits == 9);
+	check(s.misses == 41);
+}
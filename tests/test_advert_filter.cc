@@ -0,0 +1,123 @@
+#include <blepp/advert_filter.h>
+#include "hci_packets.h"
+#include <blepp/gap.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <iostream>
+
+using namespace BLEPP;
+using namespace std;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+vector<uint8_t> report(const string& address, const vector<uint8_t>& ad, int8_t rssi)
+{
+	return advertising_report(BLEAddress(address), ad, rssi);
+}
+
+vector<Subscription::Id> match(const AdvertFilter& f, const vector<uint8_t>& packet)
+{
+	vector<Subscription::Id> ids;
+	int reports=0;
+	HCIScanner::parse_packet(packet.data(), packet.size(), [&](const AdvertisingView& v)
+	{
+		reports++;
+		bool matched = f.match(v, ids);
+		check(matched == !ids.empty());
+	});
+	check(reports == 1);
+	return ids;
+}
+
+int main()
+{
+	//Manufacturer data for Apple (0x004C), and a service data and 
+	//16 bit UUID list for Eddystone (0xFEAA).
+	vector<uint8_t> ibeacon = {0x02, GAP::flags, 0x06, 0x05, GAP::manufacturer_data, 0x4C, 0x00, 0x02, 0x15};
+	vector<uint8_t> eddystone = {0x03, GAP::complete_list_of_16_bit_UUIDs, 0xAA, 0xFE, 0x05, GAP::service_data_16_bit_UUID, 0xAA, 0xFE, 0x10, 0x00};
+	
+	//128 bit UUID 7309203e-349d-4c11-ac6b-baedd1819764, little endian
+	vector<uint8_t> custom = {0x11, GAP::incomplete_list_of_128_bit_UUIDs, 0x64, 0x97, 0x81, 0xD1, 0xED, 0xBA, 0x6B, 0xAC, 0x11, 0x4C, 0x9D, 0x34, 0x3E, 0x20, 0x09, 0x73};
+
+	vector<Subscription> subs(6);
+
+	subs[0].id = 10;
+	subs[0].company_ids = {0x004C};
+
+	subs[1].id = 11;
+	subs[1].address_prefixes = {"AC:23:3F"};
+	subs[1].min_rssi = -70;
+
+	subs[2].id = 12;
+	subs[2].service_uuids = {UUID(0xFEAA)};
+
+	subs[3].id = 13;
+	subs[3].addresses = {BLEAddress("01:02:03:04:05:06")};
+	subs[3].company_ids = {0x004C, 0x0059};
+
+	subs[4].id = 14;
+	subs[4].service_uuids = {UUID("7309203e-349d-4c11-ac6b-baedd1819764")};
+
+	subs[5].id = 15;
+	subs[5].service_uuids = {UUID("0000feaa-0000-1000-8000-00805f9b34fb")};
+	subs[5].min_rssi = -50;
+
+	AdvertFilter f(subs);
+	check(f.size() == 6);
+
+	check((match(f, report("11:22:33:44:55:66", ibeacon, -60)) == vector<Subscription::Id>{10}));
+	check((match(f, report("01:02:03:04:05:06", ibeacon, -60)) == vector<Subscription::Id>{10, 13}));
+
+	//Address only matches without the company ID.
+	check(match(f, report("01:02:03:04:05:06", {}, -60)).empty());
+
+	//Prefix with an RSSI threshold
+	check((match(f, report("AC:23:3F:00:11:22", {}, -60)) == vector<Subscription::Id>{11}));
+	check(match(f, report("AC:23:3F:00:11:22", {}, -80)).empty());
+	check(match(f, report("AC:23:3F:00:11:22", {}, 127)).empty());
+	check(match(f, report("AC:23:3E:00:11:22", {}, -60)).empty());
+	check((match(f, report("AC:23:3F:00:11:22", ibeacon, -60)) == vector<Subscription::Id>{10, 11}));
+
+	//16 bit UUIDs are the same as their 128 bit forms.
+	check((match(f, report("11:22:33:44:55:66", eddystone, -60)) == vector<Subscription::Id>{12}));
+	check((match(f, report("11:22:33:44:55:66", eddystone, -40)) == vector<Subscription::Id>{12, 15}));
+	check((match(f, report("11:22:33:44:55:66", custom, -40)) == vector<Subscription::Id>{14}));
+
+	check(match(f, report("11:22:33:44:55:66", {}, -40)).empty());
+
+	//Everything and nothing
+	vector<Subscription> all(1);
+	all[0].id = 99;
+	check((match(AdvertFilter(all), report("11:22:33:44:55:66", {}, 127)) == vector<Subscription::Id>{99}));
+	check(match(AdvertFilter(), report("11:22:33:44:55:66", ibeacon, -40)).empty());
+
+	//The sink counts rejections.
+	vector<Subscription::Id> seen;
+	AdvertFilterSink sink(f, [&](const AdvertisingView&, const vector<Subscription::Id>& ids){ seen = ids; });
+	auto p = report("AC:23:3F:00:11:22", ibeacon, -60);
+	HCIScanner::parse_packet(p.data(), p.size(), sink);
+	p = report("11:22:33:44:55:66", {}, -60);
+	HCIScanner::parse_packet(p.data(), p.size(), sink);
+	check(sink.accepted() == 1);
+	check(sink.rejected() == 1);
+	check((seen == vector<Subscription::Id>{10, 11}));
+
+	bool threw=false;
+	try
+	{
+		subs[1].address_prefixes = {"AC:23:3F:00:11:22:33"};
+		AdvertFilter bad(subs);
+	}
+	catch(std::invalid_argument&)
+	{
+		threw=true;
+	}
+	check(threw);
+}
@@ -0,0 +1,109 @@
+#include <blepp/advert_generator.h>
+#include <blepp/lescan.h>
+#include <iostream>
+#include <set>
+#include <cstdlib>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	log_level = LogLevels::Error;
+
+	AdvertGenerator::Config cfg;
+	cfg.devices = 500;
+	cfg.names = 1;
+	cfg.rssi_min = -80;
+	cfg.rssi_max = -60;
+	cfg.rssi_noise = 3;
+
+	//Every packet is a valid report, in time order, and every device 
+	//advertises at roughly its interval.
+	AdvertGenerator gen(cfg);
+	auto packets = gen.generate(seconds(10));
+	check(packets.size() > 500 * 10);
+	check(packets.size() < 500 * 100 + 500);
+
+	set<BLEAddress> addresses;
+	int names=0, uuids=0, manufacturers=0;
+	microseconds last(0);
+	for(const auto& p: packets)
+	{
+		check(p.timestamp >= last);
+		check(p.timestamp < seconds(10));
+		last = p.timestamp;
+
+		auto adverts = HCIScanner::parse_packet(p.data);
+		check(adverts.size() == 1);
+		const auto& a = adverts[0];
+		check(a.rssi >= -127 && a.rssi <= 20);
+		check(a.flags);
+		addresses.insert(a.address);
+		names += bool(a.local_name);
+		uuids += !a.UUIDs.empty();
+		manufacturers += !a.manufacturer_specific_data.empty();
+	}
+	check(addresses.size() == 500);
+	check(gen.addresses() == 500);
+	check(names == static_cast<int>(packets.size()));
+	check(uuids > 0 && uuids < static_cast<int>(packets.size()));
+	check(manufacturers > 0 && manufacturers < static_cast<int>(packets.size()));
+
+	//The same seed gives the same sequence.
+	AdvertGenerator again(cfg);
+	auto repeat = again.generate(packets.size());
+	for(size_t i=0; i < packets.size(); i++)
+		check(repeat[i].data == packets[i].data && repeat[i].timestamp == packets[i].timestamp);
+
+	//With rotation, private addresses change and public ones don't.
+	cfg.names = 0;
+	cfg.random_addresses = 0.5;
+	cfg.rotation_period = seconds(5);
+	AdvertGenerator rotating(cfg);
+	addresses.clear();
+	for(const auto& p: rotating.generate(seconds(11)))
+		addresses.insert(HCIScanner::parse_packet(p.data)[0].address);
+	//About 250 private addresses, each changing 2 or 3 times.
+	check(rotating.addresses() > 800 && rotating.addresses() < 1200);
+	check(addresses.size() == rotating.addresses());
+
+	//Into a scanner through the socket.
+	cfg.devices = 100;
+	cfg.rotation_period = seconds(0);
+	AdvertGenerator live(cfg);
+	HCIScanner scanner(live.get_fd(), HCIScanner::FilterDuplicates::Software);
+	int count=0;
+	auto report = [&](const AdvertisingView&){ count++; };
+	auto sink = make_advertising_sink(report);
+	size_t sent=0;
+	for(int i=0; i < 1000 && sent < 5000; i++)
+	{
+		sent += live.feed(5000 - sent);
+		scanner.get_advertisements(sink, 0);
+	}
+	for(int i=0; i < 100; i++)
+		scanner.get_advertisements(sink, 0);
+	check(sent == 5000);
+	check(count == 100);
+
+	bool threw=false;
+	try
+	{
+		cfg.min_interval = milliseconds(0);
+		AdvertGenerator bad(cfg);
+	}
+	catch(invalid_argument&)
+	{
+		threw = true;
+	}
+	check(threw);
+}
@@ -0,0 +1,85 @@
+#include <blepp/lescan.h>
+#include <blepp/hci_replay.h>
+#include "hci_packets.h"
+#include <iostream>
+#include <cstdlib>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	log_level = LogLevels::Error;
+
+	vector<HCIReplay::Packet> packets;
+	for(int i=0; i < 2000; i++)
+		packets.push_back({microseconds(i*100), advertising_report(device(i), name_ad("blepp"))});
+
+	HCIReplay replay(packets);
+	HCIScanner scanner(replay.get_fd(), HCIScanner::FilterDuplicates::Off);
+	scanner.start_capture_thread();
+	check(scanner.is_capturing());
+
+	//Packets trickle in over 200ms, so there's plenty of reading going
+	//on in the background.
+	replay.start(HCIReplay::Pacing::RealTime);
+
+	//Stopping and starting (and so sending HCI commands, on a real
+	//adapter) while the capture thread is reading mustn't lose or
+	//disturb anything.
+	size_t got=0;
+	HCIScanner::ScanParameters balanced = HCIScanner::ScanParameters::balanced();
+	for(int i=0; i < 10000 && got < packets.size(); i++)
+	{
+		replay.feed();
+
+		scanner.stop();
+		if(i%2)
+			scanner.start(balanced);
+		else
+			scanner.start();
+
+		got += scanner.get_advertisements(1).size();
+	}
+
+	check(replay.done());
+	check(got == packets.size());
+
+	HCIScanner::CaptureStats c = scanner.capture_stats();
+	check(c.captured == packets.size());
+	check(c.overflows == 0);
+	check(scanner.stats().malformed_packets == 0);
+
+	scanner.stop_capture_thread();
+	check(!scanner.is_capturing());
+
+	//A ring too small for a burst drops the excess. The count survives the 
+	//thread being restarted, though the thread's own stats start again.
+	HCIReplay burst(packets);
+	HCIScanner small(burst.get_fd(), HCIScanner::FilterDuplicates::Off);
+	small.start_capture_thread(16);
+	burst.feed();
+	check(burst.done());
+	got = 0;
+	for(int i=0; i < 100 && got + small.capture_stats().overflows < packets.size(); i++)
+		got += small.get_advertisements(10).size();
+
+	uint64_t dropped = small.capture_stats().overflows;
+	check(dropped > 0);
+	check(got + dropped == packets.size());
+	check(small.stats().ring_overflows == dropped);
+
+	small.stop_capture_thread();
+	small.start_capture_thread(16);
+	check(small.capture_stats().overflows == 0);
+	check(small.stats().ring_overflows == dropped);
+	check(small.stats().lost() >= dropped);
+}
@@ -0,0 +1,132 @@
+#include <blepp/device_tracker.h>
+#include <vector>
+#include <cstdlib>
+#include <iostream>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+struct Events: public DeviceListener
+{
+	int arrivals=0, changes=0, departures=0;
+	void on_arrival(const TrackedDevice&) override { arrivals++; }
+	void on_change(const TrackedDevice&) override { changes++; }
+	void on_departure(const TrackedDevice&) override { departures++; }
+};
+
+AdvertisingView view(uint32_t n, int8_t rssi, const vector<uint8_t>& data, LeAdvertisingEventType type = LeAdvertisingEventType::ADV_IND)
+{
+	uint8_t bytes[6] = {static_cast<uint8_t>(n), static_cast<uint8_t>(n>>8), static_cast<uint8_t>(n>>16), 0, 0, 0xC0};
+	AdvertisingView v;
+	v.type = type;
+	v.address = BLEAddress(bytes, AddressType::Random);
+	v.rssi = rssi;
+	v.data = data.data();
+	v.length = data.size();
+	return v;
+}
+
+int main()
+{
+	DeviceTracker::Clock::time_point t0;
+	vector<uint8_t> a = {0x02, 0x01, 0x06};
+	vector<uint8_t> b = {0x02, 0x01, 0x1A};
+
+	{
+		Events e;
+		DeviceTracker t(16, seconds(10));
+		t.set_listener(&e);
+
+		t.update(view(1, -60, a), t0);
+		t.update(view(1, -40, a), t0 + seconds(1));
+		t.update(view(1, 127, a), t0 + seconds(2));
+		check(e.arrivals == 1);
+		check(e.changes == 0);
+
+		const TrackedDevice* d = t.find(view(1, 0, a).address);
+		check(d);
+		check(d->adverts == 3);
+		check(d->rssi_min == -60);
+		check(d->rssi_max == -40);
+		check(d->rssi_last == -40);
+		check(d->rssi_mean() == -50);
+		check(d->first_seen == t0);
+		check(d->last_seen == t0 + seconds(2));
+
+		//Scan responses don't count as a change to the advert
+		t.update(view(1, -50, b, LeAdvertisingEventType::SCAN_RSP), t0 + seconds(3));
+		t.update(view(1, -50, a), t0 + seconds(3));
+		check(e.changes == 0);
+		t.update(view(1, -50, b), t0 + seconds(4));
+		check(e.changes == 1);
+		t.update(view(1, -50, b, LeAdvertisingEventType::SCAN_RSP), t0 + seconds(4));
+		check(e.changes == 1);
+
+		t.update(view(2, -50, a), t0 + seconds(5));
+		check(t.size() == 2);
+
+		//Device 1 was last seen at 4s, device 2 at 5s
+		t.expire(t0 + seconds(13));
+		check(e.departures == 0);
+		t.expire(t0 + seconds(14) + milliseconds(100));
+		check(e.departures == 1);
+		check(!t.find(view(1, 0, a).address));
+		check(t.find(view(2, 0, a).address));
+
+		//A long gap departs everything
+		t.expire(t0 + seconds(1000));
+		check(e.departures == 2);
+		check(t.size() == 0);
+
+		//Coming back is a new arrival
+		t.update(view(1, -50, a), t0 + seconds(1001));
+		check(e.arrivals == 3);
+	}
+
+	//Full table
+	{
+		DeviceTracker t(4, seconds(10));
+		for(int i=0; i < 6; i++)
+			t.update(view(i, -50, a), t0);
+		check(t.size() == 4);
+		check(t.overflows() == 2);
+	}
+
+	//Lots of devices coming and going. Each device is seen for a while
+	//then stops, with a rolling population of about 20000.
+	{
+		Events e;
+		DeviceTracker t(30000, seconds(5));
+		t.set_listener(&e);
+
+		const int total = 200000;
+		for(int i=0; i < total; i++)
+		{
+			auto now = t0 + milliseconds(i/4);
+			t.update(view(i, -50, a), now);
+			
+			//Refresh an older device which is still around
+			if(i >= 100)
+				t.update(view(i-100, -50, a), now);
+		}
+		check(e.arrivals == total);
+		check(t.overflows() == 0);
+		check(t.size() <= 21000);
+
+		size_t n=0;
+		t.for_each([&](const TrackedDevice&){ n++; });
+		check(n == t.size());
+
+		t.expire(t0 + seconds(1000));
+		check(t.size() == 0);
+		check(e.departures == total);
+	}
+}
@@ -0,0 +1,73 @@
+#include <blepp/duplicate_filter.h>
+#include <iostream>
+#include <cstdlib>
+
+using namespace BLEPP;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	DuplicateFilter::Clock::time_point t0;
+	BLEAddress a("00:11:22:33:44:55");
+	BLEAddress b("00:11:22:33:44:55", AddressType::Random);
+
+	//Without a ttl, things are reported once
+	DuplicateFilter f(64);
+	check(f.capacity() == 64);
+	check(f.insert(a, 0, t0));
+	check(!f.insert(a, 0, t0 + hours(1000)));
+	check(f.insert(a, 4, t0));
+	check(f.insert(b, 0, t0));
+	check(!f.insert(b, 0, t0));
+	check(f.size() == 3);
+	f.clear();
+	check(f.size() == 0);
+	check(f.insert(a, 0, t0));
+
+	//With a ttl, things are reported at most once per ttl.
+	DuplicateFilter g(64, seconds(10));
+	check(g.insert(a, 0, t0));
+	check(!g.insert(a, 0, t0 + seconds(5)));
+	check(!g.insert(a, 0, t0 + seconds(9)));
+	check(g.insert(a, 0, t0 + seconds(10)));
+	check(!g.insert(a, 0, t0 + seconds(19)));
+	check(g.insert(a, 0, t0 + seconds(21)));
+
+	//Overfill a small table. It must stay bounded and count evictions.
+	DuplicateFilter h(16);
+	uint8_t bytes[6] = {0,0,0,0,0,0};
+	for(int i=0; i < 1000; i++)
+	{
+		bytes[0] = i & 255;
+		bytes[1] = i >> 8;
+		check(h.insert(BLEAddress(bytes), 0, t0 + milliseconds(i)));
+	}
+	check(h.size() == 16);
+	check(h.evictions() == 1000 - 16);
+
+	//The most recent device must still be there.
+	check(!h.insert(BLEAddress(bytes), 0, t0 + seconds(2)));
+
+	//Stale entries get reused before live ones are evicted.
+	DuplicateFilter k(16, seconds(1));
+	for(int i=0; i < 16; i++)
+	{
+		bytes[0] = i;
+		k.insert(BLEAddress(bytes), 0, t0);
+	}
+	uint64_t e = k.evictions();
+	for(int i=0; i < 16; i++)
+	{
+		bytes[0] = i + 100;
+		k.insert(BLEAddress(bytes), 0, t0 + seconds(2));
+	}
+	check(k.evictions() == e);
+	check(k.size() <= 16);
+}
@@ -0,0 +1,486 @@
+#include <blepp/blestatemachine.h>
+#include <blepp/logging.h>
+#include "fake_server.h"
+#include <iostream>
+#include <cstdlib>
+#include <stdexcept>
+#include <unistd.h>
+#include <sys/socket.h>
+
+using namespace BLEPP;
+using namespace std;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	log_level = LogLevels::Error;
+
+	//The exchange settles on the smaller of the two MTUs, and 
+	//both receive and transmit buffers follow it.
+	{
+		BLEGATTStateMachine gatt;
+		FakeServer server;
+		int connected=0, exchanged=0;
+		gatt.cb_connected = [&](){ connected++; };
+		gatt.cb_mtu_exchanged = [&](){ exchanged++; };
+
+		server.connect(gatt);
+		check(connected == 1);
+		check(gatt.is_idle());
+		check(gatt.mtu() == 23);
+
+		gatt.request_mtu(247);
+		check(!gatt.is_idle());
+		check(server.read_pdu() == (vector<uint8_t>{0x02, 0xF7, 0x00}));
+
+		//Only one request goes at a time, so the next one waits its turn.
+		gatt.send_read_request(3);
+		check(gatt.queued() == 1);
+
+		server.write_pdu({0x03, 0x00, 0x01});
+		gatt.read_and_process_next();
+		check(exchanged == 1);
+		check(gatt.mtu() == 247);
+
+		check(server.read_pdu() == (vector<uint8_t>{0x0A, 0x03, 0x00}));
+		check(gatt.queued() == 0);
+		server.write_pdu({0x0B, 0x01});
+		gatt.read_and_process_next();
+
+		//A notification using the whole MTU is taken in its stride.
+		vector<uint8_t> big(247, 0xAB);
+		big[0] = 0x1B;
+		big[1] = 0x10;
+		big[2] = 0x00;
+		server.write_pdu(big);
+		gatt.read_and_process_next();
+		check(gatt.is_idle());
+
+		bool invalid=false;
+		try{ gatt.request_mtu(22); }
+		catch(invalid_argument&){ invalid = true; }
+		check(invalid);
+
+		//The exchange is only allowed once per connection.
+		bool again=false;
+		try{ gatt.request_mtu(512); }
+		catch(logic_error&){ again = true; }
+		check(again);
+		check(gatt.is_idle());
+
+		//The MTU does not outlive the connection.
+		gatt.close();
+		check(gatt.mtu() == 23);
+
+		//On a fresh connection, a server with a smaller MTU wins.
+		server.connect(gatt);
+		gatt.request_mtu(512);
+		check(server.read_pdu() == (vector<uint8_t>{0x02, 0x00, 0x02}));
+		server.write_pdu({0x03, 100, 0x00});
+		gatt.read_and_process_next();
+		check(exchanged == 2);
+		check(gatt.mtu() == 100);
+	}
+
+	//A server which cannot exchange MTUs leaves the default in place.
+	{
+		BLEGATTStateMachine gatt;
+		FakeServer server;
+		int exchanged=0, disconnected=0;
+		gatt.cb_mtu_exchanged = [&](){ exchanged++; };
+		gatt.cb_disconnected = [&](BLEGATTStateMachine::Disconnect){ disconnected++; };
+
+		server.connect(gatt);
+		gatt.request_mtu(247);
+		server.read_pdu();
+		server.write_pdu({0x01, 0x02, 0x00, 0x00, 0x06});
+		gatt.read_and_process_next();
+		check(exchanged == 1);
+		check(disconnected == 0);
+		check(gatt.is_idle());
+		check(gatt.mtu() == 23);
+	}
+
+	//The standard scan can exchange the MTU before it starts discovery.
+	{
+		BLEGATTStateMachine gatt;
+		FakeServer server;
+		function<void()> done = [](){};
+		gatt.setup_standard_scan(done, 185);
+
+		server.connect(gatt);
+		check(server.read_pdu() == (vector<uint8_t>{0x02, 185, 0x00}));
+		server.write_pdu({0x03, 0x00, 0x02});
+		gatt.read_and_process_next();
+		check(gatt.mtu() == 185);
+
+		//Discovery follows, starting with the primary services.
+		vector<uint8_t> p = server.read_pdu();
+		check(p[0] == 0x10);
+	}
+
+	//Long reads carry on with Read Blob until a response comes up short.
+	{
+		BLEGATTStateMachine gatt;
+		FakeServer server;
+		server.connect(gatt);
+
+		vector<uint8_t> value(50);
+		for(unsigned int i=0; i < value.size(); i++)
+			value[i] = i;
+
+		//Answer requests for handle 0x0010 from value, MTU-1 bytes at a time.
+		auto serve = [&](vector<uint8_t> req, const vector<uint8_t>& value)
+		{
+			check(req[1] == 0x10 && req[2] == 0x00);
+			unsigned int offset = 0;
+			if(req[0] == 0x0C)
+				offset = req[3] | (req[4] << 8);
+			else
+				check(req[0] == 0x0A);
+			unsigned int n = min<size_t>(gatt.mtu() - 1, value.size() - offset);
+			vector<uint8_t> resp(n + 1);
+			resp[0] = req[0] + 1;
+			copy(value.begin() + offset, value.begin() + offset + n, resp.begin() + 1);
+			server.write_pdu(resp);
+		};
+
+		vector<uint8_t> got;
+		int calls=0, round_trips=0;
+		auto done = [&](const LongReadResponse& r)
+		{
+			calls++;
+			round_trips = r.round_trips;
+			check(r.handle == 0x10);
+			check(&r.value == &got);
+		};
+		gatt.send_long_read_request(0x10, got, done);
+		while(!gatt.is_idle())
+		{
+			serve(server.read_pdu(), value);
+			gatt.read_and_process_next();
+		}
+		check(calls == 1);
+		check(got == value);
+		check(round_trips == 3);
+
+		//A larger MTU needs fewer trips.
+		gatt.request_mtu(64);
+		server.read_pdu();
+		server.write_pdu({0x03, 0x00, 0x01});
+		gatt.read_and_process_next();
+		gatt.send_long_read_request(0x10, got, done);
+		while(!gatt.is_idle())
+		{
+			serve(server.read_pdu(), value);
+			gatt.read_and_process_next();
+		}
+		check(calls == 2);
+		check(got == value);
+		check(round_trips == 1);
+
+		//A value which exactly fills the MTU may end in an Attribute Not Long
+		//error, which still completes the read.
+		vector<uint8_t> exact(value.begin(), value.begin() + 63);
+		gatt.send_long_read_request(0x10, got, done);
+		serve(server.read_pdu(), exact);
+		gatt.read_and_process_next();
+		check(server.read_pdu()[0] == 0x0C);
+		server.write_pdu({0x01, 0x0C, 0x10, 0x00, 0x0B});
+		gatt.read_and_process_next();
+		check(calls == 3);
+		check(got == exact);
+		check(round_trips == 2);
+		check(gatt.is_idle());
+
+		//Any other error is still a failure.
+		int disconnected=0;
+		gatt.cb_disconnected = [&](BLEGATTStateMachine::Disconnect){ disconnected++; };
+		gatt.send_long_read_request(0x10, got, done);
+		server.read_pdu();
+		server.write_pdu({0x01, 0x0A, 0x10, 0x00, 0x02});
+		gatt.read_and_process_next();
+		check(calls == 3);
+		check(disconnected == 1);
+	}
+
+	//Long writes go as MTU sized Prepare Writes then an Execute Write.
+	{
+		BLEGATTStateMachine gatt;
+		FakeServer server;
+		server.connect(gatt);
+
+		vector<uint8_t> value(100);
+		for(unsigned int i=0; i < value.size(); i++)
+			value[i] = i * 7;
+
+		vector<LongWriteResponse> results;
+		auto done = [&](const LongWriteResponse& r){ results.push_back(r); };
+
+		//Plays the server, echoing segments (corrupting the one at 
+		//corrupt_offset) and returning what it was asked to execute.
+		auto serve = [&](vector<uint8_t>& queued, int corrupt_offset)
+		{
+			for(;;)
+			{
+				vector<uint8_t> req = server.read_pdu();
+				if(req[0] == 0x18)
+				{
+					server.write_pdu({0x19});
+					gatt.read_and_process_next();
+					return req[1];
+				}
+
+				check(req[0] == 0x16);
+				check(req.size() <= gatt.mtu());
+				unsigned int offset = req[3] | (req[4] << 8);
+				check(offset == queued.size());
+				queued.insert(queued.end(), req.begin() + 5, req.end());
+
+				req[0] = 0x17;
+				if((int)offset == corrupt_offset)
+					req.back() ^= 1;
+				server.write_pdu(req);
+				gatt.read_and_process_next();
+			}
+		};
+
+		vector<uint8_t> queued;
+		gatt.send_long_write_request(0x10, value.data(), value.size(), false, done);
+		check(serve(queued, -1) == ATT_WRITE_ALL_PREP_WRITES);
+		check(queued == value);
+		check(results.size() == 1);
+		check(results[0].committed);
+		check(results[0].handle == 0x10);
+		check(results[0].round_trips == 7); //6 segments of up to 18, then execute
+		check(gatt.is_idle());
+
+		//An echo that does not match is only worth a warning normally,
+		queued.clear();
+		gatt.send_long_write_request(0x10, value.data(), value.size(), false, done);
+		check(serve(queued, 18) == ATT_WRITE_ALL_PREP_WRITES);
+		check(results.size() == 2);
+		check(results[1].committed);
+
+		//but a reliable write gives up and cancels everything.
+		queued.clear();
+		gatt.send_long_write_request(0x10, value.data(), value.size(), true, done);
+		check(serve(queued, 18) == ATT_CANCEL_ALL_PREP_WRITES);
+		check(queued.size() == 36);
+		check(results.size() == 3);
+		check(!results[2].committed);
+		check(results[2].round_trips == 3);
+		check(gatt.is_idle());
+
+		bool invalid=false;
+		vector<uint8_t> huge(513);
+		try{ gatt.send_long_write_request(0x10, huge.data(), huge.size()); }
+		catch(invalid_argument&){ invalid = true; }
+		check(invalid);
+	}
+
+	//Streams of write commands never block, but wait for room in the socket.
+	{
+		BLEGATTStateMachine gatt;
+		FakeServer server;
+		server.connect(gatt);
+
+		int small = 4096;
+		check(setsockopt(gatt.socket(), SOL_SOCKET, SO_SNDBUF, &small, sizeof(small)) == 0);
+
+		vector<uint8_t> value(20000);
+		for(unsigned int i=0; i < value.size(); i++)
+			value[i] = i * 13;
+
+		vector<WriteStreamResponse> results;
+		gatt.send_write_command_stream(0x10, value.data(), value.size(), [&](const WriteStreamResponse& r){ results.push_back(r); });
+
+		//The socket is far too small for all of it, 
+		check(gatt.is_streaming());
+		check(gatt.wait_on_write());
+		check(results.empty());
+
+		//Other requests and commands wait for room rather than blocking,
+		check(gatt.is_idle());
+		vector<uint8_t> got;
+		bool read_while_streaming=false;
+		gatt.send_read_request(3, [&](const PDUReadResponse& r)
+		{
+			got.assign(r.value().first, r.value().second);
+			read_while_streaming = gatt.is_streaming();
+		});
+		const uint8_t one=1;
+		gatt.send_write_command(0x20, &one, 1);
+		check(gatt.queued() == 2);
+
+		//and go ahead of the rest of the stream once there is some.
+		vector<uint8_t> received;
+		int pdus=0;
+		bool command_sent=false;
+		while(results.empty())
+		{
+			vector<uint8_t> p(1024);
+			int n;
+			while((n = recv(server.fd, p.data(), p.size(), MSG_DONTWAIT)) > 0)
+			{
+				if(p[0] == 0x0A)
+				{
+					check(n == 3 && p[1] == 3 && got.empty());
+					server.write_pdu({0x0B, 'o', 'k'});
+					gatt.read_and_process_next();
+					continue;
+				}
+				else if(p[0] == 0x52 && p[1] == 0x20)
+				{
+					check(n == 4 && p[3] == 1 && !command_sent);
+					command_sent = true;
+					continue;
+				}
+
+				check(n <= gatt.mtu());
+				check(p[0] == 0x52 && p[1] == 0x10 && p[2] == 0x00);
+				received.insert(received.end(), p.begin() + 3, p.begin() + n);
+				pdus++;
+			}
+			gatt.write_and_process_next();
+		}
+
+		check(got == (vector<uint8_t>{'o', 'k'}));
+		check(read_while_streaming);
+		check(command_sent);
+		check(gatt.is_idle());
+
+		vector<uint8_t> p(1024);
+		int n;
+		while((n = recv(server.fd, p.data(), p.size(), MSG_DONTWAIT)) > 0)
+		{
+			received.insert(received.end(), p.begin() + 3, p.begin() + n);
+			pdus++;
+		}
+
+		check(received == value);
+		check(results.size() == 1);
+		check(results[0].bytes == value.size());
+		check(results[0].chunks == 1000);
+		check(pdus == 1000);
+		check(results[0].stalls > 0);
+		check(results[0].bytes_per_second() > 0);
+		check(!gatt.is_streaming());
+		check(!gatt.wait_on_write());
+	}
+
+	//Requests queue up and each runs when the one before it is answered.
+	{
+		BLEGATTStateMachine gatt;
+		FakeServer server;
+
+		//Nothing can be queued without a connection.
+		bool threw=false;
+		try{ gatt.read_primary_services(); }
+		catch(logic_error&){ threw = true; }
+		check(threw);
+
+		server.connect(gatt);
+
+		//Twenty notifiable characteristics, with CCCs after their values.
+		PrimaryService service;
+		service.start_handle = 1;
+		service.end_handle = 0xffff;
+		for(int i=0; i < 20; i++)
+		{
+			Characteristic c(&gatt);
+			c.notify = true;
+			c.indicate = false;
+			c.first_handle = 2 + 3*i;
+			c.value_handle = 3 + 3*i;
+			c.client_characteric_configuration_handle = 4 + 3*i;
+			c.last_handle = 4 + 3*i;
+			service.characteristics.push_back(c);
+		}
+		gatt.primary_services.push_back(service);
+
+		vector<Characteristic*> all;
+		for(auto& c: gatt.primary_services[0].characteristics)
+			all.push_back(&c);
+
+		//A bad one stops anything being queued, and the error says which
+		//property is missing.
+		all[7]->notify = false;
+		all[7]->indicate = true;
+		string why;
+		try{ gatt.set_notify_and_indicate({all[0], all[7]}, false, true, nullptr); }
+		catch(logic_error& e){ why = e.what(); }
+		check(why == "Error: this is not indicateable");
+		try{ gatt.set_notify_and_indicate({all[7]}, true, true, nullptr); }
+		catch(logic_error& e){ why = e.what(); }
+		check(why == "Error: this is not notifiable");
+		check(gatt.is_idle());
+		all[7]->notify = true;
+		all[7]->indicate = false;
+
+		int shared=0, subscribed=0;
+		gatt.cb_write_response = [&](){ shared++; };
+
+		//Subscribing to all of them is one call, with no user code until the end.
+		gatt.set_notify_and_indicate(all, true, false, [&](){ subscribed++; });
+		int writes=0;
+		while(!gatt.is_idle())
+		{
+			vector<uint8_t> req = server.read_pdu();
+			check(req == (vector<uint8_t>{0x12, (uint8_t)(4 + 3*writes), 0x00, 0x01, 0x00}));
+			writes++;
+			server.write_pdu({0x13});
+			gatt.read_and_process_next();
+		}
+		check(writes == 20);
+		check(subscribed == 1);
+		check(shared == 0);
+
+		//Commands go out while a request is outstanding,
+		vector<uint8_t> got;
+		gatt.send_read_request(3, [&](const PDUReadResponse& r){ got.assign(r.value().first, r.value().second); });
+		uint8_t one = 1;
+		gatt.send_write_command(6, &one, 1);
+		check(server.read_pdu()[0] == 0x0A);
+		check(server.read_pdu() == (vector<uint8_t>{0x52, 0x06, 0x00, 0x01}));
+
+		//but keep their place behind requests still queued.
+		int written=0;
+		gatt.send_write_request(9, &one, 1, [&](){ written++; });
+		gatt.send_write_command(6, &one, 1);
+		check(gatt.queued() == 2);
+
+		server.write_pdu({0x0B, 'h', 'i'});
+		gatt.read_and_process_next();
+		check(got == (vector<uint8_t>{'h', 'i'}));
+		check(server.read_pdu()[0] == 0x12);
+		check(server.read_pdu()[0] == 0x52);
+		server.write_pdu({0x13});
+		gatt.read_and_process_next();
+		check(written == 1);
+		check(shared == 0);
+		check(gatt.is_idle());
+
+		//Without their own callback, requests report as they always did.
+		gatt.send_write_request(9, &one, 1);
+		server.read_pdu();
+		server.write_pdu({0x13});
+		gatt.read_and_process_next();
+		check(shared == 1);
+
+		//Anything queued is dropped with the connection.
+		gatt.send_read_request(3);
+		gatt.send_read_request(3);
+		check(gatt.queued() == 1);
+		gatt.close();
+		check(gatt.queued() == 0);
+	}
+
+	cout << "OK" << endl;
+}
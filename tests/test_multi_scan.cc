@@ -0,0 +1,143 @@
+#include <blepp/multi_lescan.h>
+#include <blepp/hci_replay.h>
+#include "hci_packets.h"
+#include <iostream>
+#include <cstdlib>
+#include <map>
+#include <unistd.h>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+//Devices first to last, all at the same RSSI.
+vector<HCIReplay::Packet> adverts(int first, int last, int8_t rssi)
+{
+	vector<HCIReplay::Packet> p;
+	for(int i=first; i <= last; i++)
+		p.push_back({microseconds(0), advertising_report(device(i), name_ad("blepp"), rssi)});
+	return p;
+}
+
+int main()
+{
+	log_level = LogLevels::Error;
+
+	//Devices 5 to 9 are heard by both adapters, the first more quietly.
+	HCIReplay r0(adverts(0, 9, -80)), r1(adverts(5, 14, -40));
+	
+	auto read_all = [&](MultiHCIScanner& m)
+	{
+		r0.start();
+		r1.start();
+		r0.feed();
+		r1.feed();
+
+		//Keep going until both have been drained.
+		vector<MultiAdvertisingResponse> all;
+		for(int i=0; i < 2; i++)
+		{
+			auto got = m.get_advertisements(100);
+			all.insert(all.end(), got.begin(), got.end());
+		}
+		return all;
+	};
+
+	{
+		MultiHCIScanner multi(vector<int>{r0.get_fd(), r1.get_fd()}, HCIScanner::FilterDuplicates::Software);
+		check(multi.num_adapters() == 2);
+
+		//Each device comes out once, from whichever adapter heard it.
+		vector<MultiAdvertisingResponse> got = read_all(multi);
+		check(got.size() == 15);
+		map<BLEAddress, size_t> from;
+		for(const auto& a: got)
+		{
+			check(from.count(a.advert.address) == 0);
+			from[a.advert.address] = a.adapter;
+		}
+		for(int i=0; i < 5; i++)
+			check(from[device(i)] == 0);
+		for(int i=10; i < 15; i++)
+			check(from[device(i)] == 1);
+
+		//The RSSI is kept per adapter even when the report was filtered.
+		check(multi.rssi(device(7), 0) && *multi.rssi(device(7), 0) == -80);
+		check(multi.rssi(device(7), 1) && *multi.rssi(device(7), 1) == -40);
+		check(multi.best_adapter(device(7)) && *multi.best_adapter(device(7)) == 1);
+		check(*multi.best_adapter(device(2)) == 0);
+		check(!multi.rssi(device(2), 1));
+		check(!multi.best_adapter(device(99)));
+
+		//The filter is shared: nothing is new the second time round.
+		check(read_all(multi).empty());
+		check(multi.software_filter().size() == 15);
+
+		//Restarting forgets.
+		multi.start();
+		check(read_all(multi).size() == 15);
+		check(read_all(multi).empty());
+
+		//So does the periodic refresh, which clears the shared filter.
+		multi.set_refresh_interval(milliseconds(30));
+		check(multi.next_timeout_ms() > 0 && multi.next_timeout_ms() <= 31);
+		check(read_all(multi).empty());
+		usleep(35000);
+		check(multi.next_timeout_ms() == 0);
+		check(multi.get_advertisements(0).empty());
+		check(multi.software_filter().size() == 0);
+		check(multi.next_timeout_ms() > 0);
+		check(read_all(multi).size() == 15);
+		multi.set_refresh_interval(steady_clock::duration::zero());
+		check(multi.next_timeout_ms() == -1);
+	}
+
+	{
+		//Without filtering, everything comes through, tagged with its adapter.
+		MultiHCIScanner multi(vector<int>{r0.get_fd(), r1.get_fd()}, HCIScanner::FilterDuplicates::Off);
+		vector<MultiAdvertisingResponse> got = read_all(multi);
+		check(got.size() == 20);
+		int on[2] = {0, 0};
+		for(const auto& a: got)
+			on[a.adapter]++;
+		check(on[0] == 10 && on[1] == 10);
+
+		//A full RSSI table forgets devices rather than growing.
+		multi.set_rssi_capacity(8);
+		check(read_all(multi).size() == 20);
+		int tracked=0;
+		for(int i=0; i < 15; i++)
+			if(multi.best_adapter(device(i)))
+				tracked++;
+		check(tracked == 8);
+	}
+
+	{
+		//An adapter which goes quiet still has its held adverts released
+		//on time, rather than waiting for the next packet.
+		HCIReplay quiet({{microseconds(0), advertising_report(device(1), name_ad("blepp"), -50, LeAdvertisingEventType::ADV_IND)}});
+		HCIReplay silent(vector<HCIReplay::Packet>{});
+		MultiHCIScanner multi(vector<int>{silent.get_fd(), quiet.get_fd()}, HCIScanner::FilterDuplicates::Software);
+		multi.adapter(1).set_scan_response_merging(milliseconds(50));
+		check(multi.next_timeout_ms() == -1);
+
+		quiet.feed();
+		check(multi.get_advertisements(1000).empty());
+		check(multi.next_timeout_ms() > 0 && multi.next_timeout_ms() <= 51);
+
+		auto t0 = steady_clock::now();
+		vector<MultiAdvertisingResponse> got = multi.get_advertisements(-1);
+		check(steady_clock::now() - t0 < milliseconds(500));
+		check(got.size() == 1);
+		check(got[0].adapter == 1);
+		check(got[0].advert.address == device(1));
+		check(multi.next_timeout_ms() == -1);
+	}
+}
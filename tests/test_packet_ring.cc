@@ -0,0 +1,83 @@
+#include <blepp/packet_ring.h>
+#include <iostream>
+#include <thread>
+#include <cstring>
+#include <cstdlib>
+
+using namespace BLEPP;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	PacketRing r(5, 16);
+	check(r.capacity() == 8);
+	check(r.occupancy() == 0);
+
+	const uint8_t* p;
+	size_t len;
+	check(!r.peek(p, len));
+
+	//Fill it up
+	for(int i=0; i < 8; i++)
+	{
+		uint8_t* s = r.producer_slot();
+		check(s != nullptr);
+		s[0] = i;
+		r.commit(i+1);
+	}
+	check(r.producer_slot() == nullptr);
+	check(r.occupancy() == 8);
+
+	for(int i=0; i < 8; i++)
+	{
+		check(r.peek(p, len));
+		check(p[0] == i);
+		check(len == (size_t)i+1);
+		r.release();
+	}
+	check(r.occupancy() == 0);
+
+	//Hammer it from two threads. Everything must arrive, in order.
+	const uint32_t N=1000000;
+	PacketRing big(64, sizeof(uint32_t));
+
+	std::thread producer([&]()
+	{
+		for(uint32_t i=0; i < N;)
+		{
+			uint8_t* s = big.producer_slot();
+			if(s)
+			{
+				memcpy(s, &i, sizeof(i));
+				big.commit(sizeof(i));
+				i++;
+			}
+			else
+				std::this_thread::yield();
+		}
+	});
+
+	for(uint32_t i=0; i < N;)
+	{
+		if(big.peek(p, len))
+		{
+			uint32_t v;
+			memcpy(&v, p, sizeof(v));
+			check(v == i);
+			check(len == sizeof(v));
+			big.release();
+			i++;
+		}
+		else
+			std::this_thread::yield();
+	}
+
+	producer.join();
+	check(big.occupancy() == 0);
+}
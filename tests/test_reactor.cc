@@ -0,0 +1,224 @@
+#include <blepp/reactor.h>
+#include <blepp/hci_replay.h>
+#include "hci_packets.h"
+#include "fake_server.h"
+#include <iostream>
+#include <cstdlib>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	log_level = LogLevels::Error;
+
+	vector<HCIReplay::Packet> packets;
+	for(int i=0; i < 10; i++)
+		packets.push_back({microseconds(0), advertising_report(device(i), name_ad("blepp"))});
+	HCIReplay replay(packets);
+	HCIScanner scanner(replay.get_fd(), HCIScanner::FilterDuplicates::Off);
+
+	int adverts=0;
+	auto count = [&](const AdvertisingView&){ adverts++; };
+	auto sink = make_advertising_sink(count);
+
+	BLEGATTStateMachine gatt;
+	FakeServer server;
+	server.connect(gatt);
+
+	Reactor reactor;
+	reactor.add(scanner, sink);
+	reactor.add(gatt);
+	check(reactor.size() == 2);
+
+	//Nothing to do, and nothing spins.
+	check(reactor.run_once(0) == 0);
+
+	//Reads are dispatched to whichever is ready.
+	replay.feed();
+	check(reactor.run_once(1000) == 1);
+	check(adverts == 10);
+
+	vector<uint8_t> got;
+	gatt.send_read_request(3, [&](const PDUReadResponse& r){ got.assign(r.value().first, r.value().second); });
+	check(server.read_pdu() == (vector<uint8_t>{0x0A, 0x03, 0x00}));
+	server.write_pdu({0x0B, 'h', 'i'});
+	check(reactor.run_once(1000) == 1);
+	check(got == (vector<uint8_t>{'h', 'i'}));
+	check(gatt.is_idle());
+	check(reactor.run_once(0) == 0);
+
+	//A stream waits for room in the socket. That needs write readiness,
+	//but responses must still get through while it's waiting.
+	{
+		int small = 4096;
+		check(setsockopt(gatt.socket(), SOL_SOCKET, SO_SNDBUF, &small, sizeof(small)) == 0);
+
+		got.clear();
+		bool read_while_streaming=false;
+		gatt.send_read_request(3, [&](const PDUReadResponse& r)
+		{
+			got.assign(r.value().first, r.value().second);
+			read_while_streaming = gatt.is_streaming();
+		});
+
+		vector<uint8_t> value(20000, 0x55);
+		int streams=0;
+		gatt.send_write_command_stream(0x10, value.data(), value.size(), [&](const WriteStreamResponse&){ streams++; });
+		check(gatt.is_streaming());
+		check(gatt.wait_on_write());
+
+		size_t received=0;
+		bool answered=false;
+		for(int i=0; i < 10000 && streams == 0; i++)
+		{
+			vector<uint8_t> p(1024);
+			int n;
+			while((n = recv(server.fd, p.data(), p.size(), MSG_DONTWAIT)) > 0)
+			{
+				if(p[0] == 0x0A && !answered)
+				{
+					server.write_pdu({0x0B, 'o', 'k'});
+					answered = true;
+				}
+				else
+					received += n - 3;
+			}
+
+			reactor.run_once(1000);
+		}
+
+		vector<uint8_t> p(1024);
+		int n;
+		while((n = recv(server.fd, p.data(), p.size(), MSG_DONTWAIT)) > 0)
+			received += n - 3;
+
+		check(streams == 1);
+		check(received == value.size());
+		check(got == (vector<uint8_t>{'o', 'k'}));
+		check(read_while_streaming);
+
+		//Back to waiting for reads only: a writable socket must not wake it.
+		check(!gatt.wait_on_write());
+		check(reactor.run_once(0) == 0);
+	}
+
+	//Reconnecting between calls is picked up. The new socket will most
+	//likely reuse the old fd number.
+	{
+		gatt.close();
+		FakeServer other;
+		other.connect(gatt);
+
+		got.clear();
+		gatt.send_read_request(3, [&](const PDUReadResponse& r){ got.assign(r.value().first, r.value().second); });
+		check(other.read_pdu()[0] == 0x0A);
+		other.write_pdu({0x0B, '2'});
+		check(reactor.run_once(1000) == 1);
+		check(got == (vector<uint8_t>{'2'}));
+
+		//And from within a callback.
+		FakeServer third;
+		gatt.send_read_request(3, [&](const PDUReadResponse&)
+		{
+			gatt.close();
+			third.connect(gatt);
+		});
+		check(other.read_pdu()[0] == 0x0A);
+		other.write_pdu({0x0B, '3'});
+		check(reactor.run_once(1000) == 1);
+
+		got.clear();
+		gatt.send_read_request(3, [&](const PDUReadResponse& r){ got.assign(r.value().first, r.value().second); });
+		check(third.read_pdu()[0] == 0x0A);
+		third.write_pdu({0x0B, '4'});
+		check(reactor.run_once(1000) == 1);
+		check(got == (vector<uint8_t>{'4'}));
+
+		//Straight on to another connection, without closing first.
+		server.connect(gatt);
+		check(reactor.run_once(0) == 0);
+	}
+
+	//Entries can remove themselves from their own callbacks.
+	{
+		adverts = 0;
+		auto remove_self = [&](const AdvertisingView&)
+		{
+			if(adverts++ == 0)
+				reactor.remove(scanner);
+		};
+		auto once = make_advertising_sink(remove_self);
+
+		reactor.remove(scanner);
+		reactor.add(scanner, once);
+		replay.start();
+		replay.feed();
+		check(reactor.run_once(1000) == 1);
+		check(reactor.size() == 1);
+
+		//The rest of that batch still went to the sink, but nothing more.
+		check(adverts == 10);
+		replay.start();
+		replay.feed();
+		check(reactor.run_once(50) == 0);
+		check(adverts == 10);
+
+		gatt.send_read_request(3, [&](const PDUReadResponse&){ reactor.remove(gatt); });
+		check(server.read_pdu()[0] == 0x0A);
+		server.write_pdu({0x0B, 'x'});
+		check(reactor.run_once(1000) == 1);
+		check(reactor.size() == 0);
+
+		bool threw=false;
+		try{ reactor.remove(gatt); }
+		catch(logic_error&){ threw = true; }
+		check(threw);
+	}
+
+	//An exception from one entry doesn't lose the rest of the batch.
+	{
+		HCIReplay bad_replay(packets);
+		HCIScanner bad_scanner(bad_replay.get_fd(), HCIScanner::FilterDuplicates::Off);
+		auto fail = [&](const AdvertisingView&){ throw runtime_error("sink failed"); };
+		auto bad_sink = make_advertising_sink(fail);
+
+		reactor.add(bad_scanner, bad_sink);
+		reactor.add(gatt);
+
+		got.clear();
+		gatt.send_read_request(3, [&](const PDUReadResponse& r){ got.assign(r.value().first, r.value().second); });
+		check(server.read_pdu()[0] == 0x0A);
+		server.write_pdu({0x0B, '5'});
+		bad_replay.feed();
+
+		bool threw=false;
+		try{ reactor.run_once(1000); }
+		catch(runtime_error&){ threw = true; }
+		check(threw);
+		check(got == (vector<uint8_t>{'5'}));
+
+		//Timed work set up between calls needs update().
+		reactor.remove(bad_scanner);
+		reactor.add(scanner, sink);
+		while(reactor.run_once(0) != 0)
+			;
+		scanner.set_refresh_interval(milliseconds(20));
+		reactor.update(scanner);
+		auto before = scanner.stats().refreshes;
+		auto start = steady_clock::now();
+		for(int i=0; i < 3; i++)
+			reactor.run_once(1000);
+		check(steady_clock::now() - start < milliseconds(500));
+		check(scanner.stats().refreshes > before);
+		scanner.set_refresh_interval(steady_clock::duration::zero());
+	}
+}
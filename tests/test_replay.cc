@@ -0,0 +1,168 @@
+#include <blepp/hci_replay.h>
+#include <blepp/lescan.h>
+#include "hci_packets.h"
+#include <iostream>
+#include <fstream>
+#include <cstdlib>
+#include <unistd.h>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+vector<uint8_t> advert(uint8_t n)
+{
+	return advertising_report(device(n), name_ad("blepp"));
+}
+
+void put(ofstream& out, uint64_t v, int bytes, bool little)
+{
+	for(int i=0; i < bytes; i++)
+		out.put(static_cast<char>(v >> (8*(little?i:bytes-1-i))));
+}
+
+int main()
+{
+	log_level = LogLevels::Error;
+	string dir = "/tmp/blepp_test_replay_" + to_string(getpid());
+	string snoop = dir + ".btsnoop", pcap = dir + ".pcap";
+
+	vector<HCIReplay::Packet> packets;
+	for(int i=0; i < 100; i++)
+		packets.push_back({microseconds(i*1000), advert(i)});
+
+	//Round trip through btsnoop
+	HCIReplay::save_btsnoop(snoop, packets);
+	{
+		HCIReplay r(snoop);
+		check(r.packets().size() == 100);
+		check(r.packets()[7].data == advert(7));
+		check(r.packets()[7].timestamp == microseconds(7000));
+	}
+
+	//A big endian, nanosecond pcap in the Linux monitor format. Only the
+	//LE meta event should survive: the command complete event and the 
+	//command packet are dropped.
+	{
+		ofstream out(pcap, ios::binary);
+		put(out, 0xa1b23c4d, 4, false);
+		put(out, 0x00020004, 4, false);
+		put(out, 0, 8, false);
+		put(out, 65535, 4, false);
+		put(out, 254, 4, false);
+
+		auto record = [&](uint64_t ns, uint16_t opcode, vector<uint8_t> data)
+		{
+			put(out, ns / 1000000000, 4, false);
+			put(out, ns % 1000000000, 4, false);
+			put(out, data.size() + 4, 4, false);
+			put(out, data.size() + 4, 4, false);
+			put(out, 0, 2, false);
+			put(out, opcode, 2, false);
+			out.write(reinterpret_cast<const char*>(data.data()), data.size());
+		};
+
+		vector<uint8_t> a = advert(1);
+		record(5000000000, 2, {0x0c, 0x20, 0x02, 0x01, 0x00});
+		record(5000500000, 3, {0x0e, 0x04, 0x01, 0x0c, 0x20, 0x00});
+		record(5002000000, 3, vector<uint8_t>(a.begin()+1, a.end()));
+	}
+	{
+		HCIReplay r(pcap);
+		check(r.packets().size() == 1);
+		check(r.packets()[0].data == advert(1));
+		check(r.packets()[0].timestamp == microseconds(0));
+	}
+
+	//Garbage
+	{
+		ofstream out(pcap, ios::binary);
+		out << "this is not a capture file at all";
+	}
+	bool threw=false;
+	try
+	{
+		HCIReplay r(pcap);
+	}
+	catch(HCIReplay::FormatError&)
+	{
+		threw = true;
+	}
+	check(threw);
+
+	unlink(snoop.c_str());
+	unlink(pcap.c_str());
+
+	//Replay in to a scanner, the same way as a live adapter.
+	HCIReplay replay(packets);
+	HCIScanner scanner(replay.get_fd(), HCIScanner::FilterDuplicates::Off);
+	
+	int count=0, named=0;
+	auto report = [&](const AdvertisingView& a){
+		count++;
+		if(a.local_name() && a.local_name()->name == "blepp")
+			named++;
+	};
+	auto sink = make_advertising_sink(report);
+
+	check(replay.next_due_ms() == 0);
+	check(replay.feed() == 100);
+	check(replay.done());
+	check(replay.next_due_ms() == -1);
+
+	for(int i=0; i < 10 && count < 100; i++)
+		scanner.get_advertisements(sink, 100);
+	check(count == 100);
+	check(named == 100);
+
+	//With software filtering, the replay is deduplicated as usual.
+	HCIScanner filtered(replay.get_fd(), HCIScanner::FilterDuplicates::Software);
+	replay.start();
+	replay.feed();
+	count = 0;
+	for(int i=0; i < 10; i++)
+		filtered.get_advertisements(sink, 0);
+	check(count == 100);
+	replay.start();
+	replay.feed();
+	count = 0;
+	filtered.get_advertisements(sink, 0);
+	check(count == 0);
+
+	//Reports are stamped when they arrive at the socket, not when they're read.
+	check(scanner.kernel_timestamps());
+	vector<steady_clock::time_point> stamps;
+	auto stamp = [&](const AdvertisingView& a){ stamps.push_back(a.timestamp); };
+	auto stamper = make_advertising_sink(stamp);
+	replay.start();
+	auto sent_at = steady_clock::now();
+	replay.feed();
+	usleep(50000);
+	auto read_at = steady_clock::now();
+	scanner.get_advertisements(stamper, 0);
+	check(stamps.size() == 100);
+	for(size_t i=0; i < stamps.size(); i++)
+	{
+		check(stamps[i] > sent_at - milliseconds(5));
+		check(stamps[i] < read_at - milliseconds(40));
+		check(i == 0 || stamps[i] >= stamps[i-1] - microseconds(100));
+	}
+
+	//In real time, packets wait until they are due.
+	packets[1].timestamp = seconds(10);
+	HCIReplay slow(packets);
+	slow.start(HCIReplay::Pacing::RealTime);
+	check(slow.feed() == 1);
+	check(!slow.done());
+	check(slow.next_due_ms() > 9000);
+	slow.start(HCIReplay::Pacing::RealTime, 1e6);
+	usleep(20000);
+	check(slow.feed() == 100);
+}
@@ -1,4 +1,5 @@
 #include <blepp/lescan.h>
+#include <blepp/gap.h>
 #include <string>
 #include <sstream>
 #include <iomanip>
@@ -105,4 +106,107 @@ device: hci0 snap_len: 1500 filter: 0xffffffffffffffff
 	check(r.flags->simultaneous_LE_BR_controller);
 	check(r.flags->simultaneous_LE_BR_host);
 
+	//The same packet, through the zero allocation interface
+	std::vector<uint8_t> packet = to_data("> 04 3E 17 02 01 00 01 0B 57 16 21 76 7C 0B 02 01 1A 07 FF 4C 00 10 02 0A 00 BC");
+	int num_views=0;
+	HCIScanner::parse_packet(packet.data(), packet.size(), [&](const AdvertisingView& v)
+	{
+		num_views++;
+		check(v.address == BLEAddress("7C:76:21:16:57:0B", AddressType::Random));
+		check(v.address.str() == "7c:76:21:16:57:0b");
+		check(v.address.to_uint64() == 0x7c762116570bULL);
+		check(v.rssi == -68);
+
+		std::vector<uint8_t> types;
+		for(const ADStructure& a: v)
+			types.push_back(a.type);
+		check(types.size() == 2);
+		check(types[0] == GAP::flags);
+		check(types[1] == GAP::manufacturer_data);
+
+		boost::optional<ADStructure> m = v.find(GAP::manufacturer_data);
+		check(m);
+		check(m->length == 6);
+		check(equal(vendor_data_1.begin(), vendor_data_1.end(), m->data));
+		check(!v.find(GAP::complete_local_name));
+
+		check(v.materialize().manufacturer_specific_data[0] == vendor_data_1);
+	});
+	check(num_views == 1);
+
+	//And through a sink
+	struct CountingSink: public AdvertisingSink
+	{
+		int count=0;
+		void on_advertisement(const AdvertisingView& v) override
+		{
+			count++;
+			check(v.find(GAP::flags));
+		}
+	} sink;
+	HCIScanner::parse_packet(packet.data(), packet.size(), sink);
+	check(sink.count == 1);
+
+	//AD structure overruns the data: the report is dropped
+	check(HCIScanner::parse_packet(to_data("> 04 3E 17 02 01 00 01 0B 57 16 21 76 7C 0B 02 01 1A 08 FF 4C 00 10 02 0A 00 BC")).empty());
+
+	//32 bit UUIDs, TX power, appearance, service data, LE role and a name
+	packet = to_data("> 04 3E 28 02 01 00 00 06 05 04 03 02 01 1C 05 05 44 33 22 11 02 0A F4 03 19 C1 03 06 16 AA FE 10 20 30 02 1C 00 04 09 61 62 63 C4");
+	r = HCIScanner::parse_packet(packet).back();
+	check(r.UUIDs.size() == 1);
+	check(r.UUIDs[0] == UUID("11223344-0000-1000-8000-00805f9b34fb"));
+	check(r.uuid_32_bit_complete);
+	check(r.tx_power && *r.tx_power == -12);
+	check(r.appearance && *r.appearance == 0x03C1);
+	check(r.service_data_by_uuid.size() == 1);
+	check(r.service_data_by_uuid[0].uuid == UUID(0xFEAA));
+	check((r.service_data_by_uuid[0].data == std::vector<uint8_t>{0x10, 0x20, 0x30}));
+	check(r.service_data.size() == 1);
+	check((r.service_data[0] == std::vector<uint8_t>{0xAA, 0xFE, 0x10, 0x20, 0x30}));
+	check(r.local_name && r.local_name->name == "abc" && r.local_name->complete);
+	check(r.unparsed_data_with_types.size() == 1);
+	check((r.unparsed_data_with_types[0] == std::vector<uint8_t>{GAP::LE_role, 0x00}));
+
+	//The same fields, decoded lazily
+	num_views=0;
+	HCIScanner::parse_packet(packet.data(), packet.size(), [&](const AdvertisingView& v)
+	{
+		num_views++;
+		check(v.indexed);
+		check(v.has(GAP::appearance));
+		check(!v.has(GAP::flags));
+		check(!v.flags());
+		check(*v.tx_power() == -12);
+		check(*v.appearance() == 0x03C1);
+		check(v.local_name()->name == "abc");
+		check(v.uuids().size() == 1);
+		check(v.service_data().size() == 1);
+		check(v.service_data()[0].uuid == UUID(0xFEAA));
+		check(v.find(GAP::LE_role)->length == 1);
+	});
+	check(num_views == 1);
+
+	//More structures than the index holds
+	std::vector<uint8_t> many;
+	for(int i=0; i < AdvertisingView::Index::max_entries + 4; i++)
+	{
+		many.push_back(2);
+		many.push_back(0x80 + i);
+		many.push_back(i);
+	}
+	AdvertisingView v;
+	v.data = many.data();
+	v.length = many.size();
+	check(!v.indexed);
+	check(v.find(0x80 + AdvertisingView::Index::max_entries + 2)->data[0] == AdvertisingView::Index::max_entries + 2);
+	check(v.build_index());
+	check(v.index.overflowed);
+	check(v.find(0x80 + AdvertisingView::Index::max_entries + 2)->data[0] == AdvertisingView::Index::max_entries + 2);
+	check(v.find(0x81)->data[0] == 1);
+	check(!v.find(0x7F));
+	many[0] = 200;
+	check(!v.build_index());
+
+	check(std::string(ad_type_name(GAP::complete_local_name)) == "Complete Local Name");
+	check(std::string(ad_type_name(0xF0)) == "Unknown");
 }
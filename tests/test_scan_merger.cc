@@ -0,0 +1,157 @@
+#include <blepp/scan_merger.h>
+#include <blepp/hci_replay.h>
+#include <blepp/gap.h>
+#include "hci_packets.h"
+#include <iostream>
+#include <cstdlib>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+typedef steady_clock::time_point Time;
+
+//An advertising report from device n.
+vector<uint8_t> report(uint8_t n, LeAdvertisingEventType type, const vector<uint8_t>& ad)
+{
+	return advertising_report(device(n), ad, -64, type);
+}
+
+const vector<uint8_t> advert_data = {0x02, GAP::flags, 0x06, 0x03, GAP::complete_list_of_16_bit_UUIDs, 0x0f, 0x18};
+const vector<uint8_t> response_data = {0x06, GAP::complete_local_name, 'b', 'l', 'e', 'p', 'p'};
+
+struct Collect: public AdvertisingSink
+{
+	vector<AdvertisingResponse> adverts;
+
+	void on_advertisement(const AdvertisingView& a) override
+	{
+		adverts.push_back(a.materialize());
+	}
+};
+
+void add(ScanResponseMerger& m, const vector<uint8_t>& packet, Time t, AdvertisingSink& out)
+{
+	struct Forward: public AdvertisingSink
+	{
+		ScanResponseMerger& m;
+		AdvertisingSink& out;
+		Forward(ScanResponseMerger& m_, AdvertisingSink& o):m(m_),out(o){}
+		void on_advertisement(const AdvertisingView& a) override { m.add(a, out); }
+	} f(m, out);
+
+	HCIScanner::parse_packet(packet.data(), packet.size(), f, t);
+}
+
+int main()
+{
+	log_level = LogLevels::Error;
+	Time t0;
+	Collect c;
+
+	//An advert and its response become one report, with the advert's 
+	//type and time and everything from both.
+	ScanResponseMerger m(milliseconds(50));
+	add(m, report(1, LeAdvertisingEventType::ADV_IND, advert_data), t0, c);
+	check(c.adverts.empty());
+	check(m.pending() == 1);
+	add(m, report(1, LeAdvertisingEventType::SCAN_RSP, response_data), t0 + milliseconds(2), c);
+	check(c.adverts.size() == 1);
+	check(c.adverts[0].type == LeAdvertisingEventType::ADV_IND);
+	check(c.adverts[0].timestamp == t0);
+	check(c.adverts[0].local_name && c.adverts[0].local_name->name == "blepp");
+	check(c.adverts[0].UUIDs.size() == 1);
+	check(c.adverts[0].flags);
+	check(m.merged() == 1);
+	check(m.pending() == 0);
+
+	//Zero padding ends the advert's data, so it's dropped to keep the
+	//response reachable.
+	c.adverts.clear();
+	vector<uint8_t> padded = advert_data;
+	padded.resize(31, 0);
+	add(m, report(1, LeAdvertisingEventType::ADV_IND, padded), t0, c);
+	add(m, report(1, LeAdvertisingEventType::SCAN_RSP, response_data), t0 + milliseconds(2), c);
+	check(c.adverts.size() == 1);
+	check(c.adverts[0].local_name && c.adverts[0].local_name->name == "blepp");
+	check(c.adverts[0].UUIDs.size() == 1);
+	check(c.adverts[0].flags);
+
+	//Without a response, the advert is released when the window runs out, 
+	//either because of a later report or an explicit release.
+	c.adverts.clear();
+	add(m, report(2, LeAdvertisingEventType::ADV_SCAN_IND, advert_data), t0, c);
+	Time deadline;
+	check(m.next_deadline(deadline) && deadline == t0 + milliseconds(50));
+	m.release(t0 + milliseconds(49), c);
+	check(c.adverts.empty());
+	m.release(t0 + milliseconds(50), c);
+	check(c.adverts.size() == 1);
+	check(!c.adverts[0].local_name);
+	check(m.timed_out() == 1);
+
+	add(m, report(3, LeAdvertisingEventType::ADV_IND, advert_data), t0, c);
+	add(m, report(4, LeAdvertisingEventType::ADV_NONCONN_IND, advert_data), t0 + milliseconds(60), c);
+	check(c.adverts.size() == 3);
+	check(c.adverts[1].address.str() == "55:44:33:22:11:03");
+	check(c.adverts[2].address.str() == "55:44:33:22:11:04");
+
+	//A response from the wrong device, or with no advert waiting, passes through.
+	c.adverts.clear();
+	add(m, report(5, LeAdvertisingEventType::ADV_IND, advert_data), t0, c);
+	add(m, report(6, LeAdvertisingEventType::SCAN_RSP, response_data), t0, c);
+	check(c.adverts.size() == 1);
+	check(c.adverts[0].type == LeAdvertisingEventType::SCAN_RSP);
+	m.release_all(c);
+	check(c.adverts.size() == 2);
+
+	//When full, the oldest is released early.
+	c.adverts.clear();
+	ScanResponseMerger small(milliseconds(50), 2);
+	add(small, report(1, LeAdvertisingEventType::ADV_IND, advert_data), t0, c);
+	add(small, report(2, LeAdvertisingEventType::ADV_IND, advert_data), t0 + milliseconds(1), c);
+	add(small, report(3, LeAdvertisingEventType::ADV_IND, advert_data), t0 + milliseconds(2), c);
+	check(c.adverts.size() == 1);
+	check(c.adverts[0].address.str() == "55:44:33:22:11:01");
+	check(small.pending() == 2);
+
+	//Through a scanner: the duplicate filter sees one report per device.
+	vector<HCIReplay::Packet> packets;
+	for(int i=0; i < 10; i++)
+		for(uint8_t n=0; n < 20; n++)
+		{
+			packets.push_back({microseconds(0), report(n, LeAdvertisingEventType::ADV_IND, advert_data)});
+			packets.push_back({microseconds(0), report(n, LeAdvertisingEventType::SCAN_RSP, response_data)});
+		}
+	packets.push_back({microseconds(0), report(99, LeAdvertisingEventType::ADV_IND, advert_data)});
+
+	HCIReplay replay(packets);
+	HCIScanner scanner(replay.get_fd(), HCIScanner::FilterDuplicates::Software);
+	//Generous, so the last advert isn't released early on a loaded machine.
+	scanner.set_scan_response_merging(milliseconds(500));
+	check(scanner.next_timeout_ms() == -1);
+	replay.feed();
+
+	Collect d;
+	for(int i=0; i < 3; i++)
+		scanner.get_advertisements(d, 0);
+	check(d.adverts.size() == 20);
+	for(const auto& a: d.adverts)
+		check(a.local_name && a.type == LeAdvertisingEventType::ADV_IND);
+
+	//The last one has no response, and comes out after the window.
+	check(scanner.next_timeout_ms() > 0);
+	check(scanner.next_timeout_ms() <= 501);
+	scanner.get_advertisements(d, -1);
+	check(d.adverts.size() == 21);
+	check(!d.adverts[20].local_name);
+	check(scanner.scan_response_merger()->merged() == 200);
+	check(scanner.next_timeout_ms() == -1);
+}
@@ -0,0 +1,148 @@
+#include <blepp/lescan.h>
+#include <blepp/hci_replay.h>
+#include "hci_packets.h"
+#include <iostream>
+#include <cstdlib>
+#include <stdexcept>
+#include <unistd.h>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+typedef HCIScanner::ScanParameters ScanParameters;
+
+bool valid(uint16_t interval, uint16_t window, uint8_t filter_policy=0)
+{
+	ScanParameters p;
+	p.interval = interval;
+	p.window = window;
+	p.filter_policy = filter_policy;
+	try
+	{
+		p.validate();
+		return true;
+	}
+	catch(std::invalid_argument&)
+	{
+		return false;
+	}
+}
+
+int main()
+{
+	log_level = LogLevels::Error;
+
+	//Limits from 4.0/2/E.7.8.10: 2.5ms to 10.24s, and the window can't
+	//be longer than the interval.
+	check(valid(0x0004, 0x0004));
+	check(valid(0x4000, 0x4000));
+	check(valid(0x4000, 0x0004));
+	check(!valid(0x0003, 0x0003));
+	check(!valid(0x4001, 0x0010));
+	check(!valid(0x0010, 0x0003));
+	check(!valid(0x4001, 0x4001));
+	check(!valid(0x0010, 0x0011));
+	check(!valid(0x0010, 0x0010, 2));
+	check(valid(0x0010, 0x0010, 1));
+
+	//The presets are what they say they are, in units of 0.625ms.
+	ScanParameters c = ScanParameters::continuous(), b = ScanParameters::balanced(), l = ScanParameters::low_duty();
+	check(c.interval == 0x0010 && c.window == 0x0010);  //10ms/10ms
+	check(b.interval == 0x0060 && b.window == 0x0030);  //30ms every 60ms
+	check(l.interval == 0x0640 && l.window == 0x0050);  //50ms every 1s
+	for(const ScanParameters& p: {c, b, l})
+	{
+		p.validate();
+		check(p.own_address_type == AddressType::Public);
+		check(p.filter_policy == 0);
+	}
+	check(c == ScanParameters());
+	check(!(b == c));
+
+	//Bad parameters are rejected before an adapter is touched.
+	ScanParameters bad;
+	bad.window = 0x0020;
+	bool threw=false;
+	try
+	{
+		HCIScanner s(false, HCIScanner::FilterDuplicates::Off, HCIScanner::ScanType::Passive, "", bad);
+	}
+	catch(std::invalid_argument&)
+	{
+		threw = true;
+	}
+	check(threw);
+
+	//Through a scanner: the parameters in use are the ones given, and
+	//adverts are counted against the configuration they arrived under.
+	vector<HCIReplay::Packet> packets;
+	for(int i=0; i < 10; i++)
+		packets.push_back({microseconds(0), advertising_report(device(i), name_ad("blepp"))});
+	HCIReplay replay(packets);
+	HCIScanner scanner(replay.get_fd(), HCIScanner::FilterDuplicates::Off);
+	check(scanner.get_scan_parameters() == c);
+
+	auto deliver = [&]()
+	{
+		replay.start();
+		replay.feed();
+		return scanner.get_advertisements(1000).size();
+	};
+
+	check(deliver() == 10);
+
+	scanner.start(b);
+	check(scanner.get_scan_parameters() == b);
+	check(deliver() == 10);
+	check(deliver() == 10);
+
+	scanner.start(l);
+	check(scanner.get_scan_parameters() == l);
+	check(deliver() == 10);
+
+	//Invalid parameters leave the running scan alone.
+	threw = false;
+	try
+	{
+		scanner.start(bad);
+	}
+	catch(std::invalid_argument&)
+	{
+		threw = true;
+	}
+	check(threw);
+	check(scanner.get_scan_parameters() == l);
+
+	//Back to a configuration which has been seen before.
+	scanner.start(b);
+	check(deliver() == 10);
+	
+	vector<HCIScanner::ScanRate> rates = scanner.scan_rates();
+	check(rates.size() == 3);
+	check(rates[0].parameters == c);
+	check(rates[0].adverts == 10);
+	check(rates[1].parameters == b);
+	check(rates[1].adverts == 30);
+	check(rates[2].parameters == l);
+	check(rates[2].adverts == 10);
+	for(const auto& r: rates)
+	{
+		check(r.scan_type == HCIScanner::ScanType::Passive);
+		check(r.scanning_time > steady_clock::duration::zero());
+		check(r.adverts_per_second() > 0);
+	}
+
+	//Stopped time doesn't count.
+	scanner.stop();
+	rates = scanner.scan_rates();
+	usleep(10000);
+	check(scanner.scan_rates()[1].scanning_time == rates[1].scanning_time);
+}
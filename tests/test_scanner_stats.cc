@@ -0,0 +1,152 @@
+#include <blepp/lescan.h>
+#include "hci_packets.h"
+#include <blepp/hci_replay.h>
+#include <iostream>
+#include <cstdlib>
+#include <memory>
+#include <unistd.h>
+
+using namespace BLEPP;
+using namespace std;
+using namespace std::chrono;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+int main()
+{
+	log_level = LogLevels::Error;
+
+	vector<uint8_t> good = advertising_report(device(1), name_ad("blepp"));
+
+	//The AD structure claims to be longer than the payload.
+	vector<uint8_t> corrupt = good;
+	corrupt[14] = 0x09;
+
+	//The event length doesn't match the packet.
+	vector<uint8_t> malformed = good;
+	malformed[2] = 0x20;
+
+	vector<HCIReplay::Packet> packets;
+	for(int i=0; i < 300; i++)
+		packets.push_back({microseconds(0), good});
+	packets.push_back({microseconds(0), corrupt});
+	packets.push_back({microseconds(0), malformed});
+	packets.push_back({microseconds(0), good});
+
+	HCIReplay replay(packets);
+	HCIScanner scanner(replay.get_fd(), HCIScanner::FilterDuplicates::Off);
+
+	scanner.set_receive_buffer(1 << 20);
+	check(scanner.receive_buffer() >= (1 << 20));
+
+	replay.feed();
+
+	HCIScanner::ScannerStats s = scanner.stats();
+	check(s.packets == 0);
+	check(s.receive_buffer == scanner.receive_buffer());
+
+	int count=0;
+	auto report = [&](const AdvertisingView&){ count++; };
+	auto sink = make_advertising_sink(report);
+
+	//More than one read's worth is waiting.
+	scanner.get_advertisements(sink, 0);
+	check(count == HCIScanner::max_events_per_read);
+	s = scanner.stats();
+	check(s.full_reads == 1);
+	check(s.packets == HCIScanner::max_events_per_read);
+
+	//The malformed packet is dropped, without losing the ones either side.
+	scanner.get_advertisements(sink, 0);
+	check(count == 301);
+
+	s = scanner.stats();
+	check(s.packets == 303);
+	check(s.adverts == 301);
+	check(s.corrupt_adverts == 1);
+	check(s.malformed_packets == 1);
+	check(s.full_reads == 1);
+	check(s.ring_overflows == 0);
+	check(s.kernel_drops == 0);
+	check(s.lost() == 0);
+	check(s.refreshes == 0);
+
+	//The vector interface keeps what was parsed before a bad packet.
+	{
+		HCIReplay r({{microseconds(0), good}, {microseconds(0), malformed}, {microseconds(0), good}});
+		HCIScanner sc(r.get_fd(), HCIScanner::FilterDuplicates::Off);
+		r.feed();
+		check(sc.get_advertisements(0).size() == 2);
+		check(sc.stats().malformed_packets == 1);
+	}
+
+	//Closing the source is reported, rather than polling readable forever.
+	//Packets already sent are delivered first.
+	for(int threaded=0; threaded < 2; threaded++)
+	{
+		unique_ptr<HCIReplay> r(new HCIReplay({{microseconds(0), good}}));
+		HCIScanner sc(r->get_fd(), HCIScanner::FilterDuplicates::Off);
+		if(threaded)
+			sc.start_capture_thread();
+		r->feed();
+		r.reset();
+
+		size_t got=0;
+		bool closed=false;
+		for(int i=0; i < 10 && !closed; i++)
+		{
+			try
+			{
+				got += sc.get_advertisements(1000).size();
+			}
+			catch(HCIScanner::Closed&)
+			{
+				closed = true;
+			}
+		}
+		check(closed);
+		check(got == 1);
+	}
+
+	//Periodic refresh: each device is reported again once per interval.
+	HCIReplay one({{microseconds(0), good}});
+	HCIScanner refreshing(one.get_fd(), HCIScanner::FilterDuplicates::Software);
+	refreshing.set_refresh_interval(milliseconds(30));
+	check(refreshing.next_timeout_ms() > 0 && refreshing.next_timeout_ms() <= 31);
+
+	auto send = [&]()
+	{
+		one.start();
+		one.feed();
+		refreshing.get_advertisements(sink, 0);
+	};
+
+	count = 0;
+	send();
+	send();
+	check(count == 1);
+
+	usleep(35000);
+	check(refreshing.next_timeout_ms() == 0);
+	send();
+	check(count == 1);
+	check(refreshing.stats().refreshes == 1);
+	check(refreshing.next_timeout_ms() > 0);
+	send();
+	check(count == 2);
+	send();
+	check(count == 2);
+
+	//Blocking waits wake up for the refresh.
+	refreshing.get_advertisements(sink, -1);
+	s = refreshing.stats();
+	check(s.refreshes == 2);
+	check(s.max_refresh_gap == steady_clock::duration::zero());
+	send();
+	check(count == 3);
+}
@@ -0,0 +1,137 @@
+#include <blepp/telemetry.h>
+#include "hci_packets.h"
+#include <blepp/gap.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <cstdlib>
+#include <cmath>
+#include <iostream>
+
+using namespace BLEPP;
+using namespace std;
+
+#define check(X) do{\
+if(!(X))\
+{\
+	std::cerr << "Test failed on line " << __LINE__ << ": " << #X << std::endl;\
+	exit(1);\
+}}while(0)
+
+struct Collect: public ReadingSink
+{
+	vector<Reading> readings;
+	vector<vector<uint8_t>> bytes;
+
+	void on_reading(const Reading& r) override
+	{
+		readings.push_back(r);
+		bytes.push_back(vector<uint8_t>(r.data, r.data + r.length));
+	}
+
+	int find(Reading::Type t)
+	{
+		for(size_t i=0; i < readings.size(); i++)
+			if(readings[i].type == t)
+				return i;
+		return -1;
+	}
+};
+
+int decode(const TelemetryRegistry& reg, const vector<uint8_t>& ad, Collect& c)
+{
+	vector<uint8_t> packet = advertising_report(BLEAddress("06:05:04:03:02:01", AddressType::Random), ad, -50, LeAdvertisingEventType::ADV_NONCONN_IND);
+	int decoded=-1;
+	HCIScanner::parse_packet(packet.data(), packet.size(), [&](const AdvertisingView& v)
+	{
+		decoded = reg.decode(v, c);
+
+		//The materialized path gives the same answer.
+		Collect c2;
+		check(reg.decode(v.materialize(), c2) == decoded);
+		check(c2.readings.size() == c.readings.size());
+	});
+	return decoded;
+}
+
+int main()
+{
+	TelemetryRegistry reg;
+
+	vector<uint8_t> uuid = {0xE2, 0xC5, 0x6D, 0xB5, 0xDF, 0xFB, 0x48, 0xD2, 0xB0, 0x60, 0xD0, 0xF5, 0xA7, 0x10, 0x96, 0xE0};
+
+	//iBeacon
+	vector<uint8_t> ibeacon = {0x02, GAP::flags, 0x06, 0x1A, GAP::manufacturer_data, 0x4C, 0x00, 0x02, 0x15};
+	ibeacon.insert(ibeacon.end(), uuid.begin(), uuid.end());
+	ibeacon.insert(ibeacon.end(), {0x01, 0x02, 0x00, 0x07, 0xC5});
+	{
+		Collect c;
+		check(decode(reg, ibeacon, c) == 1);
+		check(c.readings.size() == 4);
+		check(string(c.readings[0].source) == "iBeacon");
+		check(c.bytes[c.find(Reading::Identifier)] == uuid);
+		check(c.readings[c.find(Reading::Major)].value == 0x0102);
+		check(c.readings[c.find(Reading::Minor)].value == 7);
+		check(c.readings[c.find(Reading::TxPower)].value == -59);
+	}
+
+	//Eddystone TLM: 3V, 25.5C, 100 adverts, 100s
+	vector<uint8_t> tlm = {0x11, GAP::service_data_16_bit_UUID, 0xAA, 0xFE, 0x20, 0x00, 0x0B, 0xB8, 0x19, 0x80, 0x00, 0x00, 0x00, 0x64, 0x00, 0x00, 0x03, 0xE8};
+	{
+		Collect c;
+		check(decode(reg, tlm, c) == 1);
+		check(c.readings.size() == 4);
+		check(string(c.readings[0].source) == "Eddystone-TLM");
+		check(fabs(c.readings[c.find(Reading::BatteryVoltage)].value - 3.0) < 1e-9);
+		check(c.readings[c.find(Reading::Temperature)].value == 25.5);
+		check(c.readings[c.find(Reading::AdvertCount)].value == 100);
+		check(c.readings[c.find(Reading::Uptime)].value == 100);
+	}
+
+	//Eddystone URL for https://google.com
+	vector<uint8_t> url = {0x0D, GAP::service_data_16_bit_UUID, 0xAA, 0xFE, 0x10, 0xEB, 0x03, 'g', 'o', 'o', 'g', 'l', 'e', 0x07};
+	{
+		Collect c;
+		check(decode(reg, url, c) == 1);
+		int u = c.find(Reading::URL);
+		check(u != -1);
+		check(Telemetry::eddystone_url(c.bytes[u].data(), c.bytes[u].size()) == "https://google.com");
+		check(c.readings[c.find(Reading::TxPower)].value == -21);
+	}
+
+	//Malformed, unknown, and without the built in decoders
+	{
+		Collect c;
+		vector<uint8_t> bad = {0x05, GAP::manufacturer_data, 0x4C, 0x00, 0x02, 0x15};
+		check(decode(reg, bad, c) == 0);
+		check(reg.malformed() == 2); //Once for each path
+		check(c.readings.empty());
+
+		vector<uint8_t> other = {0x05, GAP::manufacturer_data, 0x59, 0x00, 0x02, 0x15};
+		check(decode(reg, other, c) == 0);
+		check(reg.malformed() == 2);
+
+		TelemetryRegistry empty(false);
+		check(decode(empty, ibeacon, c) == 0);
+	}
+
+	//A vendor decoder for 32 bit service data
+	{
+		TelemetryRegistry custom(false);
+		UUID vendor;
+		bt_uuid32_create(&vendor, 0x11223344);
+		custom.add_service_decoder(vendor, [](const uint8_t* d, size_t n, ReadingSink& s)
+		{
+			if(n != 2)
+				return false;
+			s.on_reading(Reading{"Vendor", Reading::Temperature, static_cast<int16_t>(d[0] | (d[1] << 8)) / 100.0, nullptr, 0});
+			return true;
+		});
+
+		Collect c;
+		vector<uint8_t> v = {0x07, GAP::service_data_32_bit_UUID, 0x44, 0x33, 0x22, 0x11, 0xD2, 0x04};
+		check(decode(custom, v, c) == 1);
+		check(c.readings.size() == 1);
+		check(c.readings[0].value == 12.34);
+	}
+}